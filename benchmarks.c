@@ -0,0 +1,1436 @@
+
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include "util.h"
+#include "unit_testing.h"
+#include "kernel_sched.h"
+#include "kernel_cc.h"
+#include "symposium.h"
+
+
+/*
+ *
+ *   BENCHMARKS
+ *
+ *   Each benchmark is a test, which reports its measurements by MSG().
+ *   Run them by
+ *      ./benchmarks -c 1,4
+ *   or a single one by
+ *      ./benchmarks -c 1,4 bench_timed_waiters
+ *
+ */
+
+
+/* Host time in msec, either wall-clock or cpu time of the whole simulator */
+static double bench_time(clockid_t clk)
+{
+	struct timespec ts;
+	clock_gettime(clk, &ts);
+	return ts.tv_sec*1E3 + ts.tv_nsec*1E-6;
+}
+
+#define wall_time() bench_time(CLOCK_MONOTONIC)
+#define cpu_time() bench_time(CLOCK_PROCESS_CPUTIME_ID)
+
+
+
+/*
+	bench_timed_waiters
+
+	Many threads sleep at the same time with a timeout, so that the scheduler
+	keeps many timeouts registered. We measure the time to put all of them
+	to sleep, and how late they wake up.
+ */
+
+#define TIMED_WAITERS 10000
+
+static Mutex tw_mx = MUTEX_INIT;
+static CondVar tw_cv = COND_INIT;
+static CondVar tw_all = COND_INIT;
+static int tw_asleep;
+static double tw_late;
+
+static int timed_waiter(int argl, void* args)
+{
+	/* Timeouts are spread over 500 to 1500 msec */
+	timeout_t timeout = 500 + (argl*7919) % 1000;
+
+	Mutex_Lock(&tw_mx);
+	if(++tw_asleep == TIMED_WAITERS) Cond_Signal(&tw_all);
+	double t0 = wall_time();
+	Cond_TimedWait(&tw_mx, &tw_cv, timeout);
+	tw_late += wall_time() - t0 - timeout;
+	Mutex_Unlock(&tw_mx);
+	return 0;
+}
+
+BOOT_TEST(bench_timed_waiters,
+	"Put 10000 threads to sleep with a timeout and measure the cost of registering\n"
+	"and expiring the timeouts.",
+	.timeout = 120
+	)
+{
+	static Tid_t tids[TIMED_WAITERS];
+	tw_asleep = 0;
+	tw_late = 0.0;
+
+	double w0 = wall_time(), c0 = cpu_time();
+
+	for(int i=0; i<TIMED_WAITERS; i++) {
+		tids[i] = CreateThread(timed_waiter, i, NULL);
+		ASSERT(tids[i] != NOTHREAD);
+	}
+	/* When we get the mutex back, the last waiter is asleep */
+	Mutex_Lock(&tw_mx);
+	while(tw_asleep < TIMED_WAITERS) Cond_Wait(&tw_mx, &tw_all);
+	Mutex_Unlock(&tw_mx);
+
+	double w1 = wall_time(), c1 = cpu_time();
+
+	for(int i=0; i<TIMED_WAITERS; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	double w2 = wall_time(), c2 = cpu_time();
+
+	MSG("%d waiters asleep in %.1f msec (cpu %.1f msec)\n", TIMED_WAITERS, w1-w0, c1-c0);
+	MSG("all woken up in %.1f msec (cpu %.1f msec), mean lateness %.2f msec\n",
+		w2-w1, c2-c1, tw_late/TIMED_WAITERS);
+	return 0;
+}
+
+
+
+/*
+	bench_idle_cpu
+
+	The VM sleeps for one second. We measure the host cpu time that 
+	the simulator spends meanwhile.
+ */
+
+BOOT_TEST(bench_idle_cpu,
+	"Sleep for one second and measure the host cpu time used by the simulator."
+	)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	double w0 = wall_time(), c0 = cpu_time();
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 1000);
+	Mutex_Unlock(&mx);
+	double w1 = wall_time(), c1 = cpu_time();
+
+	MSG("slept %.1f msec, using %.1f msec of cpu\n", w1-w0, c1-c0);
+	return 0;
+}
+
+
+/*
+	bench_pipe_latency
+
+	A producer thread writes a timestamp into a pipe every few msec. 
+	The consumer thread is blocked on the pipe each time, and measures the
+	time from the write until it runs again.
+ */
+
+#define LATENCY_ROUNDS 200
+
+static int latency_consumer(int argl, void* args)
+{
+	Fid_t rfid = argl;
+	double* stats = args;    /* sum, max */
+	double t;
+
+	for(int i=0; i<LATENCY_ROUNDS; i++) {
+		ASSERT(Read(rfid, (char*)&t, sizeof(t)) == sizeof(t));
+		double lat = wall_time() - t;
+		stats[0] += lat;
+		if(lat > stats[1]) stats[1] = lat;
+	}
+	return 0;
+}
+
+BOOT_TEST(bench_pipe_latency,
+	"Measure the time from a pipe write until the blocked reader runs.",
+	.timeout = 60
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	double stats[2] = { 0.0, 0.0 };
+	Tid_t tid = CreateThread(latency_consumer, pipe.read, stats);
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	for(int i=0; i<LATENCY_ROUNDS; i++) {
+		/* Give the reader time to block */
+		Cond_TimedWait(&mx, &cv, 2);
+		double t = wall_time();
+		ASSERT(Write(pipe.write, (char*)&t, sizeof(t))==sizeof(t));
+	}
+	Mutex_Unlock(&mx);
+
+	ASSERT(ThreadJoin(tid, NULL)==0);
+	MSG("wakeup latency: mean %.1f usec, max %.1f usec\n", 
+		1E3*stats[0]/LATENCY_ROUNDS, 1E3*stats[1]);
+	return 0;
+}
+
+
+/*
+	bench_thread_create
+
+	Create and join many short threads, one at a time, and report the rate.
+	Also, report how many threads were spawned on a recycled thread block.
+ */
+
+#define CREATE_ROUNDS 20000
+
+static int empty_task(int argl, void* args) { return argl; }
+
+BOOT_TEST(bench_thread_create,
+	"Measure the rate of creating and joining threads.",
+	.timeout = 60
+	)
+{
+	unsigned long h0, m0, h1, m1;
+	thread_cache_stats(&h0, &m0);
+	double w0 = wall_time(), c0 = cpu_time();
+
+	for(int i=0; i<CREATE_ROUNDS; i++) {
+		int exitval;
+		Tid_t tid = CreateThread(empty_task, i, NULL);
+		ASSERT(tid != NOTHREAD);
+		ASSERT(ThreadJoin(tid, &exitval)==0);
+		ASSERT(exitval == i);
+	}
+
+	double w1 = wall_time(), c1 = cpu_time();
+	thread_cache_stats(&h1, &m1);
+
+	MSG("%d threads in %.1f msec (cpu %.1f msec), %.0f threads/sec\n", 
+		CREATE_ROUNDS, w1-w0, c1-c0, 1E3*CREATE_ROUNDS/(w1-w0));
+	MSG("thread cache: %lu hits, %lu misses\n", h1-h0, m1-m0);
+	return 0;
+}
+
+/*
+	bench_parked_threads
+
+	Many threads with the default stack block on a condition variable. 
+	We measure the resident memory of the simulator while they are parked.
+ */
+
+#define PARKED_THREADS 10000
+
+/* Resident memory of the simulator in KB */
+static long resident_kb()
+{
+	long size, resident;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if(f==NULL) return -1;
+	if(fscanf(f, "%ld %ld", &size, &resident)!=2) resident = -1;
+	fclose(f);
+	return resident * (sysconf(_SC_PAGESIZE)/1024);
+}
+
+static Mutex pk_mx = MUTEX_INIT;
+static CondVar pk_cv = COND_INIT;
+static CondVar pk_all = COND_INIT;
+static int pk_parked;
+static int pk_release;
+
+static int parked_thread(int argl, void* args)
+{
+	Mutex_Lock(&pk_mx);
+	if(++pk_parked == PARKED_THREADS) Cond_Signal(&pk_all);
+	while(! pk_release) Cond_Wait(&pk_mx, &pk_cv);
+	Mutex_Unlock(&pk_mx);
+	return 0;
+}
+
+BOOT_TEST(bench_parked_threads,
+	"Park 10000 threads and measure the resident memory they use.",
+	.timeout = 120
+	)
+{
+	static Tid_t tids[PARKED_THREADS];
+	pk_parked = 0;
+	pk_release = 0;
+
+	long rss0 = resident_kb();
+	for(int i=0; i<PARKED_THREADS; i++) {
+		tids[i] = CreateThread(parked_thread, i, NULL);
+		ASSERT(tids[i] != NOTHREAD);
+	}
+	Mutex_Lock(&pk_mx);
+	while(pk_parked < PARKED_THREADS) Cond_Wait(&pk_mx, &pk_all);
+	long rss1 = resident_kb();
+	pk_release = 1;
+	Cond_Broadcast(&pk_cv);
+	Mutex_Unlock(&pk_mx);
+
+	for(int i=0; i<PARKED_THREADS; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	MSG("%d parked threads: resident memory %.1f MB, %.1f KB per thread\n",
+		PARKED_THREADS, (rss1-rss0)/1024.0, (double)(rss1-rss0)/PARKED_THREADS);
+	return 0;
+}
+
+/*
+	bench_context_switch
+
+	Two contexts switch to each other, with no kernel involved. This 
+	measures the cost of cpu_swap_context() alone (build with FAST_CONTEXT=1
+	to compare the two implementations).
+ */
+
+#define SWITCH_ROUNDS 1000000
+
+static cpu_context_t cs_main, cs_other;
+
+static void cs_partner()
+{
+	while(1)
+		cpu_swap_context(&cs_other, &cs_main);
+}
+
+BARE_TEST(bench_context_switch,
+	"Measure the cost of switching between two cpu contexts."
+	)
+{
+	size_t ss_size = 64*1024;
+	void* stack = malloc(ss_size);
+	ASSERT(stack != NULL);
+	cpu_initialize_context(&cs_other, stack, ss_size, cs_partner);
+
+	double w0 = wall_time();
+	for(int i=0; i<SWITCH_ROUNDS; i++)
+		cpu_swap_context(&cs_main, &cs_other);
+	double w1 = wall_time();
+
+	free(stack);
+	MSG("%d switches in %.1f msec, %.1f nsec per switch\n", 
+		2*SWITCH_ROUNDS, w1-w0, 1E6*(w1-w0)/(2*SWITCH_ROUNDS));
+}
+
+
+/*
+	bench_thread_pingpong
+
+	Two threads take turns through a condition variable, so that every
+	turn is a kernel context switch.
+ */
+
+#define PINGPONG_ROUNDS 100000
+
+static Mutex pp_mx = MUTEX_INIT;
+static CondVar pp_cv = COND_INIT;
+static int pp_turn;
+
+static int pingpong_thread(int argl, void* args)
+{
+	Mutex_Lock(&pp_mx);
+	for(int i=0; i<PINGPONG_ROUNDS; i++) {
+		while(pp_turn != argl) Cond_Wait(&pp_mx, &pp_cv);
+		pp_turn = 1-argl;
+		Cond_Signal(&pp_cv);
+	}
+	Mutex_Unlock(&pp_mx);
+	return 0;
+}
+
+/* The same, but each thread hands the core to the other */
+static int pingpong_yield_thread(int argl, void* args)
+{
+	for(int i=0; i<PINGPONG_ROUNDS; i++) {
+		Mutex_Lock(&pp_mx);
+		while(pp_turn != argl) Cond_Wait(&pp_mx, &pp_cv);
+		pp_turn = 1-argl;
+		Mutex_Unlock(&pp_mx);
+		Cond_SignalYield(&pp_cv);
+	}
+	return 0;
+}
+
+BOOT_TEST(bench_thread_pingpong,
+	"Measure the cost of a switch between two threads that wait for each other.",
+	.timeout = 60
+	)
+{
+	pp_turn = 0;
+	double w0 = wall_time(), c0 = cpu_time();
+	Tid_t t0 = CreateThread(pingpong_thread, 0, NULL);
+	Tid_t t1 = CreateThread(pingpong_thread, 1, NULL);
+	ASSERT(ThreadJoin(t0, NULL)==0);
+	ASSERT(ThreadJoin(t1, NULL)==0);
+	double w1 = wall_time(), c1 = cpu_time();
+
+	MSG("%d turns in %.1f msec (cpu %.1f msec), %.2f usec per turn\n", 
+		2*PINGPONG_ROUNDS, w1-w0, c1-c0, 1E3*(w1-w0)/(2*PINGPONG_ROUNDS));
+
+	/* Again, with Cond_SignalYield */
+	pp_turn = 0;
+	w0 = wall_time(); c0 = cpu_time();
+	t0 = CreateThread(pingpong_yield_thread, 0, NULL);
+	t1 = CreateThread(pingpong_yield_thread, 1, NULL);
+	ASSERT(ThreadJoin(t0, NULL)==0);
+	ASSERT(ThreadJoin(t1, NULL)==0);
+	w1 = wall_time(); c1 = cpu_time();
+
+	MSG("with Cond_SignalYield: %.2f usec per turn (cpu %.1f msec)\n", 
+		1E3*(w1-w0)/(2*PINGPONG_ROUNDS), c1-c0);
+	return 0;
+}
+
+
+/*
+	bench_pipe_pingpong
+
+	Two threads send a byte back and forth over a pair of pipes, and we
+	measure the round-trip time.
+ */
+
+#define PIPE_ROUNDS 50000
+
+static int pipe_echo(int argl, void* args)
+{
+	pipe_t* pipes = args;
+	char c;
+	while(Read(pipes[0].read, &c, 1)==1)
+		Write(pipes[1].write, &c, 1);
+	return 0;
+}
+
+BOOT_TEST(bench_pipe_pingpong,
+	"Measure the round-trip time of a byte over a pair of pipes.",
+	.timeout = 60
+	)
+{
+	pipe_t pipes[2];
+	ASSERT(Pipe(&pipes[0])==0);
+	ASSERT(Pipe(&pipes[1])==0);
+	Tid_t tid = CreateThread(pipe_echo, 0, pipes);
+
+	double w0 = wall_time(), c0 = cpu_time();
+	for(int i=0; i<PIPE_ROUNDS; i++) {
+		char c = (char)i;
+		ASSERT(Write(pipes[0].write, &c, 1)==1);
+		ASSERT(Read(pipes[1].read, &c, 1)==1);
+		ASSERT(c == (char)i);
+	}
+	double w1 = wall_time(), c1 = cpu_time();
+
+	Close(pipes[0].write);
+	ASSERT(ThreadJoin(tid, NULL)==0);
+
+	MSG("%d round trips in %.1f msec (cpu %.1f msec), %.2f usec per round trip\n", 
+		PIPE_ROUNDS, w1-w0, c1-c0, 1E3*(w1-w0)/PIPE_ROUNDS);
+	return 0;
+}
+
+
+
+/*
+	bench_policy_mix
+
+	CPU-bound threads spin, while an interactive thread reads timestamps
+	from a pipe, as in bench_pipe_latency. We report the wakeup latency
+	percentiles of the interactive thread and the work done by the spinners.
+	Compare the scheduling policies by
+	   TINYOS_SCHED=rr ./benchmarks -c 1,4 bench_policy_mix
+ */
+
+#define MIX_SPINNERS 4
+#define MIX_ROUNDS 300
+
+static volatile int mix_stop;
+
+static int mix_spinner(int argl, void* args)
+{
+	unsigned long* work = args;
+	unsigned long n = 0;
+	while(! mix_stop) n++;
+	*work = n;
+	return 0;
+}
+
+static int mix_consumer(int argl, void* args)
+{
+	Fid_t rfid = argl;
+	double* lat = args;
+	double t;
+
+	for(int i=0; i<MIX_ROUNDS; i++) {
+		ASSERT(Read(rfid, (char*)&t, sizeof(t)) == sizeof(t));
+		lat[i] = wall_time() - t;
+	}
+	return 0;
+}
+
+static int cmp_double(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+BOOT_TEST(bench_policy_mix,
+	"Measure the wakeup latency of an interactive thread among CPU-bound threads.",
+	.timeout = 60
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	static double lat[MIX_ROUNDS];
+	static unsigned long work[MIX_SPINNERS];
+	Tid_t spinner[MIX_SPINNERS];
+
+	mix_stop = 0;
+	double w0 = wall_time();
+	for(int i=0; i<MIX_SPINNERS; i++)
+		spinner[i] = CreateThread(mix_spinner, 0, &work[i]);
+	Tid_t tid = CreateThread(mix_consumer, pipe.read, lat);
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	for(int i=0; i<MIX_ROUNDS; i++) {
+		Cond_TimedWait(&mx, &cv, 2);
+		double t = wall_time();
+		ASSERT(Write(pipe.write, (char*)&t, sizeof(t))==sizeof(t));
+	}
+	Mutex_Unlock(&mx);
+	ASSERT(ThreadJoin(tid, NULL)==0);
+
+	mix_stop = 1;
+	unsigned long total = 0;
+	for(int i=0; i<MIX_SPINNERS; i++) {
+		ASSERT(ThreadJoin(spinner[i], NULL)==0);
+		total += work[i];
+	}
+	double w1 = wall_time();
+
+	qsort(lat, MIX_ROUNDS, sizeof(double), cmp_double);
+	MSG("policy %s: latency p50 %.1f usec, p99 %.1f usec, max %.1f usec\n", SCHED->name,
+		1E3*lat[MIX_ROUNDS/2], 1E3*lat[MIX_ROUNDS*99/100], 1E3*lat[MIX_ROUNDS-1]);
+	MSG("policy %s: spinner work %.1f M/sec\n", SCHED->name, 1E-3*total/(w1-w0));
+	return 0;
+}
+
+
+
+/*
+	bench_fair_share
+
+	Three processes spin at the same time: A with 1 thread, B with 8 threads,
+	and C with 1 thread and nice 5. We report the share of the cpu that each 
+	one got. Under the fair policy, on one core, A and B should get the same
+	share, and C about a third of it. On more cores, A cannot get more than
+	one core, and B and C share the rest by weight (on 4 cores, about 25%, 
+	56% and 19%).
+ */
+
+#define SHARE_TIME 1000
+
+static volatile int share_stop;
+
+static int share_spinner(int argl, void* args)
+{
+	while(! share_stop);
+	return 0;
+}
+
+typedef struct { int nice; int nthreads; } share_args;
+
+static int share_process(int argl, void* args)
+{
+	share_args* a = args;
+	ASSERT(SetNice(NOPROC, a->nice)==0);
+	for(int i=1; i<a->nthreads; i++)
+		CreateThread(share_spinner, 0, NULL);
+	share_spinner(0, NULL);
+	return 0;
+}
+
+static unsigned long share_run_time(Pid_t pid)
+{
+	Fid_t finfo = OpenInfo();
+	procinfo info;
+	unsigned long t = 0;
+	while(Read(finfo, (char*)&info, sizeof(info)) == sizeof(info))
+		if(info.pid == pid) t = info.run_time;
+	Close(finfo);
+	return t;
+}
+
+BOOT_TEST(bench_fair_share,
+	"Measure the cpu share of processes with different numbers of threads.",
+	.timeout = 60
+	)
+{
+	share_args share[3] = { { 0, 1 }, { 0, 8 }, { 5, 1 } };
+	Pid_t pid[3];
+
+	share_stop = 0;
+	for(int i=0;i<3;i++)
+		pid[i] = Exec(share_process, sizeof(share[i]), &share[i]);
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, SHARE_TIME);
+	Mutex_Unlock(&mx);
+
+	unsigned long t[3], total = 0;
+	for(int i=0;i<3;i++)
+		total += (t[i] = share_run_time(pid[i]));
+
+	share_stop = 1;
+	for(int i=0;i<3;i++)
+		ASSERT(WaitChild(pid[i], NULL)==pid[i]);
+
+	MSG("policy %s: A (1 thread) %.1f%%, B (8 threads) %.1f%%, C (1 thread, nice 5) %.1f%%\n",
+		SCHED->name, 100.0*t[0]/total, 100.0*t[1]/total, 100.0*t[2]/total);
+	return 0;
+}
+
+
+
+/*
+	bench_edf_heartbeat
+
+	A heartbeat thread wakes up every HB_PERIOD msec and does a little work,
+	while a symposium of threads loads all cores. We count the periods 
+	where the work was not done within HB_DEADLINE msec from the start of
+	the period, first with a normal thread and then with a deadline thread.
+ */
+
+#define HB_PERIOD 10
+#define HB_DEADLINE 5
+#define HB_ROUNDS 100
+
+static volatile int hb_done;
+
+static int heartbeat(int argl, void* args)
+{
+	double* stats = args;   /* misses, max response, jobs, kernel misses */
+	if(argl)
+		ASSERT(SetDeadline(2000, HB_PERIOD*1000, HB_DEADLINE*1000)==0);
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	double start = wall_time();
+	Mutex_Lock(&mx);
+	for(int i=0; i<HB_ROUNDS; i++) {
+		double release = start + i*HB_PERIOD;
+		double now = wall_time();
+		if(now < release)
+			Cond_TimedWait(&mx, &cv, (timeout_t)(release-now+0.5));
+		fibo(15);
+		double resp = wall_time() - release;
+		if(resp > HB_DEADLINE) stats[0]++;
+		if(resp > stats[1]) stats[1] = resp;
+	}
+	Mutex_Unlock(&mx);
+
+	deadline_info info;
+	if(GetDeadlineInfo(&info)==0) {
+		stats[2] = info.jobs;
+		stats[3] = info.misses;
+	}
+	return 0;
+}
+
+BOOT_TEST(bench_edf_heartbeat,
+	"Measure the deadline misses of a periodic thread under a symposium of threads.",
+	.timeout = 120
+	)
+{
+	/* The symposium prints to stdout, silence it */
+	fflush(stdout);
+	int saved_stdout = dup(1);
+	int devnull = open("/dev/null", O_WRONLY);
+	dup2(devnull, 1);
+	close(devnull);
+
+	for(int edf=0; edf<=1; edf++) {
+		symposium_t symp = { .N = 4*cpu_cores()+1, .bites = 10 };
+		adjust_symposium(&symp, -2, 0);
+		Pid_t bg = Exec(SymposiumOfThreads, sizeof(symp), &symp);
+
+		double stats[4] = { 0.0, 0.0, 0.0, 0.0 };
+		Tid_t t = CreateThread(heartbeat, edf, stats);
+		ASSERT(ThreadJoin(t, NULL)==0);
+		ASSERT(WaitChild(bg, NULL)==bg);
+
+		MSG("%s thread: %.0f of %d periods late, max response %.1f msec",
+			edf ? "deadline" : "normal", stats[0], HB_ROUNDS, stats[1]);
+		if(edf) MSG(", kernel counted %.0f misses in %.0f jobs", stats[3], stats[2]);
+		MSG("\n");
+	}
+
+	fflush(stdout);
+	dup2(saved_stdout, 1);
+	close(saved_stdout);
+	return 0;
+}
+
+
+
+/*
+	bench_pipeline
+
+	A producer, a filter and a consumer are connected by two pipes, and
+	the filter does some work on each chunk. Spinning threads load the 
+	cores at the same time. We report the end-to-end throughput, with the
+	MLFQ heuristics for pipe sleeps and mutex yields turned off and then on 
+	(see mlfq_cause_adjust).
+ */
+
+#define PIPELINE_CHUNK 512
+#define PIPELINE_BYTES (4<<20)
+#define PIPELINE_SPINNERS 3
+
+static volatile int pl_stop;
+
+static int pl_spinner(int argl, void* args)
+{
+	while(! pl_stop);
+	return 0;
+}
+
+static int pl_producer(int argl, void* args)
+{
+	Fid_t out = argl;
+	char buf[PIPELINE_CHUNK];
+	memset(buf, 'x', sizeof(buf));
+	for(int sent=0; sent < PIPELINE_BYTES; sent += PIPELINE_CHUNK)
+		ASSERT(Write(out, buf, PIPELINE_CHUNK)==PIPELINE_CHUNK);
+	Close(out);
+	return 0;
+}
+
+static int pl_filter(int argl, void* args)
+{
+	pipe_t* pipes = args;
+	char buf[PIPELINE_CHUNK];
+	int n;
+	while((n = Read(pipes[0].read, buf, sizeof(buf))) > 0) {
+		/* Some work on the chunk */
+		unsigned int h = 0;
+		for(int k=0; k<20; k++)
+			for(int i=0; i<n; i++) h = h*31 + buf[i];
+		buf[0] = (char)h;
+		int w = 0;
+		while(w < n) w += Write(pipes[1].write, buf+w, n-w);
+	}
+	Close(pipes[1].write);
+	return 0;
+}
+
+static double pl_run()
+{
+	pipe_t pipes[2];
+	ASSERT(Pipe(&pipes[0])==0);
+	ASSERT(Pipe(&pipes[1])==0);
+
+	pl_stop = 0;
+	Tid_t spinner[PIPELINE_SPINNERS];
+	for(int i=0; i<PIPELINE_SPINNERS; i++)
+		spinner[i] = CreateThread(pl_spinner, 0, NULL);
+
+	double t0 = wall_time();
+	Tid_t prod = CreateThread(pl_producer, pipes[0].write, NULL);
+	Tid_t filt = CreateThread(pl_filter, 0, pipes);
+
+	char buf[PIPELINE_CHUNK];
+	int n;
+	long total = 0;
+	while((n = Read(pipes[1].read, buf, sizeof(buf))) > 0)
+		total += n;
+	double t1 = wall_time();
+	ASSERT(total == PIPELINE_BYTES);
+
+	ASSERT(ThreadJoin(prod, NULL)==0);
+	ASSERT(ThreadJoin(filt, NULL)==0);
+	pl_stop = 1;
+	for(int i=0; i<PIPELINE_SPINNERS; i++)
+		ASSERT(ThreadJoin(spinner[i], NULL)==0);
+	Close(pipes[0].read);
+	Close(pipes[1].read);
+
+	return (PIPELINE_BYTES/1048576.0) / ((t1-t0)*1E-3);
+}
+
+BOOT_TEST(bench_pipeline,
+	"Measure the throughput of a producer-filter-consumer pipeline, among spinning threads.",
+	.timeout = 120
+	)
+{
+	int pipe_adj = mlfq_cause_adjust[SCHED_PIPE];
+	int mutex_adj = mlfq_cause_adjust[SCHED_MUTEX];
+
+	mlfq_cause_adjust[SCHED_PIPE] = 0;
+	mlfq_cause_adjust[SCHED_MUTEX] = 0;
+	double plain = pl_run();
+
+	mlfq_cause_adjust[SCHED_PIPE] = pipe_adj;
+	mlfq_cause_adjust[SCHED_MUTEX] = mutex_adj;
+	double tuned = pl_run();
+
+	MSG("policy %s: %.2f MB/s without, %.2f MB/s with the pipe and mutex heuristics\n",
+		SCHED->name, plain, tuned);
+	return 0;
+}
+
+
+/*
+	bench_idle_spin
+
+	Two threads on different cores send a byte back and forth over a pair
+	of pipes, as in bench_pipe_pingpong, so that each core is idle for a
+	short time in each round. We compare the round-trip time and the host 
+	cpu time, with idle polling off and on (see idle_spin_max).
+ */
+
+#define SPIN_ROUNDS 20000
+
+static double spin_run(double* cpu)
+{
+	pipe_t pipes[2];
+	ASSERT(Pipe(&pipes[0])==0);
+	ASSERT(Pipe(&pipes[1])==0);
+	Tid_t tid = CreateThread(pipe_echo, 0, pipes);
+	if(cpu_cores() > 1) {
+		ASSERT(SetThreadAffinity(NOTHREAD, 1)==0);
+		ASSERT(SetThreadAffinity(tid, 2)==0);
+	}
+
+	double w0 = wall_time(), c0 = cpu_time();
+	for(int i=0; i<SPIN_ROUNDS; i++) {
+		char c = (char)i;
+		ASSERT(Write(pipes[0].write, &c, 1)==1);
+		ASSERT(Read(pipes[1].read, &c, 1)==1);
+	}
+	double w1 = wall_time(), c1 = cpu_time();
+
+	Close(pipes[0].write);
+	ASSERT(ThreadJoin(tid, NULL)==0);
+	Close(pipes[0].read);
+	Close(pipes[1].read);
+	Close(pipes[1].write);
+	ASSERT(SetThreadAffinity(NOTHREAD, CORE_MASK_ALL)==0);
+
+	*cpu = c1-c0;
+	return 1E3*(w1-w0)/SPIN_ROUNDS;
+}
+
+BOOT_TEST(bench_idle_spin,
+	"Measure the round-trip time over a pair of pipes between two cores, with and without idle polling.",
+	.timeout = 120
+	)
+{
+	TimerDuration spin_max = idle_spin_max;
+	unsigned long h0, m0, h1, m1;
+	TimerDuration t0, t1;
+	double cpu_off, cpu_on;
+
+	idle_spin_max = 0;
+	double off = spin_run(&cpu_off);
+
+	idle_spin_max = (spin_max > 0) ? spin_max : IDLE_SPIN_MAX;
+	idle_spin_stats(&h0, &m0, &t0);
+	double on = spin_run(&cpu_on);
+	idle_spin_stats(&h1, &m1, &t1);
+	idle_spin_max = spin_max;
+
+	MSG("no polling: %.2f usec per round trip (cpu %.1f msec)\n", off, cpu_off);
+	MSG("polling up to %lu usec: %.2f usec per round trip (cpu %.1f msec)\n", 
+		(spin_max > 0) ? spin_max : IDLE_SPIN_MAX, on, cpu_on);
+	MSG("polling: %lu hits, %lu misses, %.1f msec\n", h1-h0, m1-m0, (t1-t0)*1E-3);
+	return 0;
+}
+
+
+/*
+	bench_core_parking
+
+	A mostly idle machine: a thread wakes up every msec for a little work.
+	We measure the host cpu time with core parking off and on, and how
+	many cores are parked. Then, a burst of spinning threads should bring
+	the parked cores back.
+ */
+
+#define PARK_TICKS 500
+#define PARK_SPINNERS 8
+
+static volatile int park_stop;
+
+static int park_spinner(int argl, void* args)
+{
+	while(! park_stop);
+	return 0;
+}
+
+static unsigned int count_parked()
+{
+	unsigned int n = 0;
+	for(uint c=0; c<cpu_cores(); c++)
+		if(cctx[c].parked) n++;
+	return n;
+}
+
+static double park_idle_run()
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	double c0 = cpu_time();
+	Mutex_Lock(&mx);
+	for(int i=0; i<PARK_TICKS; i++) {
+		fibo(10);
+		Cond_TimedWait(&mx, &cv, 1);
+	}
+	Mutex_Unlock(&mx);
+	return cpu_time()-c0;
+}
+
+BOOT_TEST(bench_core_parking,
+	"Measure the host cpu time of a mostly idle machine with and without core parking, "
+	"and the unparking of cores under a burst of load.",
+	.timeout = 60
+	)
+{
+	int parking = core_parking;
+
+	core_parking = 0;
+	park_idle_run();   /* Unpark everything */
+	double off = park_idle_run();
+
+	core_parking = 1;
+	park_idle_run();   /* Let the cores park */
+	double on = park_idle_run();
+	unsigned int parked = count_parked();
+
+	park_stop = 0;
+	Tid_t t[PARK_SPINNERS];
+	for(int i=0; i<PARK_SPINNERS; i++)
+		t[i] = CreateThread(park_spinner, 0, NULL);
+	double w0 = wall_time();
+	while(count_parked() > 0 && wall_time()-w0 < 5000) 
+		fibo(15);
+	double w1 = wall_time();
+	park_stop = 1;
+	for(int i=0; i<PARK_SPINNERS; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+
+	core_parking = parking;
+
+	MSG("%d ticks: cpu %.1f msec without parking, %.1f msec with %u of %u cores parked\n",
+		PARK_TICKS, off, on, parked, cpu_cores());
+	MSG("all cores unparked %.1f msec after a burst of %d threads\n", w1-w0, PARK_SPINNERS);
+	return 0;
+}
+
+
+/*
+	Run a worker on each core, pinned there, for msec milliseconds. Each 
+	worker gets argl, and a pointer to its own count in counts[], and runs
+	until pinned_stop is set. Returns the sum of the counts.
+ */
+
+static volatile int pinned_stop;
+
+static unsigned long run_pinned(Task worker, int argl, unsigned int msec, unsigned long* counts)
+{
+	uint n = cpu_cores();
+	Tid_t t[n];
+
+	pinned_stop = 0;
+	for(uint c=0; c<n; c++) {
+		counts[c] = 0;
+		t[c] = CreateThread(worker, argl, &counts[c]);
+		ASSERT(SetThreadAffinity(t[c], (core_mask_t)1 << c)==0);
+	}
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, msec);
+	Mutex_Unlock(&mx);
+	pinned_stop = 1;
+
+	unsigned long total = 0;
+	for(uint c=0; c<n; c++) {
+		ASSERT(ThreadJoin(t[c], NULL)==0);
+		total += counts[c];
+	}
+	return total;
+}
+
+
+/*
+	bench_mutex_contention
+
+	One thread per core, pinned, locks a shared mutex with preemption off,
+	as the scheduler locks do, and does a little work inside. We compare
+	the ticket lock of Mutex_Lock with a plain test-and-set spinlock, for 
+	throughput and for fairness: the ratio of the fewest to the most
+	acquisitions by a thread. Run this with -c 1,2,4,...,32.
+ */
+
+#define CONT_MSEC 300
+#define CONT_BATCH 100
+
+static Mutex cont_mx = MUTEX_INIT;
+static volatile char cont_tas;
+static volatile unsigned long cont_shared;
+
+static void tas_lock(volatile char* lock)
+{
+	while(__atomic_test_and_set(lock, __ATOMIC_ACQUIRE))
+		while(__atomic_load_n(lock, __ATOMIC_RELAXED)) 
+			__builtin_ia32_pause();
+}
+
+static void tas_unlock(volatile char* lock)
+{
+	__atomic_clear(lock, __ATOMIC_RELEASE);
+}
+
+static int cont_worker(int argl, void* args)
+{
+	unsigned long* count = args;
+	while(! pinned_stop) {
+		int pre = preempt_off;
+		for(int i=0; i<CONT_BATCH; i++) {
+			if(argl) tas_lock(&cont_tas); else Mutex_Lock(&cont_mx);
+			cont_shared++;
+			for(int j=0; j<20; j++) __builtin_ia32_pause();
+			if(argl) tas_unlock(&cont_tas); else Mutex_Unlock(&cont_mx);
+		}
+		if(pre) preempt_on;
+		*count += CONT_BATCH;
+	}
+	return 0;
+}
+
+static double cont_run(int tas, double* fair)
+{
+	unsigned long count[MAX_CORES];
+	unsigned long total = run_pinned(cont_worker, tas, CONT_MSEC, count);
+
+	unsigned long lo = ULONG_MAX, hi = 0;
+	for(uint c=0; c<cpu_cores(); c++) {
+		if(count[c] < lo) lo = count[c];
+		if(count[c] > hi) hi = count[c];
+	}
+	*fair = (hi > 0) ? (double)lo/hi : 1.0;
+	return (double)total / CONT_MSEC;
+}
+
+BOOT_TEST(bench_mutex_contention,
+	"Measure the throughput and fairness of the ticket mutex against a test-and-set "
+	"spinlock, with one thread per core.",
+	.timeout = 60
+	)
+{
+	double tas_fair, ticket_fair;
+	double tas = cont_run(1, &tas_fair);
+	double ticket = cont_run(0, &ticket_fair);
+
+	MSG("%u cores: test-and-set %.0f locks/msec (fairness %.2f), ticket %.0f locks/msec (fairness %.2f)\n",
+		cpu_cores(), tas, tas_fair, ticket, ticket_fair);
+	return 0;
+}
+
+/*
+	bench_parallel_pipes
+
+	One writer and one reader per core stream data over their own pipe,
+	while another thread keeps reading the process table through OpenInfo.
+	With per-subsystem kernel locks the pipes do not serialize against 
+	each other or against the process table, so the aggregate throughput 
+	should grow with the number of cores.
+ */
+
+#define PP_CHUNK 512
+#define PP_BYTES (1<<20)
+
+static volatile int pp_info_stop;
+
+static int pp_writer(int argl, void* args)
+{
+	pipe_t* p = args;
+	char buf[PP_CHUNK];
+	memset(buf, 'x', PP_CHUNK);
+	for(int sent=0; sent<PP_BYTES; ) {
+		int n = Write(p->write, buf, PP_CHUNK);
+		if(n<=0) break;
+		sent += n;
+	}
+	Close(p->write);
+	return 0;
+}
+
+static int pp_reader(int argl, void* args)
+{
+	pipe_t* p = args;
+	char buf[PP_CHUNK];
+	while(Read(p->read, buf, PP_CHUNK)>0);
+	Close(p->read);
+	return 0;
+}
+
+static int pp_info(int argl, void* args)
+{
+	unsigned long* scans = args;
+	procinfo info;
+	while(! pp_info_stop) {
+		Fid_t f = OpenInfo();
+		while(Read(f, (char*)&info, sizeof(info))>0);
+		Close(f);
+		(*scans)++;
+	}
+	return 0;
+}
+
+BOOT_TEST(bench_parallel_pipes,
+	"Measure the aggregate throughput of one pipe per core, with the process "
+	"table being read concurrently.",
+	.timeout = 120
+	)
+{
+	uint n = cpu_cores();
+	pipe_t p[n];
+	Tid_t w[n], r[n];
+	unsigned long scans = 0;
+
+	pp_info_stop = 0;
+	Tid_t info = CreateThread(pp_info, 0, &scans);
+
+	double w0 = wall_time();
+	for(uint c=0; c<n; c++) {
+		ASSERT(Pipe(&p[c])==0);
+		w[c] = CreateThread(pp_writer, 0, &p[c]);
+		r[c] = CreateThread(pp_reader, 0, &p[c]);
+	}
+	for(uint c=0; c<n; c++) {
+		ASSERT(ThreadJoin(w[c], NULL)==0);
+		ASSERT(ThreadJoin(r[c], NULL)==0);
+	}
+	double w1 = wall_time();
+
+	pp_info_stop = 1;
+	ASSERT(ThreadJoin(info, NULL)==0);
+
+	MSG("%u pipes: %.2f MB/s in total, %lu process table scans\n", 
+		n, (double)n*PP_BYTES/(1E3*(w1-w0)), scans);
+	return 0;
+}
+
+
+/*
+	bench_symposium_mutex
+
+	A symposium of 1000 philosophers, all contending for the mutex of the
+	SymposiumTable monitor. We compare the wall and the cpu time, with
+	contended mutexes that yield and spin, and with mutexes that sleep on 
+	a futex (see mutex_sleep). Run this with -c 4.
+ */
+
+#define SYMP_N 1000
+#define SYMP_BITES 5
+
+static void symp_run(double* wall, double* cpu)
+{
+	symposium_t symp = { .N = SYMP_N, .bites = SYMP_BITES };
+	adjust_symposium(&symp, -4, 0);
+
+	double w0 = wall_time(), c0 = cpu_time();
+	Pid_t pid = Exec(SymposiumOfThreads, sizeof(symp), &symp);
+	ASSERT(WaitChild(pid, NULL)==pid);
+	*wall = wall_time()-w0;
+	*cpu = cpu_time()-c0;
+}
+
+BOOT_TEST(bench_symposium_mutex,
+	"Measure a symposium of 1000 philosophers, with yielding and with sleeping mutexes.",
+	.timeout = 300
+	)
+{
+	/* The symposium prints to stdout, silence it */
+	fflush(stdout);
+	int saved_stdout = dup(1);
+	int devnull = open("/dev/null", O_WRONLY);
+	dup2(devnull, 1);
+	close(devnull);
+
+	int saved = mutex_sleep;
+	double wall[2], cpu[2];
+	for(int sleep=0; sleep<=1; sleep++) {
+		mutex_sleep = sleep;
+		symp_run(&wall[sleep], &cpu[sleep]);
+	}
+	mutex_sleep = saved;
+
+	fflush(stdout);
+	dup2(saved_stdout, 1);
+	close(saved_stdout);
+
+	MSG("%d philosophers: yielding mutex %.1f msec (cpu %.1f msec), "
+		"futex mutex %.1f msec (cpu %.1f msec)\n",
+		SYMP_N, wall[0], cpu[0], wall[1], cpu[1]);
+	return 0;
+}
+
+
+/*
+	bench_pipe_producers
+
+	Many producer threads write into one pipe, and one consumer reads it.
+	Every read broadcasts to the blocked producers, while the reader still
+	holds the pipe lock. We compare the throughput and the cpu time with 
+	signalled waiters woken up, and with wait morphing (see cond_morph).
+ */
+
+#define MP_PRODUCERS 16
+#define MP_CHUNK 64
+#define MP_BYTES (1<<20)
+
+static int mp_producer(int argl, void* args)
+{
+	char buf[MP_CHUNK];
+	memset(buf, 'x', MP_CHUNK);
+	for(int sent=0; sent < MP_BYTES/MP_PRODUCERS; ) {
+		int n = Write(argl, buf, MP_CHUNK);
+		if(n<=0) break;
+		sent += n;
+	}
+	return 0;
+}
+
+static void mp_run(double* mbs, double* cpu)
+{
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+
+	double w0 = wall_time(), c0 = cpu_time();
+	Tid_t t[MP_PRODUCERS];
+	for(int i=0; i<MP_PRODUCERS; i++)
+		t[i] = CreateThread(mp_producer, p.write, NULL);
+
+	char buf[MP_CHUNK];
+	int n;
+	long total = 0;
+	while(total < MP_BYTES && (n = Read(p.read, buf, sizeof(buf))) > 0)
+		total += n;
+	double w1 = wall_time(), c1 = cpu_time();
+	ASSERT(total == MP_BYTES);
+
+	for(int i=0; i<MP_PRODUCERS; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	Close(p.read);
+	Close(p.write);
+
+	*mbs = (MP_BYTES/1048576.0) / ((w1-w0)*1E-3);
+	*cpu = c1-c0;
+}
+
+BOOT_TEST(bench_pipe_producers,
+	"Measure a pipe with many producers, with and without wait morphing.",
+	.timeout = 120
+	)
+{
+	int saved = cond_morph;
+	double mbs[2], cpu[2];
+	for(int morph=0; morph<=1; morph++) {
+		cond_morph = morph;
+		mp_run(&mbs[morph], &cpu[morph]);
+	}
+	cond_morph = saved;
+
+	MSG("%d producers: %.2f MB/s (cpu %.1f msec) waking up, %.2f MB/s (cpu %.1f msec) with wait morphing\n",
+		MP_PRODUCERS, mbs[0], cpu[0], mbs[1], cpu[1]);
+	return 0;
+}
+
+
+/*
+	bench_rwlock_readers
+
+	One thread per core, pinned, reads a shared table under a lock, and
+	updates it once every RWB_WRITES operations. We compare the throughput
+	with a Mutex and with an RwLock. Run this with -c 1,2,4,...
+ */
+
+#define RWB_MSEC 300
+#define RWB_WRITES 100
+#define RWB_TABLE 64
+
+static Mutex rwb_mx = MUTEX_INIT;
+static RwLock rwb_rw = RWLOCK_INIT;
+static unsigned long rwb_table[RWB_TABLE];
+
+static int rwb_worker(int argl, void* args)
+{
+	unsigned long* count = args;
+	unsigned long sum = 0;
+	for(unsigned long i=0; ! pinned_stop; i++) {
+		int write = (i % RWB_WRITES == 0);
+		if(argl) { if(write) RwLock_WriteLock(&rwb_rw); else RwLock_ReadLock(&rwb_rw); }
+		else Mutex_Lock(&rwb_mx);
+
+		if(write) 
+			rwb_table[i % RWB_TABLE]++;
+		else
+			for(int j=0; j<RWB_TABLE; j++) sum += rwb_table[j];
+
+		if(argl) RwLock_Unlock(&rwb_rw); else Mutex_Unlock(&rwb_mx);
+		(*count)++;
+	}
+	return sum==0;
+}
+
+static double rwb_run(int rw)
+{
+	unsigned long count[MAX_CORES];
+	return (double)run_pinned(rwb_worker, rw, RWB_MSEC, count) / RWB_MSEC;
+}
+
+BOOT_TEST(bench_rwlock_readers,
+	"Measure a read-mostly table under a Mutex and under an RwLock, with one thread per core.",
+	.timeout = 60
+	)
+{
+	double mx = rwb_run(0);
+	double rw = rwb_run(1);
+
+	MSG("%u cores: mutex %.0f ops/msec, rwlock %.0f ops/msec\n", cpu_cores(), mx, rw);
+	return 0;
+}
+
+
+
+/*
+	bench_semaphore
+
+	The cost of a wait and a post on a semaphore. Kernel locks used to be 
+	monitors, a count under a mutex with a condition for the waiters. We 
+	compare such a monitor with a Semaphore and with a kernel lock, without 
+	contention, and then with one thread per core, all using one binary
+	semaphore.
+ */
+
+#define SEMB_PAIRS 1000000
+#define SEMB_MSEC 300
+
+/* A semaphore as a monitor, as the kernel locks were */
+typedef struct { Mutex mx; int count; CondVar free; } monitor_sem;
+
+static void msem_wait(monitor_sem* s)
+{
+	Mutex_Lock(&s->mx);
+	while(s->count <= 0) Cond_Wait(&s->mx, &s->free);
+	s->count--;
+	Mutex_Unlock(&s->mx);
+}
+
+static void msem_post(monitor_sem* s)
+{
+	Mutex_Lock(&s->mx);
+	s->count++;
+	Cond_Signal(&s->free);
+	Mutex_Unlock(&s->mx);
+}
+
+static monitor_sem semb_msem = { MUTEX_INIT, 1, COND_INIT };
+static Semaphore semb_sem = SEMAPHORE_INIT(1);
+static unsigned long semb_shared;
+
+static int semb_worker(int argl, void* args)
+{
+	unsigned long* count = args;
+	while(! pinned_stop) {
+		if(argl) Semaphore_Wait(&semb_sem); else msem_wait(&semb_msem);
+		semb_shared++;
+		if(argl) Semaphore_Post(&semb_sem); else msem_post(&semb_msem);
+		(*count)++;
+	}
+	return 0;
+}
+
+static double semb_run(int sem)
+{
+	unsigned long count[MAX_CORES];
+	return (double)run_pinned(semb_worker, sem, SEMB_MSEC, count) / SEMB_MSEC;
+}
+
+BOOT_TEST(bench_semaphore,
+	"Measure the cost of a wait and a post, on a monitor, a Semaphore and a kernel lock,\n"
+	"alone and with one thread per core.",
+	.timeout = 60
+	)
+{
+	monitor_sem msem = { MUTEX_INIT, 1, COND_INIT };
+	Semaphore sem = SEMAPHORE_INIT(1);
+	klock lock = KLOCK_INIT;
+
+	double t0 = wall_time();
+	for(int i=0; i<SEMB_PAIRS; i++) { msem_wait(&msem); msem_post(&msem); }
+	double t1 = wall_time();
+	for(int i=0; i<SEMB_PAIRS; i++) { Semaphore_Wait(&sem); Semaphore_Post(&sem); }
+	double t2 = wall_time();
+	for(int i=0; i<SEMB_PAIRS; i++) { kernel_lock(&lock); kernel_unlock(&lock); }
+	double t3 = wall_time();
+
+	double mc = semb_run(0);
+	double sc = semb_run(1);
+
+	MSG("alone: monitor %.1f, semaphore %.1f, kernel lock %.1f nsec per pair\n",
+		(t1-t0)*1E6/SEMB_PAIRS, (t2-t1)*1E6/SEMB_PAIRS, (t3-t2)*1E6/SEMB_PAIRS);
+	MSG("%u cores: monitor %.0f, semaphore %.0f pairs/msec\n", cpu_cores(), mc, sc);
+	return 0;
+}
+
+
+TEST_SUITE(all_benchmarks,
+	"All kernel benchmarks."
+	)
+{
+	&bench_timed_waiters,
+	&bench_idle_cpu,
+	&bench_pipe_latency,
+	&bench_thread_create,
+	&bench_parked_threads,
+	&bench_context_switch,
+	&bench_thread_pingpong,
+	&bench_pipe_pingpong,
+	&bench_policy_mix,
+	&bench_fair_share,
+	&bench_edf_heartbeat,
+	&bench_pipeline,
+	&bench_idle_spin,
+	&bench_core_parking,
+	&bench_mutex_contention,
+	&bench_parallel_pipes,
+	&bench_symposium_mutex,
+	&bench_pipe_producers,
+	&bench_rwlock_readers,
+	&bench_semaphore,
+	NULL
+};
+
+
+int main(int argc, char** argv)
+{
+	register_test(&all_benchmarks);
+	return run_program(argc, argv, &all_benchmarks);
+}
+
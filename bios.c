@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <time.h>
 #include <sys/select.h>
@@ -99,8 +101,8 @@ static struct sigaction USR1_saved_sigaction;
 /* The sigaction for SIGUSR1 (core interrupts) */
 static struct sigaction USR1_sigaction;
 
-/* A simulated coarse clock measuring time with a res. of 0.1 sec,
-   since "boot". Used for serial device timeouts. */
+/* A simulated coarse clock measuring time in msec, refreshed by the PIC
+   about every SLOW_HZ usec. Used for serial device timeouts. */
 typedef unsigned long coarse_clock_t;
 static volatile coarse_clock_t  system_clock;
 
@@ -631,6 +633,23 @@ static void PIC_daemon(uint serialno)
 
 
 
+/*
+	Pin the thread of a core to host cpu (first+core id), modulo the
+	number of host cpus.
+ */
+static void pin_core_thread(Core* core, int first)
+{
+	long nhost = sysconf(_SC_NPROCESSORS_ONLN);
+	if(nhost < 1) nhost = 1;
+	if(first < 0) first = 0;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET((first + core->id) % nhost, &set);
+	CHECKRC(pthread_setaffinity_np(core->thread, sizeof(set), &set));
+}
+
+
 /*****************************************
 	Public API
  *****************************************/
@@ -667,6 +686,7 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 	rlnode_init(&halted_list, NULL);
 
 	/* Launch the core threads */
+	const char* pin_cores = getenv("TINYOS_PIN_CORES");
 	ncores = cores;
 	for(uint c=0; c < cores; c++) {
 		/* Initialize Core */
@@ -689,6 +709,10 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 		char thread_name[16];
 		CHECK(snprintf(thread_name,16,"core-%d",c));
 		CHECKRC(pthread_setname_np(CORE[c].thread, thread_name));
+
+		/* Maybe pin it to a host cpu */
+		if(pin_cores != NULL)
+			pin_core_thread(&CORE[c], atoi(pin_cores));
 	}
 
 	/* Initialize PIC statistics */
@@ -732,6 +756,13 @@ uint cpu_cores()
 	return ncores;
 }
 
+static int core_interrupt_pending(Core* core)
+{
+	for(int intno = 0; intno < maximum_interrupt_no; intno++)
+		if(core->intpending[intno]) return 1;
+	return 0;
+}
+
 void cpu_core_halt()
 {
 	/* unmask signals and call sigsuspend */
@@ -739,10 +770,31 @@ void cpu_core_halt()
 	assert(! core->int_disabled);
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
 	pthread_mutex_lock(& core_halt_mutex);
-	core->halted = 1;
-	rlist_push_front(&halted_list, & core->halted_node);
-	while(core->halted)
-		pthread_cond_wait(& core->halt_cond, & core_halt_mutex);
+	/* An interrupt raised before we got here must not be lost */
+	if(! core_interrupt_pending(core)) {
+		core->halted = 1;
+		rlist_push_front(&halted_list, & core->halted_node);
+		while(core->halted)
+			pthread_cond_wait(& core->halt_cond, & core_halt_mutex);
+	}
+	assert(! core->halted);
+	pthread_mutex_unlock(& core_halt_mutex);
+	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	dispatch_interrupts(core);
+}
+
+void cpu_core_park(volatile sig_atomic_t* parked)
+{
+	Core* core = curr_core();
+	assert(! core->int_disabled);
+	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
+	pthread_mutex_lock(& core_halt_mutex);
+	/* The flag is checked under the mutex, so that an unpark is not lost */
+	if(*parked && ! core_interrupt_pending(core)) {
+		core->halted = 1;
+		while(core->halted)
+			pthread_cond_wait(& core->halt_cond, & core_halt_mutex);
+	}
 	assert(! core->halted);
 	pthread_mutex_unlock(& core_halt_mutex);
 	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
@@ -782,6 +834,11 @@ void cpu_core_restart_all()
 	pthread_mutex_unlock(& core_halt_mutex);	
 }
 
+void cpu_core_relax()
+{
+	sched_yield();
+}
+
 void cpu_core_barrier_sync()
 {
 	pthread_barrier_wait(& core_barrier);
@@ -819,6 +876,93 @@ void cpu_enable_interrupts()
 }
 
 
+#ifdef FAST_CONTEXT_SWITCH
+
+/*
+	The fast context switch. 
+
+	Unlike swapcontext(), it does not save and restore the signal mask, which
+	costs a host syscall at each switch. This is not needed, since contexts
+	are switched with interrupts disabled, and the interrupt state belongs 
+	to the core, not to the thread.
+
+	fast_switch(&oldsp, newsp) pushes the callee-saved registers of the 
+	x86-64 ABI, and the SSE and x87 control words, on the current stack,
+	saves the stack pointer in oldsp, and pops the same from newsp.
+ */
+void fast_switch(void** oldsp, void* newsp);
+void fast_context_start();
+
+__asm__(
+	".text\n"
+	".globl fast_switch\n"
+	".type fast_switch, @function\n"
+	"fast_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size fast_switch, .-fast_switch\n"
+
+	/* A new context 'returns' here, with the function in %r12 */
+	".globl fast_context_start\n"
+	".type fast_context_start, @function\n"
+	"fast_context_start:\n"
+	"	call *%r12\n"
+	"	ud2\n"
+	".size fast_context_start, .-fast_context_start\n"
+);
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* 
+	  Build the frame that fast_switch() pops, at the top of the stack:
+	    control words, r15, r14, r13, r12=ctx_func, rbx, rbp, return address
+	  After the return, the stack pointer is 16-byte aligned, as needed
+	  at a call.
+	 */
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+	uint64_t* frame = (uint64_t*)(top - 80);
+
+	uint32_t mxcsr;
+	uint16_t fpucw;
+	__asm__ __volatile__("stmxcsr %0" : "=m"(mxcsr));
+	__asm__ __volatile__("fnstcw %0" : "=m"(fpucw));
+
+	frame[0] = mxcsr | ((uint64_t)fpucw << 32);
+	frame[1] = frame[2] = frame[3] = 0;        /* r15, r14, r13 */
+	frame[4] = (uint64_t)ctx_func;             /* r12 */
+	frame[5] = frame[6] = 0;                   /* rbx, rbp */
+	frame[7] = (uint64_t)fast_context_start;   /* return address */
+
+	ctx->sp = frame;
+}
+
+
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+	fast_switch(& oldctx->sp, newctx->sp);
+}
+
+#else
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -840,6 +984,8 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#endif
+
 
 
 /*
@@ -872,9 +1018,20 @@ TimerDuration bios_cancel_timer()
 }
 
 
+TimerDuration bios_fine_clock()
+{
+	struct timespec curtime;
+	clock_gettime(CLOCK_MONOTONIC, &curtime);
+	return curtime.tv_sec*1000000ul + curtime.tv_nsec/1000;
+}
+
+
 TimerDuration bios_clock()
 {
-	return system_clock * 1000ul;
+	/* The PIC updates system_clock only when it wakes up, which is rare 
+	   when cores do not use their timers. Therefore, read the host clock
+	   instead; system_clock belongs to the PIC. */
+	return get_coarse_time() * 1000ul;
 }	
 
 
@@ -148,6 +148,11 @@ typedef enum Interrupt
 	The simulation ends (and this function returns) when (and if) all
 	cores return from bootfunc, in which case the VM shuts down.
 
+	If the environment variable @c TINYOS_PIN_CORES is set to a number
+	@c n, the thread of core @c c is pinned to host cpu @c n+c (modulo the
+	number of host cpus). This isolates the virtual machine from other 
+	workloads, and keeps each core on its own host cache.
+
 	@param bootfunc The function that each simulated core will execute at 
 			boot time. When all cores return from this function, the virtual
 			machine shuts down.
@@ -241,6 +246,20 @@ void cpu_enable_interrupts();
 void cpu_core_halt();
 
 
+/**
+	@brief Park the core.
+
+	This is like @c cpu_core_halt(), but the core is not restarted by
+	@c cpu_core_restart_one(), and it only halts if @c *parked is non-zero.
+	The flag is checked atomically with halting, therefore a core that 
+	clears the flag and then calls @c cpu_core_restart() for this core 
+	is sure to restart it.
+
+	@param parked the flag of the caller that keeps the core parked
+*/
+void cpu_core_park(volatile sig_atomic_t* parked);
+
+
 /**
 	@brief Restart the given core.
 
@@ -263,12 +282,42 @@ void cpu_core_restart_one();
 */
 void cpu_core_restart_all();
 
+/**
+	@brief Give up the host processor for a while.
+
+	This call is made by a core that spins on a lock for a long time.
+	Since cores are simulated by host threads, the holder of the lock may 
+	be a core that is not running on the host, and spinning would only 
+	delay it. 
+*/
+void cpu_core_relax();
+
+
+/* The fast context switch is only implemented for x86-64 */
+#if defined(FAST_CONTEXT_SWITCH) && !defined(__x86_64__)
+#undef FAST_CONTEXT_SWITCH
+#endif
+
+#ifdef FAST_CONTEXT_SWITCH
+
+/**
+	@brief A type for saving CPU context into.
+
+	With the fast context switch (build with FAST_CONTEXT=1), the callee-saved
+	registers of a suspended context are saved on its stack, so the context 
+	is just the saved stack pointer. The signal mask is not part of the context.
+*/
+typedef struct { void* sp; } cpu_context_t;
+
+#else
 
 /**
 	@brief A type for saving CPU context into.
 */
 typedef ucontext_t cpu_context_t;
 
+#endif
+
 
 /**
 	@brief Initialize a CPU context for a new thread.
@@ -337,12 +386,23 @@ TimerDuration bios_cancel_timer();
 	the epoch. 
 
 	The resolution of the clock is very low, currently 
-	around 100 msec. Therefore, it is inappropriate for any type of
+	1 msec. Therefore, it is inappropriate for any type of
 	precise timing.
  */
 TimerDuration bios_clock();
 
 
+/**
+	@brief Get the current time from a fine-grained clock.
+
+	This function returns the value of a monotonic clock, in usec.
+	Unlike @c bios_clock(), its resolution is 1 usec, and it is cheap
+	enough to be read at every context switch. It is meant for 
+	measuring durations, not for the time of day.
+ */
+TimerDuration bios_fine_clock();
+
+
 
 
 /**
@@ -1,6 +1,11 @@
 
 
 #include <assert.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "kernel_sched.h"
 #include "kernel_proc.h"
@@ -19,51 +24,567 @@
   */
 
 
+/*
+	Lock profiling.
+	---------------
+
+	With LOCK_PROFILE, each lock has an entry in a table keyed by its 
+	address. An entry is claimed by a compare-and-swap on the key, so the
+	profiler itself needs no lock. The counters of an entry are updated 
+	by the holder of the lock, after it gets it, so they need no atomics
+	either. A waiter counts its spins, yields and sleeps in a lock_wait on
+	its stack, and adds them when it gets the lock. Entries are never 
+	freed; once the table is full, the locks that do not fit are only 
+	counted together, in an overflow row. The report is at the end of 
+	this file.
+
+	Without LOCK_PROFILE, the macros below expand to nothing.
+*/
+
+#ifdef LOCK_PROFILE
+
+#define LOCK_PROFILE_SLOTS 4096
+#define LOCK_PROFILE_PROBES 64
+#define LOCK_PROFILE_TOP 12
+
+/** \cond HELPER The counters of a lock. */
+typedef struct lock_profile {
+	void* lock;					/* the key, NULL if the slot is free */
+	const char* name;
+	unsigned long acquired, contended, spins, yields, sleeps;
+	uint64_t hold, max_hold;	/* in TSC cycles */
+	uint64_t locked_at;
+} lock_profile;
+
+typedef struct { unsigned long spins, yields, sleeps; } lock_wait;
+/** \endcond */
+
+static lock_profile lock_table[LOCK_PROFILE_SLOTS];
+static lock_profile lock_overflow;	/* the locks that did not fit in the table */
+
+static lock_profile* lock_profile_get(void* lock)
+{
+	uintptr_t h = (((uintptr_t)lock >> 3) * 0x9E3779B97F4A7C15ul) >> 52;
+	for(int i=0; i<LOCK_PROFILE_PROBES; i++) {
+		lock_profile* e = & lock_table[(h + i) % LOCK_PROFILE_SLOTS];
+		void* key = __atomic_load_n(& e->lock, __ATOMIC_ACQUIRE);
+		if(key == NULL && __atomic_compare_exchange_n(& e->lock, &key, lock, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return e;
+		if(key == lock) return e;
+	}
+	return NULL;
+}
+
+/* The holder got the lock; w is NULL if it did not wait */
+static void lock_acquired(void* lock, lock_wait* w)
+{
+	lock_profile* e = lock_profile_get(lock);
+	if(e == NULL) {
+		/* Shared by many locks, so only the counts, atomically */
+		__atomic_fetch_add(& lock_overflow.acquired, 1, __ATOMIC_RELAXED);
+		if(w) __atomic_fetch_add(& lock_overflow.contended, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	e->acquired++;
+	if(w) {
+		e->contended++;
+		e->spins += w->spins;
+		e->yields += w->yields;
+		e->sleeps += w->sleeps;
+	}
+	e->locked_at = __builtin_ia32_rdtsc();
+}
+
+/* The holder is about to release the lock */
+static void lock_released(void* lock)
+{
+	lock_profile* e = lock_profile_get(lock);
+	if(e == NULL || e->locked_at == 0) return;
+	uint64_t t = __builtin_ia32_rdtsc() - e->locked_at;
+	e->hold += t;
+	if(t > e->max_hold) e->max_hold = t;
+	e->locked_at = 0;
+}
+
+#define LOCK_WAIT(w) lock_wait w = { 0, 0, 0 }
+#define LOCK_WAIT_COUNT(w, field) ((w).field++)
+#define LOCK_ACQUIRED(lock, w) lock_acquired((lock), (w))
+#define LOCK_RELEASED(lock) lock_released(lock)
+
+#else
+
+#define LOCK_WAIT(w)
+#define LOCK_WAIT_COUNT(w, field) ((void)0)
+#define LOCK_ACQUIRED(lock, w) ((void)0)
+#define LOCK_RELEASED(lock) ((void)0)
+
+#endif
+
+
 /*
  	Pre-emption aware mutex.
  	-------------------------
 
  	This mutex will act as a spinlock if preemption is off, and a
- 	yielding mutex if preemption is on.
+ 	sleeping mutex if preemption is on.
 
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
 
+ 	The mutex is a ticket lock: the low half of the lock word is the ticket
+ 	of the current holder, and the high half is the next ticket to hand out.
+ 	In the non-preemptive domain, a core takes a ticket and waits for its
+ 	turn, so that the lock is granted in FIFO order. The wait is a backoff 
+ 	proportional to the number of tickets ahead, so that the waiters do not
+ 	all read the lock word after every release.
+
+ 	In the preemptive domain, a thread only takes a ticket when the lock is
+ 	free. A thread that waits in line may be preempted, and then every
+ 	thread behind it would wait for it to run again. After spinning for a
+ 	while, the thread sleeps on the lock word with futex_wait(), and counts
+ 	itself in the sleepers of the mutex. The unlock takes the fast path, 
+ 	without touching the futex table, unless there are sleepers.
+
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
-void Mutex_Lock(Mutex* lock)
-{
+
+/** \cond HELPER The parts of a mutex. */
+typedef union {
+  Mutex word;
+  struct {
+    union {
+      uint32_t lock;        /* the futex word */
+      struct {
+        uint16_t owner;     /* ticket holding the lock */
+        uint16_t next;      /* next ticket to hand out */
+      };
+    };
+    uint32_t sleepers;      /* threads asleep on the lock word */
+  };
+} ticket_lock;
+/** \endcond */
+
 #define MUTEX_SPINS 1000
+#define MUTEX_BACKOFF 20
+
+int mutex_sleep = 1;
+
+static inline int mutex_locked(ticket_lock* tl)
+{
+  ticket_lock t = { .lock = __atomic_load_n(&tl->lock, __ATOMIC_RELAXED) };
+  return t.owner != t.next;
+}
+
+static inline int mutex_trylock(ticket_lock* tl)
+{
+  ticket_lock t = { .lock = __atomic_load_n(&tl->lock, __ATOMIC_RELAXED) };
+  if(t.owner != t.next) return 0;
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
-      __builtin_ia32_pause();      
-      if(spin>0) 
-      	spin--; 
-      else { 
-      	spin=MUTEX_SPINS; 
-      	if(get_core_preemption())
-      		yield(SCHED_MUTEX); 
+  ticket_lock taken = t;
+  taken.next++;
+  return __atomic_compare_exchange_n(&tl->lock, &t.lock, taken.lock, 0,
+    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/* Wait in the preemptive domain, until we get the lock */
+static void mutex_wait(ticket_lock* tl)
+{
+  LOCK_WAIT(w);
+  int spin=MUTEX_SPINS;
+  uint32_t seen;
+  do {
+    while(mutex_locked(tl)) {
+      __builtin_ia32_pause();
+      LOCK_WAIT_COUNT(w, spins);
+      if(spin>0) { spin--; continue; }
+      spin=MUTEX_SPINS;
+
+      if(! mutex_sleep || CURTHREAD->type == IDLE_THREAD) {
+        yield(SCHED_MUTEX); 
+        LOCK_WAIT_COUNT(w, yields);
+        /* The holder may be a core that the host is not running */
+        cpu_core_relax();
+        continue;
       }
+
+      /* The count must be raised before futex_wait() looks at the lock word,
+         see Mutex_Unlock(). The word we sleep on must be a locked one, 
+         else the unlock may have come and gone already. */
+      seen = __atomic_load_n(&tl->lock, __ATOMIC_RELAXED);
+      if(((ticket_lock){ .lock = seen }).owner == ((ticket_lock){ .lock = seen }).next)
+        continue;
+      __atomic_add_fetch(&tl->sleepers, 1, __ATOMIC_SEQ_CST);
+      futex_wait(&tl->lock, seen, SCHED_FUTEX, NO_TIMEOUT);
+      __atomic_sub_fetch(&tl->sleepers, 1, __ATOMIC_RELAXED);
+      LOCK_WAIT_COUNT(w, sleeps);
+    }
+  } while(! mutex_trylock(tl));
+  LOCK_ACQUIRED(tl, &w);
+}
+
+void Mutex_Lock(Mutex* lock)
+{
+  ticket_lock* tl = (ticket_lock*) lock;
+
+  if(get_core_preemption()) {
+    if(mutex_trylock(tl))
+      LOCK_ACQUIRED(tl, NULL);
+    else
+      mutex_wait(tl);
+    return;
+  }
+
+  LOCK_WAIT(w);
+  uint16_t ticket = __atomic_fetch_add(&tl->next, 1, __ATOMIC_RELAXED);
+  uint16_t seen = ticket;
+  int spin = MUTEX_SPINS;
+  for(;;) {
+    uint16_t owner = __atomic_load_n(&tl->owner, __ATOMIC_ACQUIRE);
+    if(owner == ticket) break;
+    if(owner != seen) { seen = owner; spin = MUTEX_SPINS; }
+
+    int backoff = (uint16_t)(ticket - owner) * MUTEX_BACKOFF;
+    for(int i = backoff; i>0; i--) {
+      __builtin_ia32_pause();
+      LOCK_WAIT_COUNT(w, spins);
+    }
+
+    /* If the line does not move, the holder (or a waiter ahead of us) may 
+       be a core that the host is not running */
+    spin -= backoff;
+    if(spin <= 0) {
+      spin = MUTEX_SPINS;
+      cpu_core_relax();
+      LOCK_WAIT_COUNT(w, yields);
     }
   }
-#undef MUTEX_SPINS
+  LOCK_ACQUIRED(tl, (seen != ticket) ? &w : NULL);
+}
+
+
+int Mutex_TryLock(Mutex* lock)
+{
+  ticket_lock* tl = (ticket_lock*) lock;
+  if(! mutex_trylock(tl)) return 0;
+  LOCK_ACQUIRED(tl, NULL);
+  return 1;
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+  ticket_lock* tl = (ticket_lock*) lock;
+  LOCK_RELEASED(tl);
+  uint16_t owner = __atomic_load_n(&tl->owner, __ATOMIC_RELAXED);
+
+  /* The store and the load of the sleepers are ordered against the 
+     increment and the load of the lock word in mutex_wait(), so that
+     either we see the sleeper, or it sees the lock released. */
+  __atomic_store_n(&tl->owner, (uint16_t)(owner+1), __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&tl->sleepers, __ATOMIC_SEQ_CST))
+    futex_wake(&tl->lock, 1);
+}
+
+#undef MUTEX_BACKOFF
+#undef MUTEX_SPINS
+
+
+/*
+	Waiting on a word.
+	------------------
+
+	The locks below wait for a word to change. A waiter spins for a while,
+	and then sleeps as in mutex_wait(), counting itself in the sleepers of
+	the lock, so that a release only calls futex_wake() if someone sleeps.
+	In the non-preemptive domain, it can only spin.
+*/
+
+#define WAIT_SPINS 1000
+
+/* Spin, and after a while sleep until *word is no longer seen */
+static void spin_wait(volatile uint32_t* word, uint32_t seen, 
+	uint32_t* sleepers, int* spin)
+{
+  __builtin_ia32_pause();
+  if(--*spin > 0) return;
+  *spin = WAIT_SPINS;
+
+  if(! get_core_preemption()) {
+    cpu_core_relax();
+  }
+  else if(! mutex_sleep || CURTHREAD->type == IDLE_THREAD) {
+    yield(SCHED_MUTEX);
+    cpu_core_relax();
+  }
+  else {
+    __atomic_add_fetch(sleepers, 1, __ATOMIC_SEQ_CST);
+    futex_wait(word, seen, SCHED_FUTEX, NO_TIMEOUT);
+    __atomic_sub_fetch(sleepers, 1, __ATOMIC_RELAXED);
+  }
+}
+
+
+/*
+	Reader-writer locks.
+	--------------------
+
+	The state word counts the readers, or it is RWLOCK_WRITER. A writer
+	announces itself in the writers count, which keeps new readers out, and
+	waits for the state to drop to zero. The state may return to a value 
+	that a waiter has seen, so waiters sleep on the count of releases 
+	instead. Sleepers may be readers or writers, so all of them are woken up
+	when the lock becomes free: by a writer, or by the last reader.
+*/
+
+void RwLock_ReadLock(RwLock* rw)
+{
+  int spin = WAIT_SPINS;
+  for(;;) {
+    uint32_t seen = __atomic_load_n(&rw->releases, __ATOMIC_SEQ_CST);
+    uint32_t s = __atomic_load_n(&rw->state, __ATOMIC_SEQ_CST);
+    if(!(s & RWLOCK_WRITER) && __atomic_load_n(&rw->writers, __ATOMIC_SEQ_CST)==0) {
+      if(__atomic_compare_exchange_n(&rw->state, &s, s+1, 0, 
+          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    }
+    else
+      spin_wait(&rw->releases, seen, &rw->sleepers, &spin);
+  }
+}
+
+void RwLock_WriteLock(RwLock* rw)
+{
+  int spin = WAIT_SPINS;
+  __atomic_add_fetch(&rw->writers, 1, __ATOMIC_SEQ_CST);
+  for(;;) {
+    uint32_t seen = __atomic_load_n(&rw->releases, __ATOMIC_SEQ_CST);
+    uint32_t s = 0;
+    if(__atomic_compare_exchange_n(&rw->state, &s, RWLOCK_WRITER, 0, 
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+    spin_wait(&rw->releases, seen, &rw->sleepers, &spin);
+  }
+  __atomic_sub_fetch(&rw->writers, 1, __ATOMIC_RELAXED);
+}
+
+void RwLock_Unlock(RwLock* rw)
+{
+  uint32_t s = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+  if(s == RWLOCK_WRITER) {
+    __atomic_store_n(&rw->state, 0, __ATOMIC_SEQ_CST);
+    s = 0;
+  }
+  else
+    s = __atomic_sub_fetch(&rw->state, 1, __ATOMIC_SEQ_CST);
+  if(s != 0) return;
+
+  /* As in Mutex_Unlock(), either we see the sleeper, or it sees the release */
+  __atomic_add_fetch(&rw->releases, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&rw->sleepers, __ATOMIC_SEQ_CST))
+    futex_wake(&rw->releases, UINT_MAX);
+}
+
+
+/*
+	Semaphores.
+	-----------
+
+	The count is the futex word. A wait is a single compare-and-swap on the
+	count when it is positive, and a post is a single increment, unless
+	there are sleepers. Waiters sleep while the count is zero. A waiter that
+	a post wakes up may find that another thread took the count first; it
+	then sleeps again, which is fine, since the count is zero.
+*/
+
+int Semaphore_TryWait(Semaphore* sem)
+{
+  uint32_t c = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+  while(c > 0)
+    if(__atomic_compare_exchange_n(&sem->count, &c, c-1, 0, 
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return 1;
+  return 0;
+}
+
+void Semaphore_Wait(Semaphore* sem)
+{
+  int spin = WAIT_SPINS;
+  while(! Semaphore_TryWait(sem))
+    spin_wait(&sem->count, 0, &sem->sleepers, &spin);
+}
+
+void Semaphore_Post(Semaphore* sem)
+{
+  /* As in Mutex_Unlock(), either we see the sleeper, or it sees the count */
+  __atomic_add_fetch(&sem->count, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&sem->sleepers, __ATOMIC_SEQ_CST))
+    futex_wake(&sem->count, 1);
+}
+
+
+/*
+	Barriers.
+	---------
+
+	The last thread to arrive resets the count of arrivals and starts a new
+	round. The others wait for the round to change. A thread can only 
+	arrive for the next round after it has seen the new round, and so after
+	the reset.
+*/
+
+int Barrier_Wait(Barrier* bar)
+{
+  uint32_t round = __atomic_load_n(&bar->round, __ATOMIC_ACQUIRE);
+
+  if(__atomic_add_fetch(&bar->arrived, 1, __ATOMIC_ACQ_REL) == bar->parties) {
+    __atomic_store_n(&bar->arrived, 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bar->round, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&bar->sleepers, __ATOMIC_SEQ_CST))
+      futex_wake(&bar->round, UINT_MAX);
+    return 1;
+  }
+
+  int spin = WAIT_SPINS;
+  while(__atomic_load_n(&bar->round, __ATOMIC_ACQUIRE) == round)
+    spin_wait(&bar->round, round, &bar->sleepers, &spin);
+  return 0;
+}
+
+#undef WAIT_SPINS
+
+
+/*
+	Futexes.
+	---------
+
+	A thread sleeps on a word, if the word still has the value it expects,
+	until another thread wakes up the sleepers of that word. The sleepers are
+	kept in a hash table keyed by address, with a spinlock per bucket. The 
+	bucket locks are only taken with preemption off, so they never have
+	sleepers of their own.
+*/
+
+/** \cond HELPER Helper structures for futexes. */
+typedef struct __futex_waiter {
+	rlnode node;				/* become part of the ring of the bucket */
+	TCB* thread;				/* thread to wait */
+	volatile uint32_t* addr;	/* the word it sleeps on */
+	sig_atomic_t removed;		/* set if the waiter is removed from the ring */
+} __futex_waiter;
+
+#define FUTEX_BUCKETS 256
+
+static struct futex_bucket {
+	Mutex lock;
+	__futex_waiter* waitset;
+} futex_table[FUTEX_BUCKETS];
+/** \endcond */
+
+static inline struct futex_bucket* futex_bucket(volatile uint32_t* addr)
+{
+	uintptr_t key = (uintptr_t)addr >> 2;
+	return & futex_table[(key * 0x9E3779B97F4A7C15ul) >> 56];
+}
+
+static inline void futex_remove(struct futex_bucket* b, __futex_waiter* w)
+{
+	if(b->waitset == w) {
+		__futex_waiter* nextw = w->node.next->obj;
+		b->waitset = (nextw == w) ? NULL : nextw;
+	}
+	rlist_remove(& w->node);
+	w->removed = 1;
+}
+
+
+int futex_wait(volatile uint32_t* addr, uint32_t val, 
+	enum SCHED_CAUSE cause, TimerDuration timeout)
+{
+	struct futex_bucket* b = futex_bucket(addr);
+	__futex_waiter waiter = { .thread = CURTHREAD, .addr = addr, .removed = 0 };
+	rlnode_init(& waiter.node, &waiter);
+
+	int pre = preempt_off;
+	Mutex_Lock(& b->lock);
+
+	if(__atomic_load_n(addr, __ATOMIC_SEQ_CST) != val) {
+		Mutex_Unlock(& b->lock);
+		if(pre) preempt_on;
+		return -1;
+	}
+
+	if(b->waitset)
+		rlist_push_back(& b->waitset->node, & waiter.node);
+	else
+		b->waitset = &waiter;
+
+	sleep_releasing(STOPPED, & b->lock, cause, timeout);
+
+	/* Woke up, if it was not by futex_wake() we must leave the ring */
+	Mutex_Lock(& b->lock);
+	int woken = waiter.removed;
+	if(! woken) 
+		futex_remove(b, &waiter);
+	Mutex_Unlock(& b->lock);
+
+	if(pre) preempt_on;
+	return woken ? 0 : -1;
+}
+
+
+int futex_wake(volatile uint32_t* addr, unsigned int n)
+{
+	struct futex_bucket* b = futex_bucket(addr);
+	int count = 0;
+
+	int pre = preempt_off;
+	Mutex_Lock(& b->lock);
+
+	__futex_waiter* w = b->waitset;
+	for(unsigned int left = w ? rlist_len(& w->node)+1 : 0; left>0 && count<n; left--) {
+		__futex_waiter* nextw = w->node.next->obj;
+		if(w->addr == addr) {
+			futex_remove(b, w);
+			/* A waiter that its timeout has already woken up is not counted */
+			if(wakeup(w->thread)) count++;
+		}
+		w = nextw;
+	}
+
+	Mutex_Unlock(& b->lock);
+	if(pre) preempt_on;
+	return count;
+}
+
+
+int sys_FutexWait(volatile uint32_t* addr, uint32_t val)
+{
+	return futex_wait(addr, val, SCHED_USER, NO_TIMEOUT);
+}
+
+int sys_FutexWake(volatile uint32_t* addr, unsigned int n)
+{
+	return futex_wake(addr, n);
 }
 
 
 /*
 	Condition variables.	
+
+	A signalled waiter must lock the mutex of the wait before it returns.
+	If the mutex is held when the waiter is signalled, waking the waiter
+	up would only make it block again on the mutex, and a broadcast would
+	wake up a herd that competes for it. Instead, the signal moves the
+	waiter to the wait queue of the mutex (wait morphing): the futex of 
+	the mutex, or for a kernel lock, the futex of its semaphore. Every 
+	unlock then releases one thread.
 */
 
 
+int cond_morph = 1;
+
 /** \cond HELPER Helper structure for condition variables. */
 typedef struct __cv_waiter {
 	rlnode node;				/* become part of a ring */
@@ -71,6 +592,11 @@ typedef struct __cv_waiter {
 	sig_atomic_t signalled;		/* this is set if the thread is signalled */
 	sig_atomic_t removed;		/* this is set if the waiter is removed 
 								   from the ring */
+	Mutex* mutex;				/* the mutex of the wait, or NULL */
+	klock* klock;				/* the kernel lock of the wait, or NULL */
+	uint32_t* sleepers;			/* the sleepers of the futex a signal moved 
+								   us to, or NULL */
+	__futex_waiter fw;			/* our node in that futex */
 } __cv_waiter;
 /** \endcond */
 
@@ -88,6 +614,98 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 	rlist_remove(& w->node);
 }
 
+/* Lock the waitset of a condition, naming it for the lock profile */
+static inline void cv_lock(CondVar* cv)
+{
+	Mutex_Lock(& cv->waitset_lock);
+}
+
+static inline void push_to_ring(CondVar* cv, __cv_waiter* w)
+{
+	if(cv->waitset) {
+		__cv_waiter* wset = cv->waitset;
+		rlist_push_back(& wset->node, & w->node);
+	} else {
+		cv->waitset = w;
+	}
+}
+
+
+/**
+  @internal
+  Move a signalled waiter to the futex of its mutex, or of the semaphore
+  of its kernel lock, if that is held. Called with the waitset lock of 
+  the condition held.
+
+  The test of the lock and the move are done under the lock of the futex
+  bucket, after the waiter is counted as a sleeper, and every unlock 
+  wakes the futex after it releases the lock if there are sleepers, so 
+  that the waiter cannot miss the unlock.
+
+  @returns 1 if the waiter was moved, 0 if it should just be woken up
+ */
+static int cv_morph(__cv_waiter* w)
+{
+	volatile uint32_t* word;
+	uint32_t* sleepers;
+
+	if(w->klock) {
+		word = & w->klock->sem.count;
+		sleepers = & w->klock->sem.sleepers;
+	}
+	else if(w->mutex) {
+		ticket_lock* tl = (ticket_lock*) w->mutex;
+		word = & tl->lock;
+		sleepers = & tl->sleepers;
+	}
+	else
+		return 0;
+
+	struct futex_bucket* b = futex_bucket(word);
+	int pre = preempt_off;
+	Mutex_Lock(& b->lock);
+
+	/* As in mutex_wait(), count the sleeper before looking at the lock */
+	__atomic_add_fetch(sleepers, 1, __ATOMIC_SEQ_CST);
+	int held = w->klock 
+		? __atomic_load_n(word, __ATOMIC_SEQ_CST) == 0
+		: mutex_locked((ticket_lock*) w->mutex);
+	if(held) {
+		w->fw.addr = word;
+		if(b->waitset)
+			rlist_push_back(& b->waitset->node, & w->fw.node);
+		else
+			b->waitset = & w->fw;
+		w->sleepers = sleepers;
+	}
+	else
+		__atomic_sub_fetch(sleepers, 1, __ATOMIC_RELAXED);
+
+	Mutex_Unlock(& b->lock);
+	if(pre) preempt_on;
+	return held;
+}
+
+
+/**
+  @internal
+  Leave the futex that a signal moved us to. It may also be that we 
+  woke up from it by a timeout.
+ */
+static void cv_unmorph(__cv_waiter* w)
+{
+	if(w->sleepers == NULL) return;
+
+	struct futex_bucket* b = futex_bucket(w->fw.addr);
+	int pre = preempt_off;
+	Mutex_Lock(& b->lock);
+	if(! w->fw.removed)
+		futex_remove(b, & w->fw);
+	Mutex_Unlock(& b->lock);
+	if(pre) preempt_on;
+	__atomic_sub_fetch(w->sleepers, 1, __ATOMIC_RELAXED);
+}
+
 
 /** 
    @internal
@@ -97,17 +715,18 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 	condition variables. It is used to implement the @c Cond_Wait and @c Cond_TimedWait
 	system calls, as well as internal kernel 'wait' functionality.
 
-  The function must be called only while we have locked the mutex that 
-  is associated with this call. It will put the calling thread to sleep, 
-  unlocking the mutex. These operations happen atomically.  
+  The function must be called only while we have locked the mutex (or the
+  kernel lock) that is associated with this call. It will put the calling
+  thread to sleep, unlocking the mutex. These operations happen atomically.  
 
   When the thread is woken up later (by another thread that calls @c 
   Cond_Signal or @c Cond_Broadcast, or because the timeout has expired, or
   because the thread was awoken by another kernel routine), 
   it first re-locks the mutex and then returns.  
 
-  @param mx The mutex to be unlocked as the thread sleeps.
+  @param mx The mutex to be unlocked as the thread sleeps, if @c lock is NULL.
   @param cv The condition variable to sleep on.
+  @param lock The kernel lock to be unlocked as the thread sleeps, or NULL.
   @param cause A cause provided to the kernel scheduler.
   @param timeout The time to sleep, or @c NO_TIMEOUT to sleep for ever.
 
@@ -116,27 +735,31 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
   @see Cond_Signal
   @see Cond_Broadcast
   */
-static int cv_wait(Mutex* mutex, CondVar* cv, 
+static int cv_wait(Mutex* mutex, CondVar* cv, klock* lock,
 		enum SCHED_CAUSE cause, TimerDuration timeout)
 {
-	__cv_waiter waiter = { .thread=CURTHREAD, .signalled = 0, .removed=0 };
+	__cv_waiter waiter = { .thread=CURTHREAD, .signalled = 0, .removed=0,
+		.mutex = mutex, .klock = lock, .sleepers = NULL,
+		.fw = { .thread=CURTHREAD, .removed=0 } };
 	rlnode_init(& waiter.node, &waiter);
+	rlnode_init(& waiter.fw.node, &waiter.fw);
 
-	Mutex_Lock(&(cv->waitset_lock));
+	cv_lock(cv);
 	/* We just push the current thread to the back of the list */
-	if(cv->waitset) {
-		__cv_waiter* wset = cv->waitset;
-		rlist_push_back(& wset->node, & waiter.node);
-	} else {
-		cv->waitset = &waiter;
-	}
+	push_to_ring(cv, &waiter);
 
-	/* Now atomically release mutex and sleep */
-	Mutex_Unlock(mutex);
+	/* Now atomically release the lock and sleep. A signaller needs the
+	   waitset lock, so it cannot miss us after the release. */
+	if(lock) {
+		LOCK_RELEASED(lock);
+		Semaphore_Post(& lock->sem);
+	}
+	else
+		Mutex_Unlock(mutex);
 	sleep_releasing(STOPPED, &(cv->waitset_lock), cause, timeout);
 
 	/* Woke up, we must check wether we were signaled, and tidy up */
-	Mutex_Lock(&(cv->waitset_lock));
+	cv_lock(cv);
 	if(! waiter.removed) {
 		assert(! waiter.signalled);
 
@@ -144,8 +767,12 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 		remove_from_ring(cv, &waiter);
 	}
 	Mutex_Unlock(&(cv->waitset_lock));
+	cv_unmorph(&waiter);
 
-	Mutex_Lock(mutex);
+	if(lock)
+		kernel_lock(lock);
+	else
+		Mutex_Lock(mutex);
 	return waiter.signalled;
 }
 
@@ -155,15 +782,18 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
   Helper for Cond_Signal and Cond_Broadcast. This method 
   will actually find a waiter to signal, if one exists. 
   Else, it leaves the cv->waitset == NULL.
+  If @c handoff is set, the waiter is handed the current core, else it
+  may be moved to the wait queue of its mutex.
  */
-static inline void cv_signal(CondVar* cv)
+static inline void cv_signal(CondVar* cv, int handoff)
 {
 	/* Wakeup first process in the waiters' queue, if it exists. */
 	while(cv->waitset) {
 		__cv_waiter* waiter = cv->waitset;
 		remove_from_ring(cv, waiter);
 		waiter->removed = 1;
-		if(wakeup(waiter->thread)) {
+		if((!handoff && cond_morph && cv_morph(waiter)) ||
+			(handoff ? wakeup_handoff(waiter->thread) : wakeup(waiter->thread))) {
 			waiter->signalled = 1;
 			return;
 		}
@@ -174,28 +804,37 @@ static inline void cv_signal(CondVar* cv)
 
 int Cond_Wait(Mutex* mutex, CondVar* cv)
 {
-	return cv_wait(mutex, cv, SCHED_USER, NO_TIMEOUT);
+	return cv_wait(mutex, cv, NULL, SCHED_USER, NO_TIMEOUT);
 }
 
 int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
 {
 	/* We have to translate timeout from msec to usec */
-	return cv_wait(mutex, cv, SCHED_USER, timeout*1000ul);
+	return cv_wait(mutex, cv, NULL, SCHED_USER, timeout*1000ul);
 }
 
 
 void Cond_Signal(CondVar* cv)
 {
-  Mutex_Lock(&(cv->waitset_lock));
-  cv_signal(cv);
+  cv_lock(cv);
+  cv_signal(cv, 0);
+  Mutex_Unlock(&(cv->waitset_lock));
+}
+
+
+void Cond_SignalYield(CondVar* cv)
+{
+  cv_lock(cv);
+  cv_signal(cv, 1);
   Mutex_Unlock(&(cv->waitset_lock));
+  yield_handoff();
 }
 
 
 void Cond_Broadcast(CondVar* cv)
 {
-  Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
+  cv_lock(cv);
+  while(cv->waitset) cv_signal(cv, 0);
   Mutex_Unlock(&(cv->waitset_lock));
 }
 
@@ -236,56 +875,77 @@ int get_core_preemption()
  */
 
 /**
- * @brief The kernel lock.
+ * @brief The kernel locks.
+ *
+ * Each kernel lock is a binary semaphore. A semaphore has the advantage 
+ * that it can be released by a thread that sleeps, in kernel_wait_wchan() 
+ * and kernel_sleep(), and an uncontended lock or unlock is a single atomic
+ * operation.
  *
- * Kernel locking is provided by a semaphore, implemented as a monitor.
- * A semaphre for kernel locking has the advantage that 
+ * A kernel lock can also be held in shared mode, by many readers. The 
+ * first reader takes the semaphore for all of them, and the last one 
+ * releases it. A thread that has to wait for exclusive mode counts itself 
+ * in the writers, and while there are writers, new readers do not join 
+ * the ones that hold the lock. They sleep on the writers count instead,
+ * until the writers are served.
  */
 
-/* This mutex is used to implement the kernel semaphore as a monitor. */
-static Mutex kernel_mutex = MUTEX_INIT;
+void kernel_lock(klock* lock)
+{
+	if(Semaphore_TryWait(& lock->sem)) {
+		LOCK_ACQUIRED(lock, NULL);
+		return;
+	}
 
-/* Semaphore counter */
-static int kernel_sem = 1;
+	LOCK_WAIT(w);
+	__atomic_add_fetch(& lock->writers, 1, __ATOMIC_SEQ_CST);
+	Semaphore_Wait(& lock->sem);
+	LOCK_ACQUIRED(lock, &w);
+	if(__atomic_sub_fetch(& lock->writers, 1, __ATOMIC_SEQ_CST) == 0)
+		futex_wake(& lock->writers, UINT_MAX);
+}
 
-/* Semaphore condition */
-static CondVar kernel_sem_cv = COND_INIT;
+void kernel_unlock(klock* lock)
+{
+	LOCK_RELEASED(lock);
+	Semaphore_Post(& lock->sem);
 
-void kernel_lock()
+	/* Run a thread woken by kernel_signal_yield() */
+	yield_handoff();
+}
+
+void kernel_lock_shared(klock* lock)
 {
-	Mutex_Lock(& kernel_mutex);
-	while(kernel_sem<=0) {
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
+	Mutex_Lock(& lock->readers_mutex);
+	for(;;) {
+		if(lock->readers == 0) {
+			/* Wait for the writers with the others behind us */
+			Semaphore_Wait(& lock->sem);
+			break;
+		}
+		uint32_t writers = __atomic_load_n(& lock->writers, __ATOMIC_SEQ_CST);
+		if(writers == 0) break;
+
+		Mutex_Unlock(& lock->readers_mutex);
+		futex_wait(& lock->writers, writers, SCHED_FUTEX, NO_TIMEOUT);
+		Mutex_Lock(& lock->readers_mutex);
 	}
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);
+	lock->readers++;
+	Mutex_Unlock(& lock->readers_mutex);
 }
 
-void kernel_unlock()
+void kernel_unlock_shared(klock* lock)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	Mutex_Unlock(& kernel_mutex);
+	Mutex_Lock(& lock->readers_mutex);
+	if(--lock->readers == 0)
+		Semaphore_Post(& lock->sem);
+	Mutex_Unlock(& lock->readers_mutex);
 }
 
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(klock* lock, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan_name, TimerDuration timeout)
 {
-	/* Atomically release kernel semaphore */
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
-
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
-
-	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);		
-
-	return ret;
+	return cv_wait(NULL, cv, lock, cause, timeout);
 }
 
 void kernel_signal(CondVar* cv) 
@@ -298,14 +958,123 @@ void kernel_broadcast(CondVar* cv)
 	Cond_Broadcast(cv); 
 }
 
-void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
+void kernel_signal_yield(CondVar* cv)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
+	cv_lock(cv);
+	cv_signal(cv, 1);
+	Mutex_Unlock(&(cv->waitset_lock));
+}
+
+void kernel_sleep(klock* lock, Thread_state newstate, enum SCHED_CAUSE cause)
+{
+	LOCK_RELEASED(lock);
+	sleep_posting(newstate, & lock->sem, cause, NO_TIMEOUT);
+}
+
+
+
+/*
+ *
+ * The lock profile report
+ *
+ */
+
+#ifdef LOCK_PROFILE
+
+void lock_profile_name(void* lock, const char* name)
+{
+	lock_profile* e = lock_profile_get(lock);
+	if(e) e->name = name;
 }
 
+void lock_profile_reset()
+{
+	memset(lock_table, 0, sizeof(lock_table));
+	memset(& lock_overflow, 0, sizeof(lock_overflow));
+	for(int i=0; i<FUTEX_BUCKETS; i++)
+		lock_profile_name(& futex_table[i].lock, "futex bucket");
+}
+
+/* The locks with the same name are summed in one row */
+typedef struct { lock_profile sum; unsigned int locks; } lock_row;
+
+static int lock_row_cmp(const void* a, const void* b)
+{
+	const lock_profile* x = & ((const lock_row*)a)->sum;
+	const lock_profile* y = & ((const lock_row*)b)->sum;
+	if(x->contended != y->contended) return (x->contended < y->contended) ? 1 : -1;
+	if(x->acquired != y->acquired) return (x->acquired < y->acquired) ? 1 : -1;
+	return 0;
+}
 
+static void lock_printf(char* buf, size_t size, size_t* len, const char* fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	size_t room = (*len < size) ? size - *len : 0;
+	int n = vsnprintf(room ? buf + *len : NULL, room, fmt, ap);
+	va_end(ap);
+	if(n > 0) *len += n;
+}
 
+size_t lock_profile_report(char* buf, size_t size)
+{
+	size_t len = 0;
+	if(size > 0) buf[0] = 0;
+
+	lock_row* rows = calloc(LOCK_PROFILE_SLOTS, sizeof(lock_row));
+	unsigned int nrows = 0;
+	for(int i=0; i<LOCK_PROFILE_SLOTS; i++) {
+		lock_profile* e = & lock_table[i];
+		if(e->lock == NULL || e->acquired == 0) continue;
+
+		unsigned int r = 0;
+		if(e->name)
+			while(r < nrows && !(rows[r].sum.name && strcmp(rows[r].sum.name, e->name)==0)) r++;
+		else
+			r = nrows;
+		if(r == nrows) {
+			rows[nrows].sum.lock = e->lock;
+			rows[nrows].sum.name = e->name;
+			nrows++;
+		}
+
+		lock_profile* s = & rows[r].sum;
+		rows[r].locks++;
+		s->acquired += e->acquired;
+		s->contended += e->contended;
+		s->spins += e->spins;
+		s->yields += e->yields;
+		s->sleeps += e->sleeps;
+		s->hold += e->hold;
+		if(e->max_hold > s->max_hold) s->max_hold = e->max_hold;
+	}
+	qsort(rows, nrows, sizeof(lock_row), lock_row_cmp);
+
+	lock_printf(buf, size, &len, "\nLock contention, top %d by contended acquisitions "
+		"(hold time in cycles)\n", LOCK_PROFILE_TOP);
+	lock_printf(buf, size, &len, "%-24s %5s %10s %9s %6s %10s %7s %7s %8s %9s\n", 
+		"lock", "locks", "acquired", "contended", "%", "spins", "yields", "sleeps",
+		"avg hold", "max hold");
+	for(unsigned int r=0; r<nrows && r<LOCK_PROFILE_TOP; r++) {
+		lock_profile* s = & rows[r].sum;
+		char name[32];
+		if(s->name)
+			snprintf(name, sizeof(name), "%s", s->name);
+		else
+			snprintf(name, sizeof(name), "%p", s->lock);
+		lock_printf(buf, size, &len, "%-24s %5u %10lu %9lu %6.2f %10lu %7lu %7lu %8lu %9lu\n",
+			name, rows[r].locks, s->acquired, s->contended, 
+			100.0 * s->contended / s->acquired, s->spins, s->yields, s->sleeps,
+			(unsigned long)(s->hold / s->acquired), (unsigned long) s->max_hold);
+	}
+	if(lock_overflow.acquired)
+		lock_printf(buf, size, &len, "%-24s %5s %10lu %9lu %6.2f   (locks that did not fit in the table)\n",
+			"(overflow)", "-", lock_overflow.acquired, lock_overflow.contended,
+			100.0 * lock_overflow.contended / lock_overflow.acquired);
+
+	free(rows);
+	return len;
+}
 
+#endif
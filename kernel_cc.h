@@ -32,37 +32,210 @@
 
 
 
+/**
+	@brief Try to lock a mutex without waiting.
+
+	This is used by kernel code that must not wait for a mutex, because
+	it already holds a lock that is ordered after it.
+
+	@param lock the mutex to lock
+	@returns 1 if the mutex was locked, 0 if it was already locked
+ */
+int Mutex_TryLock(Mutex* lock);
+
+
+/**
+	@brief Try to decrement a semaphore without waiting.
+
+	@param sem the semaphore
+	@returns 1 if the count was decremented, 0 if it was zero
+ */
+int Semaphore_TryWait(Semaphore* sem);
+
+
+/**
+	@brief Whether contended mutexes sleep.
+
+	In the preemptive domain, a thread that spins on a mutex for a while
+	goes to sleep in @c futex_wait, until the holder unlocks the mutex. 
+	If this is 0, the thread yields and spins again instead. This can be 
+	changed at run time, for comparisons.
+ */
+extern int mutex_sleep;
+
+
+/**
+	@brief Whether signals move waiters to the queue of their mutex.
+
+	A thread that is signalled while the mutex of its wait (or the kernel 
+	lock, for @c kernel_wait) is held, is moved to the wait queue of the 
+	mutex, instead of waking up only to block on it. Each unlock then 
+	releases one such thread, so that a broadcast does not wake a herd. 
+	If this is 0, signalled threads are always woken up. This can be 
+	changed at run time, for comparisons.
+ */
+extern int cond_morph;
+
+
+/**
+	@brief Sleep on a word, if it has the expected value.
+
+	The check and the sleep are atomic with respect to @c futex_wake, so a
+	thread that changes the word and then calls @c futex_wake cannot miss
+	the sleeper. This is the kernel side of @c FutexWait.
+
+	@param addr the word
+	@param val the expected value of the word
+	@param cause the cause of the sleep, for the scheduler
+	@param timeout the most time to sleep, or @c NO_TIMEOUT
+	@returns 0 if woken by @c futex_wake, -1 if the word did not have the
+	   value @c val, or the timeout expired
+ */
+int futex_wait(volatile uint32_t* addr, uint32_t val, 
+	enum SCHED_CAUSE cause, TimerDuration timeout);
+
+/**
+	@brief Wake up sleepers on a word.
+
+	@param addr the word
+	@param n the most threads to wake up
+	@returns the number of threads woken up
+ */
+int futex_wake(volatile uint32_t* addr, unsigned int n);
+
+
+/*
+ * Lock profiling.
+ */
+
+/**
+	@brief Profile the contention of locks.
+
+	If the kernel is compiled with @c LOCK_PROFILE defined (by 
+	@c make @c LOCK_PROFILE=1), every mutex and kernel lock counts its 
+	acquisitions, its contended acquisitions, the spin iterations, yields
+	and sleeps of its waiters, and the time it is held, in TSC cycles. 
+	The counters are kept in a table keyed by the address of the lock.
+
+	A lock can be given a name, and the locks with the same name (such as
+	the run queue locks of the cores) are reported together. The top 
+	contenders are printed at shutdown, and are appended to the stream of
+	@c OpenSchedStats.
+
+	Without @c LOCK_PROFILE, these calls compile to nothing.
+ */
+#ifdef LOCK_PROFILE
+
+/** @brief Name a lock (a @c Mutex or a @c klock) for the report, once, 
+	when it is initialized. */
+void lock_profile_name(void* lock, const char* name);
+
+/**
+	@brief Format a report of the top contended locks.
+
+	The report is written to @c buf like @c snprintf.
+	@returns the length of the whole report
+ */
+size_t lock_profile_report(char* buf, size_t size);
+
+/** @brief Clear the counters and names, at boot. */
+void lock_profile_reset();
+
+#else
+#define lock_profile_name(lock, name) ((void)0)
+static inline size_t lock_profile_report(char* buf, size_t size) { return 0; }
+#define lock_profile_reset() ((void)0)
+#endif
+
+
 /*
- * Kernel preemption control.
- * These are wrappers for the kernel monitor.
+ * Kernel locks.
+ * These are sleeping locks, held by system calls (see kernel_sys.c).
  */
 
 /**
-	@brief Lock the kernel.
+	@brief A kernel lock.
+
+	A kernel lock is a binary semaphore. Unlike a mutex, it can be held 
+	while the holder blocks in @c kernel_wait, which releases it for the 
+	duration of the wait. Threads that wait for a kernel lock sleep after
+	a short spin, like the waiters of a contended mutex.
+
+	Each kernel lock protects a part of the kernel state, and the kernel
+	condition variables on that state must be waited for and signalled 
+	with the lock held. When a thread needs two kernel locks, it takes
+	them in the order:
+	- @c proc_lock
+	- @c port_lock
+	- the lock of a stream object (a pipe or a serial device)
+	
+	A mutex (such as the file table of a process) may be locked with kernel 
+	locks held, but not the other way round.
+
+	For read-mostly state, a kernel lock can also be held in shared mode
+	(see @c kernel_lock_shared), with preference to the exclusive waiters.
  */
-void kernel_lock();
+typedef struct kernel_lock_s {
+	Semaphore sem;			/**< 1 if the lock is free, 0 if it is held */
+	uint32_t writers;		/**< Threads waiting for exclusive mode, readers sleep on it */
+	int readers;			/**< Holders in shared mode */
+	Mutex readers_mutex;	/**< Serializes the readers that come and go */
+} klock;
+
+/** @brief Initializer for kernel locks. */
+#define KLOCK_INIT ((klock){ { 1, 0 }, 0, 0, MUTEX_INIT })
+
+/** @brief The process table, with the threads and the exit status of processes */
+extern klock proc_lock;
+
+/** @brief The port table, with the listening sockets and their requests */
+extern klock port_lock;
 
 /**
-	@brief Unlock the kernel.
+	@brief Lock a kernel lock.
  */
-void kernel_unlock();
+void kernel_lock(klock* lock);
 
 /**
-	@brief Wait on a condition variable using the kernel lock.
+	@brief Unlock a kernel lock.
+
+	If a thread was handed the core by @c kernel_signal_yield, it runs now.
+ */
+void kernel_unlock(klock* lock);
+
+/**
+	@brief Lock a kernel lock in shared mode.
+
+	Many threads can hold the lock in shared mode, to read the state that 
+	it protects. A thread that waits for exclusive mode keeps new readers
+	out. A shared holder must not call @c kernel_wait or @c kernel_sleep.
+ */
+void kernel_lock_shared(klock* lock);
+
+/**
+	@brief Unlock a kernel lock held in shared mode.
+ */
+void kernel_unlock_shared(klock* lock);
+
+/**
+	@brief Wait on a condition variable, releasing a kernel lock.
+
+	The lock must be held, and it is held again when the call returns.
 	@returns 1 if signalled, 0 if not
   */
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(klock* lock, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan, TimerDuration timeout);
 
-#define kernel_wait(cv, cause) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, NO_TIMEOUT)
-#define kernel_timedwait(cv, cause, timeout) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
+#define kernel_wait(lock, cv, cause) \
+	kernel_wait_wchan((lock),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+
+#define kernel_timedwait(lock, cv, cause, timeout) \
+	kernel_wait_wchan((lock),(cv),(cause),__FUNCTION__, (timeout))
 
 /**
 	@brief Signal a kernel condition to one waiter.
 
-	This call must be made 
+	This call must be made with the kernel lock of the condition held.
   */
 void kernel_signal(CondVar* cv);
 
@@ -71,15 +244,22 @@ void kernel_signal(CondVar* cv);
   */
 void kernel_broadcast(CondVar* cv);
 
+/**
+	@brief Signal a kernel condition to one waiter, and hand it the core.
+
+	The waiter runs next on the current core, when the current thread 
+	releases the kernel lock or blocks, without going through a run queue.
+	This suits a producer that wakes its consumer.
+  */
+void kernel_signal_yield(CondVar* cv);
 
 /**
-	@brief Put thread to sleep, unlocking the kernel.
+	@brief Put thread to sleep, unlocking a kernel lock.
 
 	System calls should call this function instead of @c sleep_releasing,
-	as the kernel lock is not a mutex.
+	as a kernel lock is not a mutex.
   */
-void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
-
+void kernel_sleep(klock* lock, Thread_state state, enum SCHED_CAUSE cause);
 
 
 /** @brief Set the preemption status for the current thread.
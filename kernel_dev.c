@@ -68,7 +68,7 @@ void serial_tx_handler();
 
 typedef struct serial_device_control_block {
   uint devno;
-  Mutex spinlock;
+  klock lock;         /* Serializes the users of the device */
   CondVar rx_ready;
 } serial_dcb_t;
 
@@ -102,6 +102,7 @@ int serial_read(void* dev, char *buf, unsigned int size)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
+  kernel_lock(&dcb->lock);
   preempt_off;            /* Stop preemption */
 
   uint count =  0;
@@ -113,13 +114,14 @@ int serial_read(void* dev, char *buf, unsigned int size)
       count++;
     }
     else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
+      kernel_wait(&dcb->lock, &dcb->rx_ready, SCHED_IO);
     }
     else
       break;
   }
 
   preempt_on;           /* Restart preemption */
+  kernel_unlock(&dcb->lock);
 
   return count;
 }
@@ -143,6 +145,7 @@ int serial_write(void* dev, const char* buf, unsigned int size)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
+  kernel_lock(&dcb->lock);
   unsigned int count = 0;
   while(count < size) {
     int success = bios_write_serial(dcb->devno, buf[count] );
@@ -157,6 +160,7 @@ int serial_write(void* dev, const char* buf, unsigned int size)
     else
       break;
   }
+  kernel_unlock(&dcb->lock);
 
   return count;  
 }
@@ -210,7 +214,9 @@ void initialize_devices()
   for(int i=0; i<bios_serial_ports(); i++) {
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
-    serial_dcb[i].spinlock = MUTEX_INIT;
+    lock_profile_name(& serial_dcb[i].rx_ready.waitset_lock, "serial rx_ready");
+    serial_dcb[i].lock = KLOCK_INIT;
+    lock_profile_name(& serial_dcb[i].lock, "serial lock");
   }
 
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
@@ -9,6 +9,7 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_cc.h"
 
 
 
@@ -32,6 +33,7 @@ static struct {
   Task init_task;
   int argl;
   void* args;
+  const sched_policy* policy;
 } boot_rec;
 
 
@@ -40,11 +42,14 @@ void boot_tinyos_kernel()
 {
 
   if(cpu_core_id==0) {
+    /* Clear the lock profile of a previous boot */
+    lock_profile_reset();
+
     /* Initialize the kenrel data structures */
     initialize_processes();
     initialize_devices();
     initialize_files();
-    initialize_scheduler();
+    initialize_scheduler(boot_rec.policy);
 
     //Students Functions.
     initialize_pipe_ops();
@@ -64,12 +69,43 @@ void boot_tinyos_kernel()
 
   run_scheduler();
 
+  /* Wait until every core has left the scheduler */
+  cpu_core_barrier_sync();
+
   if(cpu_core_id==0) {
     /* Here, we could add cleanup after the scheduler has ended. */    
+
+    /* Print the scheduler statistics, if the environment asks for them */
+    if(getenv("TINYOS_SCHEDSTATS") != NULL) {
+      size_t len = sched_stats_report(NULL, 0);
+      char* report = malloc(len+1);
+      sched_stats_report(report, len+1);
+      fputs(report, stderr);
+      free(report);
+    }
+
+#ifdef LOCK_PROFILE
+    /* Print the top contended locks */
+    size_t len = lock_profile_report(NULL, 0);
+    char* report = malloc(len+1);
+    lock_profile_report(report, len+1);
+    fputs(report, stderr);
+    free(report);
+#endif
   }
 }
 
 
+int set_scheduler_policy(const char* name)
+{
+  const sched_policy* policy = NULL;
+  if(name != NULL && (policy = sched_find_policy(name)) == NULL)
+    return -1;
+  boot_rec.policy = policy;
+  return 0;
+}
+
+
 void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
 {
   boot_rec.init_task = boot_task;
@@ -35,6 +35,9 @@ typedef struct Pipe_Control_Block
 	//Condition Variables.
 	CondVar haspace, hasdata;
 
+	//Protects the pipe (kept last, it must match the copy in kernel_socket.c).
+	klock lock;
+
 }PIPCB;
 //================================Pipe Control Block================================//
 
@@ -73,15 +76,18 @@ int pipe_reader_read(void* this, char *buf, unsigned int size)
 	else
 		return -1;
 
+	kernel_lock( &(pipe->lock) );
 	
 	//Reader has reached the writer but the writer is still alive!
 	while ( pipe->buffer_size == 0 && pipe->pip_t.write != -1 )
-		kernel_wait( &(pipe->hasdata), SCHED_PIPE );
+		kernel_wait( &(pipe->lock), &(pipe->hasdata), SCHED_PIPE );
 	
 
 	//EOF Reached.
-	if (pipe->buffer_size == 0 && pipe->pip_t.write == -1)
+	if (pipe->buffer_size == 0 && pipe->pip_t.write == -1) {
+		kernel_unlock( &(pipe->lock) );
 		return 0;
+	}
 	
 	//Read.
 	for (int i = 0; i < size; i++)
@@ -108,8 +114,13 @@ int pipe_reader_read(void* this, char *buf, unsigned int size)
 			break;
 	}
 
-	//Wake up all those who wait two write data.
-	kernel_broadcast( &(pipe->haspace) );
+	//Hand the core to a writer. If it leaves space, it wakes the next writer.
+	kernel_signal_yield( &(pipe->haspace) );
+
+	//There is still data, wake the next reader.
+	if (pipe->buffer_size > 0)
+		kernel_signal( &(pipe->hasdata) );
+	kernel_unlock( &(pipe->lock) );
 	
 	//Return the amount of read bytes.
 	return counter;
@@ -139,7 +150,9 @@ int pipe_reader_close(void* this)
 		return -1;
 
 	//The write FCB closed.
+	kernel_lock( &(pipe->lock) );
 	pipe->pip_t.read = -1;
+	kernel_unlock( &(pipe->lock) );
 
 
 	//The writer is still using the pipe, so don't destroy it.
@@ -198,14 +211,17 @@ int pipe_writer_write(void* this, const char* buf, unsigned int size)
 	else
 		return -1;
 
+	kernel_lock( &(pipe->lock) );
 	
 	//While the buffer is full, wait.
 	while (pipe->buffer_size >= size_of_buffer)
-		kernel_wait( &(pipe->haspace), SCHED_PIPE );
+		kernel_wait( &(pipe->lock), &(pipe->haspace), SCHED_PIPE );
 	
 	//Reader has closed.
-	if (pipe->pip_t.read == -1)
+	if (pipe->pip_t.read == -1) {
+		kernel_unlock( &(pipe->lock) );
 		return -1;
+	}
 	
 
 	//Copy the bytes to the pipe buffer.
@@ -232,8 +248,13 @@ int pipe_writer_write(void* this, const char* buf, unsigned int size)
 			break;
 	}
 
-	//Wake up all those who wait to read data.
-	kernel_broadcast( &(pipe->hasdata) );
+	//Hand the core to a reader. If it leaves data, it wakes the next reader.
+	kernel_signal_yield( &(pipe->hasdata) );
+
+	//There is still space, wake the next writer.
+	if (pipe->buffer_size < size_of_buffer)
+		kernel_signal( &(pipe->haspace) );
+	kernel_unlock( &(pipe->lock) );
 
 	//Return number of bytes written into the pipe buffer.
 	return counter;
@@ -255,11 +276,13 @@ int pipe_writer_close(void* this)
 		return -1;
 
 	//The write FCB closed.
+	kernel_lock( &(pipe->lock) );
 	pipe->pip_t.write = -1;
 
 
 	//Do a final broadcast.
 	kernel_broadcast( &(pipe->hasdata) );
+	kernel_unlock( &(pipe->lock) );
 
 
 	//The reader is still using the pipe, so don't destroy it.
@@ -328,6 +351,10 @@ int sys_Pipe(pipe_t* pip_t_giveaway)
 	new_pipe->buffer_size = 	0;
 	new_pipe->hasdata     = COND_INIT;
 	new_pipe->haspace     = COND_INIT;
+	new_pipe->lock        = KLOCK_INIT;
+	lock_profile_name(&new_pipe->lock, "PIPCB.lock");
+	lock_profile_name(&new_pipe->hasdata.waitset_lock, "PIPCB.hasdata");
+	lock_profile_name(&new_pipe->haspace.waitset_lock, "PIPCB.haspace");
 	//----------Initialize the Structure----------//
 
 
@@ -360,6 +387,10 @@ PIPCB *create_pipe(Fid_t fid_1, Fid_t fid_2)
 	new_pipe->buffer_size = 	    0;
 	new_pipe->hasdata     = COND_INIT;
 	new_pipe->haspace     = COND_INIT;
+	new_pipe->lock        = KLOCK_INIT;
+	lock_profile_name(&new_pipe->lock, "PIPCB.lock");
+	lock_profile_name(&new_pipe->hasdata.waitset_lock, "PIPCB.hasdata");
+	lock_profile_name(&new_pipe->haspace.waitset_lock, "PIPCB.haspace");
 	//----------Initialize the Structure----------//
 
 
@@ -23,6 +23,9 @@ static file_ops open_info_ops;
 PCB PT[MAX_PROC];
 unsigned int process_count;
 
+/* Protects the process table, the process tree and the threads of every process */
+klock proc_lock = KLOCK_INIT;
+
 PCB* get_pcb(Pid_t pid)
 {
   return PT[pid].pstate==FREE ? NULL : &PT[pid];
@@ -40,9 +43,14 @@ static inline void initialize_PCB(PCB* pcb)
   pcb->argl = 0;
   pcb->args = NULL;
   pcb->num_of_threads = 0;
+  pcb->nice = 0;
+  pcb->weight = NICE_0_WEIGHT;
+  pcb->fair_vruntime = 0;
+  pcb->fair_runnable = 0;
 
   for(int i=0;i<MAX_FILEID;i++)
     pcb->FIDT[i] = NULL;
+  pcb->fidt_lock = MUTEX_INIT;
 
   rlnode_init(& pcb->children_list, NULL);
   rlnode_init(& pcb->exited_list, NULL);
@@ -53,6 +61,7 @@ static inline void initialize_PCB(PCB* pcb)
   rlnode_init( &(pcb->ptcb_head), NULL );
   
   pcb->child_exit = COND_INIT;
+  lock_profile_name(& pcb->child_exit.waitset_lock, "PCB.child_exit");
 }
 
 
@@ -60,6 +69,8 @@ static PCB* pcb_freelist;
 
 void initialize_processes()
 {
+  lock_profile_name(& proc_lock, "proc_lock");
+
   /* initialize the PCBs */
   for(Pid_t p=0; p<MAX_PROC; p++) {
     initialize_PCB(&PT[p]);
@@ -83,7 +94,7 @@ void initialize_processes()
 
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 PCB* acquire_PCB()
 {
@@ -94,13 +105,14 @@ PCB* acquire_PCB()
     pcb->pstate = ALIVE;
     pcb_freelist = pcb_freelist->parent;
     process_count++;
+    lock_profile_name(& pcb->fidt_lock, "PCB.fidt_lock");
   }
 
   return pcb;
 }
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 void release_PCB(PCB* pcb)
 {
@@ -155,8 +167,8 @@ void start_another_thread()
       //Call the task.
       CURTHREAD->tcb_ptcb->exit_value  = call(argl, args);
 
-      //Call the thread exit.
-      sys_ThreadExit(CURTHREAD->tcb_ptcb->exit_value);
+      //Call the thread exit (as a system call, it must take the kernel lock).
+      ThreadExit(CURTHREAD->tcb_ptcb->exit_value);
     }
 
   }
@@ -180,6 +192,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     /* Processes with pid<=1 (the scheduler and the init process) 
        are parentless and are treated specially. */
     newproc->parent = NULL;
+    newproc->nice = 0;
   }
   else
   {
@@ -190,18 +203,31 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     newproc->parent = curproc;
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
+    /* Inherit the nice value */
+    newproc->nice = curproc->nice;
+
     /* Inherit file streams from parent */
+    Mutex_Lock(& curproc->fidt_lock);
     for(int i=0; i<MAX_FILEID; i++) {
        newproc->FIDT[i] = curproc->FIDT[i];
        if(newproc->FIDT[i])
           FCB_incref(newproc->FIDT[i]);
     }
+    Mutex_Unlock(& curproc->fidt_lock);
   }
 
 
   /* Set the main thread's function */
   newproc->main_task = call;
 
+  newproc->weight = sched_nice_weight(newproc->nice);
+
+  /* Reset accounting */
+  newproc->run_time = 0;
+  newproc->wait_time = 0;
+  newproc->vol_switches = 0;
+  newproc->invol_switches = 0;
+
   /* Copy the arguments to new storage, owned by the new process */
   newproc->argl = argl;
   if(args!=NULL) {
@@ -223,7 +249,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
   if(call != NULL) {
 
     //Create The Main Process.
-    newproc->main_thread = spawn_thread(newproc, start_main_thread);
+    newproc->main_thread = spawn_thread(newproc, start_main_thread, THREAD_STACK_SIZE);
 
     //Increase the number of threads of this process.
     newproc->num_of_threads++;
@@ -232,7 +258,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     newproc->main_thread->tcb_ptcb->is_main = 1;
 
     //Append the ptcb of the main thread into the process list.
-    rlist_append( &(newproc->ptcb_head), &(newproc->main_thread->tcb_ptcb->ptcb_node) );
+    rlist_push_back( &(newproc->ptcb_head), &(newproc->main_thread->tcb_ptcb->ptcb_node) );
 
     wakeup(newproc->main_thread);
   }
@@ -256,6 +282,22 @@ Pid_t sys_GetPPid()
 }
 
 
+int sys_SetNice(Pid_t pid, int nice)
+{
+  if(nice < NICE_MIN || nice > NICE_MAX) return -1;
+
+  PCB* pcb;
+  if(pid == NOPROC)
+    pcb = CURPROC;
+  else if(pid < 0 || pid >= MAX_PROC || (pcb = get_pcb(pid)) == NULL || pcb->pstate != ALIVE)
+    return -1;
+
+  pcb->nice = nice;
+  pcb->weight = sched_nice_weight(nice);
+  return 0;
+}
+
+
 static void cleanup_zombie(PCB* pcb, int* status)
 {
   if(status != NULL)
@@ -287,7 +329,7 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
   while(child->pstate == ALIVE)
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    kernel_wait(& proc_lock, & parent->child_exit, SCHED_USER);
   
   cleanup_zombie(child, status);
   
@@ -309,7 +351,7 @@ static Pid_t wait_for_any_child(int* status)
   }
 
   while(is_rlist_empty(& parent->exited_list)) {
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    kernel_wait(& proc_lock, & parent->child_exit, SCHED_USER);
   }
 
   PCB* child = parent->exited_list.next->pcb;
@@ -354,10 +396,12 @@ void sys_Exit(int exitval)
 
   /* Clean up FIDT */
   for(int i=0;i<MAX_FILEID;i++) {
-    if(curproc->FIDT[i] != NULL) {
-      FCB_decref(curproc->FIDT[i]);
-      curproc->FIDT[i] = NULL;
-    }
+    Mutex_Lock(& curproc->fidt_lock);
+    FCB* fcb = curproc->FIDT[i];
+    curproc->FIDT[i] = NULL;
+    Mutex_Unlock(& curproc->fidt_lock);
+    if(fcb != NULL)
+      FCB_decref(fcb);
   }
 
   /* Reparent any children of the exiting process to the 
@@ -432,6 +476,19 @@ int info_read(void* this, char *buf, unsigned int size)
   //Cast this to an OCB object.
   OCB *ocb = (OCB *)this;
 
+  //Read the process table, sharing the process lock with other readers.
+  kernel_lock_shared(& proc_lock);
+
+  //Skip the free PCBs.
+  while (ocb->next_pcb < MAX_PROC && PT[ocb->next_pcb].pstate == FREE)
+    ocb->next_pcb++;
+
+  //EOF Reached because we are out of bounds in the process table.
+  if ( ocb->next_pcb >= MAX_PROC ) {
+    kernel_unlock_shared(& proc_lock);
+    return 0;
+  }
+
   //Get the nect pcb.
   PCB next_pcb = PT[ocb->next_pcb];
 
@@ -439,9 +496,9 @@ int info_read(void* this, char *buf, unsigned int size)
   info->alive = next_pcb.pstate;
   info->argl  = next_pcb.argl;
 
-  //Get the args characters.
+  //Get the args characters (at most PROCINFO_MAX_ARGS_SIZE of them).
   char *temp = (char *)next_pcb.args;
-  for (int i = 0; i < info->argl; i++)
+  for (int i = 0; i < info->argl && i < PROCINFO_MAX_ARGS_SIZE; i++)
     info->args[i] = temp[i];
 
   //Main task and PID.
@@ -458,24 +515,23 @@ int info_read(void* this, char *buf, unsigned int size)
   
   //Thread count.
   info->thread_count = next_pcb.num_of_threads;
+
+  //Accounting of the process.
+  info->prio           = next_pcb.main_thread ? (int)next_pcb.main_thread->prio : -1;
+  info->nice           = next_pcb.nice;
+  info->run_time       = next_pcb.run_time;
+  info->wait_time      = next_pcb.wait_time;
+  info->vol_switches   = next_pcb.vol_switches;
+  info->invol_switches = next_pcb.invol_switches;
   //----------Initialize the info object----------//
 
 
   //Go to the next process.
   ocb->next_pcb++;
+  kernel_unlock_shared(& proc_lock);
 
-
-  //EOF Reached because we are out of bounds in the process table.
-  if ( ocb->next_pcb >= MAX_PROC )
-    return 0;
-    
-  //EOF Reached because the next PCB is free.
-  else if ( PT[ocb->next_pcb].pstate == FREE )
-    return 0;
-
-  //Else just return the procinfo size.
-  else
-    return sizeof(procinfo);
+  //Return the procinfo size.
+  return sizeof(procinfo);
 }
 
 
@@ -505,6 +561,110 @@ int info_close(void* this)
 
 
 
+//--------------------------Sched Stats Functions--------------------------//
+
+//Sched stats data structure: a snapshot of the report, read in order.
+typedef struct sched_stats_control_block
+{
+  char *report;
+  size_t len;
+  size_t pos;
+
+}SSCB;
+
+
+//Sched stats READ Function.
+static int sched_stats_read(void* this, char *buf, unsigned int size)
+{
+  SSCB *sscb = (SSCB *)this;
+
+  //Copy as much of the rest of the report as fits.
+  size_t count = sscb->len - sscb->pos;
+  if (count > size) count = size;
+  memcpy(buf, sscb->report + sscb->pos, count);
+  sscb->pos += count;
+
+  return count;
+}
+
+
+//Sched stats WRITE Function.
+static int sched_stats_write(void* this, const char* buf, unsigned int size)
+{
+  return -1;
+}
+
+
+//Sched stats CLOSE Function.
+static int sched_stats_close(void* this)
+{
+  SSCB *sscb = (SSCB *)this;
+  free(sscb->report);
+  free(sscb);
+  return 0;
+}
+
+static file_ops sched_stats_ops = {
+  .Open  = info_open,
+  .Read  = sched_stats_read,
+  .Write = sched_stats_write,
+  .Close = sched_stats_close
+};
+
+//--------------------------Sched Stats Functions--------------------------//
+
+
+
+
+//--------------------------Thread Info Functions--------------------------//
+
+//Thread info data structure: a snapshot of the threads, read in order.
+typedef struct thread_info_control_block
+{
+  threadinfo *threads;
+  int count;
+  int next;
+
+}TICB;
+
+
+//Thread info READ Function.
+static int thread_info_read(void* this, char *buf, unsigned int size)
+{
+  TICB *ticb = (TICB *)this;
+
+  //EOF, or the buffer cannot hold a record.
+  if (ticb->next >= ticb->count || size < sizeof(threadinfo))
+    return 0;
+
+  memcpy(buf, &ticb->threads[ticb->next], sizeof(threadinfo));
+  ticb->next++;
+
+  return sizeof(threadinfo);
+}
+
+
+//Thread info CLOSE Function.
+static int thread_info_close(void* this)
+{
+  TICB *ticb = (TICB *)this;
+  free(ticb->threads);
+  free(ticb);
+  return 0;
+}
+
+static file_ops thread_info_ops = {
+  .Open  = info_open,
+  .Read  = thread_info_read,
+  .Write = sched_stats_write,
+  .Close = thread_info_close
+};
+
+//--------------------------Thread Info Functions--------------------------//
+
+
+
+
 //Initialize open info function.
 void initialize_openInfo()
 {
@@ -548,3 +708,99 @@ Fid_t sys_OpenInfo()
 	return fidts[0];
 }
 
+
+
+
+//Open Sched Stats System Call.
+Fid_t sys_OpenSchedStats()
+{
+  Fid_t fidts[1];
+  FCB   *fcbs[1];
+
+  //Reserve 1 FCB.
+  if ( !FCB_reserve(1, fidts, fcbs) )
+    return NOFILE;
+
+  //Take a snapshot of the report.
+  SSCB *new_sscb = (SSCB *)malloc(sizeof(SSCB));
+  size_t n = sched_stats_report(NULL, 0);
+  new_sscb->len    = n + lock_profile_report(NULL, 0);
+  new_sscb->report = (char *)malloc(new_sscb->len+1);
+  sched_stats_report(new_sscb->report, n+1);
+  lock_profile_report(new_sscb->report+n, new_sscb->len-n+1);
+  new_sscb->len    = strlen(new_sscb->report);
+  new_sscb->pos    = 0;
+
+  fcbs[0]->streamfunc = &sched_stats_ops;
+  fcbs[0]->streamobj  = new_sscb;
+
+  return fidts[0];
+}
+
+
+
+
+//Open Thread Info System Call (called with proc_lock shared).
+Fid_t sys_OpenThreadInfo()
+{
+  Fid_t fidts[1];
+  FCB   *fcbs[1];
+
+  //Reserve 1 FCB.
+  if ( !FCB_reserve(1, fidts, fcbs) )
+    return NOFILE;
+
+  //Count the threads.
+  int count = 0;
+  for (Pid_t p = 0; p < MAX_PROC; p++)
+    if (PT[p].pstate != FREE)
+      count += rlist_len( &(PT[p].ptcb_head) );
+
+  //Take a snapshot of their accounting.
+  TICB *new_ticb    = (TICB *)malloc(sizeof(TICB));
+  new_ticb->threads = (threadinfo *)calloc(count ? count : 1, sizeof(threadinfo));
+  new_ticb->count   = 0;
+  new_ticb->next    = 0;
+
+  for (Pid_t p = 0; p < MAX_PROC; p++) {
+    if (PT[p].pstate == FREE) continue;
+
+    for (rlnode *n = PT[p].ptcb_head.next; n != &(PT[p].ptcb_head); n = n->next) {
+      PTCB *ptcb = n->ptcb;
+      TCB  *tcb  = ptcb->tcb;
+      threadinfo *info = &new_ticb->threads[new_ticb->count++];
+
+      info->pid            = p;
+      info->tid            = (Tid_t)ptcb;
+      info->is_main        = ptcb->is_main;
+      info->exited         = ptcb->exited_flag;
+      info->prio           = tcb->prio;
+      info->last_core      = tcb->last_core;
+      info->run_time       = tcb->run_time;
+      info->wait_time      = tcb->wait_time;
+      info->vol_switches   = tcb->vol_switches;
+      info->invol_switches = tcb->invol_switches;
+    }
+  }
+
+  fcbs[0]->streamfunc = &thread_info_ops;
+  fcbs[0]->streamobj  = new_ticb;
+
+  return fidts[0];
+}
+
+
+
+
+//Get Core Times System Call.
+unsigned int sys_GetCoreTimes(unsigned long* busy, unsigned long* idle, unsigned int n)
+{
+  unsigned int ncores = cpu_cores();
+
+  for (unsigned int c = 0; c < ncores && c < n; c++) {
+    if (busy) busy[c] = cctx[c].busy_time;
+    if (idle) idle[c] = cctx[c].idle_time;
+  }
+
+  return ncores;
+}
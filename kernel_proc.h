@@ -54,6 +54,7 @@ typedef struct process_control_block {
   CondVar child_exit;     /**< Condition variable for @c WaitChild */
 
   FCB* FIDT[MAX_FILEID];  /**< The fileid table of the process */
+  Mutex fidt_lock;        /**< Protects @c FIDT among the threads of the process */
 
   //PTCB Head;
   rlnode ptcb_head;
@@ -61,6 +62,20 @@ typedef struct process_control_block {
   //Number of threads that exists in this process.
   int num_of_threads;
 
+  //Accounting, summed over all threads of the process (see the TCB).
+  TimerDuration run_time;
+  TimerDuration wait_time;
+  unsigned long vol_switches;
+  unsigned long invol_switches;
+
+  //Weight of the process in the fair-share policy.
+  int nice;
+  unsigned int weight;
+  TimerDuration fair_vruntime; /**< Virtual runtime of the process in the fair-share policy */
+  int fair_runnable;      /**< Threads of the process that are ready or running 
+                               (not reset at Exec, a thread of a previous user 
+                               of the PCB may still be leaving its core) */
+
 } PCB;
 
 
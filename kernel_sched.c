@@ -1,5 +1,7 @@
 
 #include <assert.h>
+#include <stddef.h>
+#include <stdarg.h>
 #include <sys/mman.h>
 
 #include "tinyos.h"
@@ -14,21 +16,10 @@
 
 
 //----------Here we define some usefull macros----------//
-#define num_of_queues 10
-#define debugger 0
+#define num_of_queues SCHED_QUEUES
 //----------Here we define some usefull macros----------//
 
 
-//Define the scheduler list.
-rlnode SCHEDULER[num_of_queues];
-
-//An index.
-unsigned int next_queue = 1;
-
-//Create a file pointer for debugging.
-FILE *debug_file;
-
-
 /*
    The thread layout.
   --------------------
@@ -67,32 +58,51 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE  (1<<12)
 
+/* 
+  The TCB and the PTCB of a thread live in the same memory block,
+  at the top of the thread stack.
+*/
+typedef struct thread_block {
+  TCB tcb;
+  PTCB ptcb;
+} thread_block;
+
 /* The memory allocated for the TCB must be a multiple of SYSTEM_PAGE_SIZE */
-#define THREAD_TCB_SIZE   (((sizeof(TCB)+SYSTEM_PAGE_SIZE-1)/SYSTEM_PAGE_SIZE)*SYSTEM_PAGE_SIZE)
+#define THREAD_TCB_SIZE   (((sizeof(thread_block)+SYSTEM_PAGE_SIZE-1)/SYSTEM_PAGE_SIZE)*SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE  (THREAD_TCB_SIZE+THREAD_STACK_SIZE)
+/* Use mmap for thread memory, unless malloc is requested at build time */
+#ifndef MALLOC_THREAD_MEM
+#define MMAPPED_THREAD_MEM 
+#endif
 
-//#define MMAPPED_THREAD_MEM 
 #ifdef MMAPPED_THREAD_MEM 
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Use mmap to allocate a thread. The memory of a thread is
+
+    [ guard page | stack ... | TCB,PTCB ]
+
+  The whole block is reserved, but pages are only committed by the host
+  when they are touched, so a parked thread costs a few pages, no matter
+  how large its stack is. The guard page is PROT_NONE, so that a stack 
+  overflow is detected as seg.fault, instead of corrupting other memory.
  */
-void free_thread(void* ptr, size_t size)
+#define THREAD_GUARD_SIZE  SYSTEM_PAGE_SIZE
+
+static void free_thread(void* ptr, size_t size)
 {
   CHECK(munmap(ptr, size));
 }
 
-void* allocate_thread(size_t size)
+static void* allocate_thread(size_t size)
 {
   void* ptr = mmap(NULL, size, 
       PROT_READ|PROT_WRITE|PROT_EXEC,  
-      MAP_ANONYMOUS  | MAP_PRIVATE 
+      MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE
       , -1,0);
   
   CHECK((ptr==MAP_FAILED)?-1:0);
+  CHECK(mprotect(ptr, THREAD_GUARD_SIZE, PROT_NONE));
 
   return ptr;
 }
@@ -101,12 +111,14 @@ void* allocate_thread(size_t size)
   Use malloc to allocate a thread. This is probably faster than  mmap, but cannot
   be made easily to 'detect' stack overflow.
  */
-void free_thread(void* ptr, size_t size)
+#define THREAD_GUARD_SIZE  0
+
+static void free_thread(void* ptr, size_t size)
 {
   free(ptr);
 }
 
-void* allocate_thread(size_t size)
+static void* allocate_thread(size_t size)
 {
   void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
   CHECK((ptr==NULL)?-1:0);
@@ -114,6 +126,73 @@ void* allocate_thread(size_t size)
 }
 #endif
 
+/* The size of the memory block of a thread, for a given stack size */
+#define THREAD_SIZE(stack_size)  (THREAD_GUARD_SIZE+(stack_size)+THREAD_TCB_SIZE)
+
+/* The start of the memory block of a thread */
+#define THREAD_BASE(tcb)  (((void*)(tcb)) - (tcb)->stack_size - THREAD_GUARD_SIZE)
+
+
+/*
+  Released thread blocks are kept in a cache of the core, up to
+  THREAD_CACHE_MAX blocks. A recycled block is cheaper than a new one: it
+  needs no allocation, and its stack pages are already mapped.
+
+  Only blocks with the default stack size are cached.
+  Each core only touches its own cache, with preemption off.
+*/
+#define THREAD_CACHE_MAX 64
+
+static TCB* thread_block_get(size_t stack_size)
+{
+  int preempt = preempt_off;
+  CCB* core = & CURCORE;
+  TCB* tcb;
+
+  if(stack_size == THREAD_STACK_SIZE && core->thread_cache_size > 0) {
+    tcb = rlist_pop_front(& core->thread_cache)->tcb;
+    core->thread_cache_size--;
+    core->thread_cache_hits++;
+  } else {
+    void* base = allocate_thread(THREAD_SIZE(stack_size));
+    tcb = (TCB*) (base + THREAD_GUARD_SIZE + stack_size);
+    tcb->stack_size = stack_size;
+    core->thread_cache_misses++;
+  }
+
+  if(preempt) preempt_on;
+  return tcb;
+}
+
+/* Drop a reference to a thread block, and recycle it when unused */
+static void thread_block_put(TCB* tcb)
+{
+  if(__atomic_sub_fetch(& tcb->block_refs, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  int preempt = preempt_off;
+  CCB* core = & CURCORE;
+
+  if(tcb->stack_size == THREAD_STACK_SIZE && core->thread_cache_size < THREAD_CACHE_MAX) {
+    /* The most recently used block is reused first */
+    rlist_push_front(& core->thread_cache, & tcb->sched_node);
+    core->thread_cache_size++;
+  } else {
+    free_thread(THREAD_BASE(tcb), THREAD_SIZE(tcb->stack_size));
+  }
+
+  if(preempt) preempt_on;
+}
+
+void thread_cache_stats(unsigned long* hits, unsigned long* misses)
+{
+  *hits = *misses = 0;
+  for(uint c=0; c<MAX_CORES; c++) {
+    *hits += cctx[c].thread_cache_hits;
+    *misses += cctx[c].thread_cache_misses;
+  }
+}
+
 
 
 /*
@@ -136,10 +215,14 @@ static void thread_start()
   Initialize and return a new TCB
 */
 
-TCB* spawn_thread(PCB* pcb, void (*func)())
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size)
 {
   /* The allocated thread size must be a multiple of page size */
-  TCB* tcb = (TCB*) allocate_thread(THREAD_SIZE);
+  if(stack_size == 0) stack_size = THREAD_STACK_SIZE;
+  if(stack_size < THREAD_STACK_MIN) stack_size = THREAD_STACK_MIN;
+  stack_size = ((stack_size+SYSTEM_PAGE_SIZE-1)/SYSTEM_PAGE_SIZE)*SYSTEM_PAGE_SIZE;
+
+  TCB* tcb = thread_block_get(stack_size);
 
   /* Set the owner */
   tcb->owner_pcb = pcb;
@@ -148,25 +231,48 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
   tcb->type = NORMAL_THREAD;
   tcb->state = INIT;
   tcb->phase = CTX_CLEAN;
+  tcb->ici_nested = 0;
   tcb->thread_func = func;
   tcb->wakeup_time = NO_TIMEOUT;
+  tcb->state_spinlock = MUTEX_INIT;
+  lock_profile_name(& tcb->state_spinlock, "TCB.state_spinlock");
 
   //Initialize priority.
   tcb->prio = 0;
+  tcb->last_core = cpu_core_id;
+  tcb->affinity = CORE_MASK_ALL;
+  tcb->last_run = 0;
+  tcb->recent_cpu = 0;
+  tcb->recent_stamp = bios_clock();
+  rbnode_init(& tcb->fair_node, tcb);
+  tcb->fair_lag = 0;
+  tcb->edf_period = 0;
+  tcb->edf_jobs = 0;
+  tcb->edf_misses = 0;
+  rbnode_init(& tcb->edf_node, tcb);
+  tcb->fair_charged = 0;
+
+  //Initialize accounting.
+  tcb->run_time = 0;
+  tcb->wait_time = 0;
+  tcb->acct_stamp = 0;
+  tcb->last_cause = SCHED_USER;
+  tcb->vol_switches = 0;
+  tcb->invol_switches = 0;
 
 
   rlnode_init(& tcb->sched_node, tcb);  /* Intrusive list node */
 
 
   /* Compute the stack segment address and size */
-  void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+  void* sp = ((void*)tcb) - stack_size;
 
   /* Init the context */
-  cpu_initialize_context(& tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+  cpu_initialize_context(& tcb->context, sp, stack_size, thread_start);
 
 #ifndef NVALGRIND
   tcb->valgrind_stack_id = 
-    VALGRIND_STACK_REGISTER(sp, sp+THREAD_STACK_SIZE);
+    VALGRIND_STACK_REGISTER(sp, sp+stack_size);
 #endif
 
   /* increase the count of active threads */
@@ -175,8 +281,9 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
   Mutex_Unlock(&active_threads_spinlock);
 
 
-  //Allocate memory for ptcb.
-  tcb->tcb_ptcb = (PTCB *)malloc(sizeof(PTCB));
+  //The ptcb lives in the same block, which is released by both.
+  tcb->tcb_ptcb = & ((thread_block*)tcb)->ptcb;
+  tcb->block_refs = 2;
 
 
   //------------Initialize PTCB------------//
@@ -192,6 +299,7 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
   tcb->tcb_ptcb->is_main      = 0;
   tcb->tcb_ptcb->is_detached  = 0;
   tcb->tcb_ptcb->joinVar      = COND_INIT;
+  lock_profile_name(& tcb->tcb_ptcb->joinVar.waitset_lock, "PTCB.joinVar");
   //------------Initialize PTCB------------//
  
   return tcb;
@@ -199,7 +307,8 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 
 
 /*
-  This is called with tcb->state_spinlock locked !
+  This is called after tcb->state_spinlock has been released, since
+  the lock lives inside the memory that is freed here.
  */
 void release_TCB(TCB* tcb)
 {
@@ -207,7 +316,8 @@ void release_TCB(TCB* tcb)
   VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);    
 #endif
 
-  free_thread(tcb, THREAD_SIZE);
+  edf_release(tcb);
+  thread_block_put(tcb);
 
   Mutex_Lock(&active_threads_spinlock);
   active_threads--;
@@ -215,6 +325,13 @@ void release_TCB(TCB* tcb)
 }
 
 
+void release_PTCB(PTCB* ptcb)
+{
+  thread_block* block = (thread_block*)((char*)ptcb - offsetof(thread_block, ptcb));
+  thread_block_put(& block->tcb);
+}
+
+
 /*
  *
  * Scheduler
@@ -230,171 +347,859 @@ void release_TCB(TCB* tcb)
 /* Core control blocks */
 CCB cctx[MAX_CORES];
 
+/* The scheduling policy */
+const sched_policy* SCHED = & sched_mlfq;
+
+static const sched_policy* const sched_policies[] = {
+  & sched_mlfq, & sched_rr, & sched_decay, & sched_fair, NULL
+};
+
+const sched_policy* sched_find_policy(const char* name)
+{
+  for(int i=0; sched_policies[i]!=NULL; i++)
+    if(strcmp(sched_policies[i]->name, name)==0)
+      return sched_policies[i];
+  return NULL;
+}
+
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
-	
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
+  Each core owns a multilevel run queue (ready_list in its CCB), protected
+  by the core's rq_spinlock. The non-empty levels are marked in ready_mask,
+  so that selection is a find-first-set. A core takes threads from its own run queue,
+  and only when it is empty it steals a batch of threads from the busiest
+  core.
+
+  The state of each thread is protected by its own tcb->state_spinlock.
 
-  Both of these structures are protected by @c sched_spinlock.
+  Also, the scheduler contains a timer wheel of all the sleeping
+  threads with a timeout, protected by @c timeout_spinlock.
+
+  Lock ordering:  state_spinlock -> timeout_spinlock -> rq_spinlock.
+  No code holds two rq_spinlocks (or two state_spinlocks) at the same time.
 */
 
 
-rlnode TIMEOUT_LIST;				  /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT;    /* spinlock for scheduler queue */
+/*
+  The timer wheel is a hashed array of TIMER_SLOTS unsorted lists. A thread
+  that wakes up at time t (in usec) is kept in slot (t/TIMER_TICK) % TIMER_SLOTS,
+  therefore a timeout is added and cancelled in O(1). 
+
+  Slots are expired in order, up to the current tick. A slot may also
+  contain threads that wake up in a later round of the wheel, these are
+  skipped.
+*/
+#define TIMER_TICK  1000      /* usec per slot, the resolution of bios_clock() */
+#define TIMER_SLOTS 512       /* slots in the wheel, must be a power of 2 */
+
+rlnode TIMER_WHEEL[TIMER_SLOTS];	  /* The threads with a timeout */
+uint64_t timer_slot_mask[TIMER_SLOTS/64]; /* Bit i is set if TIMER_WHEEL[i] may be non-empty */
+TimerDuration timer_next_tick;        /* The first tick not yet expired */
+unsigned int timer_count;             /* Number of threads in TIMER_WHEEL */
+Mutex timeout_spinlock = MUTEX_INIT;  /* spinlock for TIMER_WHEEL */
+
+/* Maximum number of threads moved by a single steal */
+#define STEAL_BATCH 8
+
+/* Maximum number of threads a steal looks at */
+#define STEAL_SCAN 32
 
 
 
+static void sched_expire_timeouts();
+static void sched_set_timeslice(CCB* core, TimerDuration slice);
+static inline void sched_account_switch(TCB* current, TCB* next, int current_ready, int preempted);
+
+
+/* 
+  True if the deadline queue of a core has a thread more urgent than the 
+  current thread. 
+*/
+static int sched_edf_urgent(CCB* core)
+{
+  /* Called from interrupt handlers, where the lock must not sleep */
+  int preempt = preempt_off;
+  Mutex_Lock(& core->rq_spinlock);
+  rbnode* edf = rbtree_first(& core->edf_queue);
+  int urgent = (edf != NULL && edf->key < core->edf_running);
+  Mutex_Unlock(& core->rq_spinlock);
+  if(preempt) preempt_on;
+  return urgent;
+}
+
+
 /* Interrupt handler for ALARM */
 void yield_handler()
 {
-  yield(SCHED_QUANTUM);
+  CCB* core = & CURCORE;
+
+  /* An alarm before the end of the timeslice was set for a timeout */
+  TimerDuration curtime = bios_clock();
+  if(! core->tickless && curtime + TIMER_TICK < core->slice_end) {
+  	sched_expire_timeouts();
+  	if(sched_edf_urgent(core))
+  		yield(SCHED_PREEMPT);
+  	else
+  		sched_set_timeslice(core, core->slice_end - curtime);
+  	return;
+  }
+
+  /* The policy may let the current thread run another quantum */
+  if(! core->tickless && SCHED->keep && CURTHREAD->type != IDLE_THREAD 
+     && core->edf_running == NO_TIMEOUT && ! core->parked && ! sched_edf_urgent(core)) {
+  	sched_account_switch(CURTHREAD, CURTHREAD, 1, 0);
+  	int preempt = preempt_off;
+  	Mutex_Lock(& core->rq_spinlock);
+  	int keep = SCHED->keep(core, CURTHREAD);
+  	Mutex_Unlock(& core->rq_spinlock);
+  	if(preempt) preempt_on;
+  	if(keep) {
+  		sched_expire_timeouts();
+  		sched_set_timeslice(core, QUANTUM);
+  		return;
+  	}
+  }
+
+  /* On a tickless core, the alarm was set for a timeout */
+  yield(core->tickless ? SCHED_TIMER : SCHED_QUANTUM);
 }
 
-/* Interrupt handle for inter-core interrupts */
+/* 
+  Interrupt handler for inter-core interrupts. 
+
+  Another core has put a thread into our run queue. If the new thread is
+  more urgent than the current one, we reschedule at once. Else, the 
+  current thread gets a quantum, if it was tickless.
+
+  The idle thread is not preempted: its loop yields once it returns from 
+  the interrupt. A yield from here would leave the handler on the idle
+  stack, and under a stream of interrupts these frames pile up. For the
+  same reason, a thread that resumes inside this handler (gain() enables
+  interrupts before the handler returns) does not yield again until it
+  has left it; the ready threads wait for the next tick instead.
+*/
 void ici_handler() 
 {
-  /* noop for now... */
+  CCB* core = & CURCORE;
+  TCB* current = core->current_thread;
+  uint64_t mask = core->ready_mask;
+
+  if(current->type == IDLE_THREAD)
+  	return;
+
+  if(current->ici_nested)
+  	return;
+
+  /* We are parked, give away the current thread */
+  if(core->parked) {
+  	current->ici_nested = 1;
+  	yield(SCHED_PREEMPT);
+  	current->ici_nested = 0;
+  	return;
+  }
+
+  if(core->ready_count == 0)
+  	return;
+
+  if(sched_edf_urgent(core)
+  	|| (mask && (unsigned int)__builtin_ctzll(mask) < current->prio)) {
+  	current->ici_nested = 1;
+  	yield(SCHED_PREEMPT);
+  	current->ici_nested = 0;
+  } else if(core->tickless) {
+  	core->tickless = 0;
+  	sched_set_timeslice(core, QUANTUM);
+  }
 }
 
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  Possibly add TCB to the scheduler timer wheel.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
 */
 static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 {
   if(timeout!=NO_TIMEOUT){
 
+  	Mutex_Lock(& timeout_spinlock);
+
   	/* set the wakeup time */
   	TimerDuration curtime = bios_clock();
-  	tcb->wakeup_time = (timeout==NO_TIMEOUT) ? NO_TIMEOUT : curtime+timeout;
+  	tcb->wakeup_time = curtime+timeout;
+
+  	/* Ticks that have already expired will not be visited again */
+  	TimerDuration tick = tcb->wakeup_time / TIMER_TICK;
+  	if(tick < timer_next_tick) tick = timer_next_tick;
 
-  	/* add to the TIMEOUT_LIST in sorted order */
-  	rlnode* n = TIMEOUT_LIST.next;
-  	for( ; n!=&TIMEOUT_LIST; n=n->next) 
-  		/* skip earlier entries */
-  		if(tcb->wakeup_time < n->tcb->wakeup_time) break;
-  	/* insert before n */
-	rl_splice(n->prev, & tcb->sched_node);
+  	unsigned int slot = tick % TIMER_SLOTS;
+  	rlist_push_back(& TIMER_WHEEL[slot], & tcb->sched_node);
+  	timer_slot_mask[slot/64] |= (uint64_t)1 << (slot%64);
+  	timer_count++;
+
+	Mutex_Unlock(& timeout_spinlock);
   }
 }
 
 
 /*
-  Add TCB to the end of the scheduler list.
+  Add TCB to the end of its level in a core's run queue.
+
+  *** MUST BE CALLED WITH core->rq_spinlock HELD ***
+*/
+void rq_push(CCB* core, TCB* tcb)
+{
+  rlist_push_back(& core->ready_list[tcb->prio], & tcb->sched_node);
+  core->ready_mask |= (uint64_t)1 << tcb->prio;
+  core->ready_count++;
+}
+
+
+/*
+  Return the time when the earliest timeout may expire, or NO_TIMEOUT if
+  no thread sleeps with a timeout.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  This is the end of the tick of the first non-empty slot after the
+  expired ones. When that slot only holds threads of a later round of the 
+  wheel, the caller just wakes up too early and asks again.
 */
-static void sched_queue_add(TCB* tcb)
+static TimerDuration sched_next_timeout()
 {
-  /* Insert at the end of the scheduling list */
-  rlist_push_back(&(SCHEDULER[tcb->prio]), & tcb->sched_node);
+  TimerDuration ret = NO_TIMEOUT;
+
+  Mutex_Lock(& timeout_spinlock);
+
+  unsigned int d = 0;
+  while(timer_count > 0 && d < TIMER_SLOTS) {
+  	unsigned int s = (timer_next_tick + d) % TIMER_SLOTS;
+  	uint64_t word = timer_slot_mask[s/64] >> (s%64);
+
+  	if(word == 0) {
+  		/* Skip the rest of this word */
+  		d += 64 - (s%64);
+  		continue;
+  	}
 
-  /* Restart possibly halted cores */
-  cpu_core_restart_one();
+  	d += __builtin_ctzll(word);
+  	if(d >= TIMER_SLOTS) break;
+  	s = (timer_next_tick + d) % TIMER_SLOTS;
+
+  	if(is_rlist_empty(& TIMER_WHEEL[s])) {
+  		/* Stale bit, left by a cancelled timeout */
+  		timer_slot_mask[s/64] &= ~((uint64_t)1 << (s%64));
+  		d++;
+  		continue;
+  	}
+
+  	ret = (timer_next_tick + d + 1) * TIMER_TICK;
+  	break;
+  }
+
+  Mutex_Unlock(& timeout_spinlock);
+  return ret;
 }
 
 
 /*
-	Adjust the state of a thread to make it READY.
+  Set the alarm for a timeslice. A core with deadline threads is also
+  interrupted at the earliest timeout before the end of the timeslice, 
+  so that a deadline thread that sleeps wakes up in time (see 
+  yield_handler).
+*/
+static void sched_set_timeslice(CCB* core, TimerDuration slice)
+{
+  TimerDuration curtime = bios_clock();
+  core->slice_end = curtime + slice;
+
+  if(core->edf_util > 0) {
+  	TimerDuration deadline = sched_next_timeout();
+  	if(deadline != NO_TIMEOUT && deadline < core->slice_end)
+  		slice = (deadline > curtime) ? deadline - curtime : TIMER_TICK;
+  }
+  bios_set_timer(slice);
+}
+
+
+/*
+  Program the alarm of this core, at the start of a new timeslice.
+
+  A core that has other ready threads gets a full quantum. Otherwise, the
+  core is tickless: the current thread (or the idle thread) is not 
+  interrupted, except to expire the earliest timeout.
+*/
+static void sched_set_alarm(TCB* current)
+{
+  CCB* core = & CURCORE;
+
+  /* A parked core gets no timer interrupts */
+  if(core->parked) {
+  	core->tickless = 1;
+  	bios_cancel_timer();
+  	return;
+  }
+
+  /* A deadline thread runs until its budget is used up */
+  if(core->edf_running != NO_TIMEOUT && current->edf_period != 0) {
+  	core->tickless = 0;
+  	TimerDuration budget = current->edf_budget;
+  	sched_set_timeslice(core, (budget < TIMER_TICK) ? TIMER_TICK : (budget < QUANTUM) ? budget : QUANTUM );
+  	return;
+  }
+
+  if(current->type != IDLE_THREAD && core->ready_count > 0) {
+  	core->tickless = 0;
+  	sched_set_timeslice(core, QUANTUM);
+  	return;
+  }
+
+  core->tickless = 1;
+  TimerDuration deadline = sched_next_timeout();
+  if(deadline == NO_TIMEOUT) {
+  	bios_cancel_timer();
+  } else {
+  	TimerDuration curtime = bios_clock();
+  	bios_set_timer( (deadline > curtime) ? deadline - curtime : TIMER_TICK );
+  }
+}
+
+
+/*
+  Pop the first thread of the highest non-empty level of a core's
+  run queue. The level is found from the lowest set bit of 
+  core->ready_mask, so this does not depend on the number of levels.
+
+  *** MUST BE CALLED WITH core->rq_spinlock HELD ***
+*/
+TCB* rq_pop(CCB* core)
+{
+  if (core->ready_mask == 0)
+  	return NULL;
+
+  int i = __builtin_ctzll(core->ready_mask);
+  TCB* tcb = rlist_pop_front( &core->ready_list[i] )->tcb;
+  if ( is_rlist_empty( &core->ready_list[i] ) )
+  	core->ready_mask &= ~((uint64_t)1 << i);
+  core->ready_count--;
+  return tcb;
+}
+
+
+/*
+  Core parking.
+  -------------
+
+  Any core may take park_spinlock (with a try-lock) every PARK_PERIOD,
+  and measure the utilization of the unparked cores since the last time. 
+  A core is parked by setting its flag and sending it an ICI. The core 
+  then moves its threads to other cores, and parks in its idle thread.
+  Unparking clears the flag and restarts the core.
+*/
+int core_parking = 1;
+static Mutex park_spinlock = MUTEX_INIT;
+static TimerDuration park_stamp;      /* Time of the last decision */
+static TimerDuration park_busy;       /* Busy time of all cores at the last decision */
+static unsigned int parked_cores;     /* Number of parked cores */
+
+void core_unpark(CCB* core)
+{
+  if(__atomic_exchange_n(& core->parked, 0, __ATOMIC_ACQ_REL)) {
+  	__atomic_fetch_sub(& parked_cores, 1, __ATOMIC_RELAXED);
+  	cpu_core_restart(core->id);
+  }
+}
+
+static void core_park(CCB* core)
+{
+  if(! __atomic_exchange_n(& core->parked, 1, __ATOMIC_ACQ_REL)) {
+  	__atomic_fetch_add(& parked_cores, 1, __ATOMIC_RELAXED);
+  	core->park_count++;
+  	cpu_ici(core->id);
+  }
+}
+
+/* Unpark the lowest parked core, if any */
+static void core_unpark_one()
+{
+  for(uint c=1; c<cpu_cores() && parked_cores > 0; c++)
+  	if(cctx[c].parked) {
+  		core_unpark(& cctx[c]);
+  		return;
+  	}
+}
+
+/* The busy time of a core, including the current timeslice */
+static TimerDuration core_busy_now(CCB* core, TimerDuration now)
+{
+  TimerDuration busy = core->busy_time;
+  TCB* current = core->current_thread;
+  TimerDuration stamp = core->switch_stamp;
+  if(current != NULL && current->type != IDLE_THREAD && now > stamp)
+  	busy += now - stamp;
+  return busy;
+}
+
+/* 
+  Park or unpark a core, by the utilization of the unparked cores.
+  The reads of other cores are racy, but this is only a heuristic.
+*/
+static void sched_balance_cores()
+{
+  TimerDuration now = bios_fine_clock();
+  if(now - park_stamp < PARK_PERIOD || ! Mutex_TryLock(& park_spinlock))
+  	return;
+
+  if(now - park_stamp >= PARK_PERIOD) {
+  	uint ncores = cpu_cores();
+  	TimerDuration busy = 0;
+  	unsigned int active = 0;
+  	for(uint c=0; c<ncores; c++) {
+  		busy += core_busy_now(& cctx[c], now);
+  		if(! cctx[c].parked) active++;
+  	}
+  	/* A stale read may go back in time, then we decide next time */
+  	if(busy < park_busy) {
+  		Mutex_Unlock(& park_spinlock);
+  		return;
+  	}
+  	unsigned int util = (busy - park_busy) * 100 / ((now - park_stamp) * active);
+  	park_stamp = now;
+  	park_busy = busy;
+
+  	if(core_parking && util < PARK_LOW && active > 1) {
+  		for(uint c=ncores-1; c>0; c--)
+  			if(! cctx[c].parked && cctx[c].edf_util == 0) {
+  				core_park(& cctx[c]);
+  				break;
+  			}
+  	} else if(util > PARK_HIGH || ! core_parking) {
+  		core_unpark_one();
+  	}
+  }
+
+  Mutex_Unlock(& park_spinlock);
+}
+
+
+/*
+  A core where the thread may run: the core where it last ran, if 
+  allowed, or else the first allowed core. Unparked cores are preferred,
+  and if there is none, an allowed core is unparked.
+*/
+static CCB* sched_allowed_core(TCB* tcb)
+{
+  if(core_allowed(tcb, tcb->last_core) && ! cctx[tcb->last_core].parked)
+  	return & cctx[tcb->last_core];
+
+  core_mask_t mask = tcb->affinity;
+  for(core_mask_t m = mask; m; m &= m-1) {
+  	CCB* core = & cctx[__builtin_ctz(m)];
+  	if(! core->parked) return core;
+  }
+
+  CCB* core = & cctx[__builtin_ctz(mask)];
+  core_unpark(core);
+  return core;
+}
+
+
+/*
+  Add TCB to the end of the run queue of a core.
+
+  After it releases tcb->state_spinlock, the caller must send an ICI to 
+  the core, if it is not the current core, or else call 
+  cpu_core_restart_one(), so that a halted core can steal the thread. 
+  Doing so while holding the lock would make the other core spin on it.
+
+  If the thread may not run on @c core, it is queued on an allowed core,
+  which is sent an ICI here.
 
-    *** MUST BE CALLED WITH sched_spinlock HELD ***	
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD (or tcb otherwise owned) ***
+*/
+static void sched_queue_add(CCB* core, TCB* tcb)
+{
+  /* A deadline thread with budget goes to the deadline queue of its core */
+  if(is_edf(tcb) && edf_charge(tcb)) {
+  	CCB* edf = & cctx[tcb->edf_core];
+  	Mutex_Lock(& edf->rq_spinlock);
+  	edf_enqueue(edf, tcb);
+  	edf->ready_count++;
+  	Mutex_Unlock(& edf->rq_spinlock);
+
+  	/* Tell the core, it may have to preempt its current thread */
+  	if(edf != & CURCORE)
+  		cpu_ici(edf->id);
+  	return;
+  }
+
+  /* The thread may not run here (its affinity changed, or the core is parked) */
+  int moved = 0;
+  if(! core_allowed(tcb, core->id) || core->parked) {
+  	core = sched_allowed_core(tcb);
+  	moved = (core != & CURCORE);
+  }
+
+  /* Insert into the scheduling list, as the policy says */
+  Mutex_Lock(& core->rq_spinlock);
+  SCHED->enqueue(core, tcb);
+  Mutex_Unlock(& core->rq_spinlock);
+
+  if(moved)
+  	cpu_ici(core->id);
+
+  /* Threads are waiting, bring back a parked core */
+  if(core->ready_count >= UNPARK_DEPTH && parked_cores > 0)
+  	core_unpark_one();
+
+  /* The current thread is no longer alone, give it a quantum */
+  if(core == & CURCORE && core->tickless) {
+  	core->tickless = 0;
+  	sched_set_timeslice(core, QUANTUM);
+  }
+}
+
+
+/*
+  Choose the core whose run queue gets a thread that wakes up.
+
+  We prefer the core where the thread last ran, since its cache may still
+  be warm, if it is idle or runs a less urgent thread. Else, we look for 
+  any idle core. If all cores are busy, the thread stays with the current
+  core (and can be stolen). Only the cores in the affinity of the thread
+  are considered.
+
+  The state of other cores is read without locks, so this is only a hint.
+*/
+static CCB* sched_wakeup_core(TCB* tcb)
+{
+  if(is_edf(tcb))
+  	return & cctx[tcb->edf_core];
+
+  CCB* last = & cctx[tcb->last_core];
+  TCB* running = last->current_thread;
+  if(core_allowed(tcb, tcb->last_core) && ! last->parked && running != NULL &&
+  	(running->type == IDLE_THREAD || tcb->prio < running->prio))
+  	return last;
+
+  for(uint c=0; c<cpu_cores(); c++) {
+  	running = cctx[c].current_thread;
+  	if(core_allowed(tcb, c) && ! cctx[c].parked && running != NULL && running->type == IDLE_THREAD)
+  		return & cctx[c];
+  }
+
+  if(core_allowed(tcb, cpu_core_id) && ! CURCORE.parked)
+  	return & CURCORE;
+  return sched_allowed_core(tcb);
+}
+
+
+/*
+	Adjust the state of a thread to make it READY, without queueing it.
+
+    *** MUST BE CALLED WITH tcb->state_spinlock HELD ***	
  */
-static void sched_make_ready(TCB* tcb)
+static void sched_mark_ready(TCB* tcb)
 {
 	assert(tcb->state == STOPPED || tcb->state == INIT);
 
-	/* Possibly remove from TIMEOUT_LIST */
+	/* Possibly remove from TIMER_WHEEL */
 	if(tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
+		/* tcb is in TIMER_WHEEL, fix it */
+		Mutex_Lock(& timeout_spinlock);
 		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
 		rlist_remove(& tcb->sched_node);
+		timer_count--;
 		tcb->wakeup_time = NO_TIMEOUT;
+		Mutex_Unlock(& timeout_spinlock);
 	}
 
-	/* Mark as ready */
+	/* Mark as ready, the wait for a core starts now */
 	tcb->state = READY;
+	tcb->acct_stamp = bios_fine_clock();
+
+	if(is_edf(tcb)) edf_wake(tcb);
+	if(SCHED->wake) SCHED->wake(tcb);
+}
+
+
+/*
+	Adjust the state of a thread to make it READY. Return 1 if the
+	thread was added to the run queue of @c core.
+
+    *** MUST BE CALLED WITH tcb->state_spinlock HELD ***	
+ */
+static int sched_make_ready(TCB* tcb, CCB* core)
+{
+	sched_mark_ready(tcb);
 
 	/* Possibly add to the scheduler queue */
-	if(tcb->phase == CTX_CLEAN) 
-		sched_queue_add(tcb);
+	if(tcb->phase == CTX_CLEAN) {
+		sched_queue_add(core, tcb);
+		return 1;
+	}
+	return 0;
 }
 
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Wake up the threads of a timer wheel slot whose timeout has expired.
+  Return 0 if some expired thread could not be woken up, 1 otherwise.
+
+  The timer wheel is ordered after the thread state locks, therefore
+  we only try-lock each thread; if this fails, the thread is being
+  handled by some other core and we retry at the next decision.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
 */
-static TCB* sched_queue_select(enum SCHED_CAUSE cause, TCB *current)
+static int sched_expire_slot(unsigned int s, TimerDuration curtime, int* queued)
 {
+  rlnode* slot = & TIMER_WHEEL[s];
+  rlnode* n = slot->next;
+  while(n != slot) {
+  		TCB* tcb = n->tcb;
+  		n = n->next;
+  		if(tcb->wakeup_time > curtime)
+  			continue;
+  		if(! Mutex_TryLock(& tcb->state_spinlock))
+  			return 0;
 
+  		/* Take it off the wheel here, sched_make_ready() must not relock */
+  		rlist_remove(& tcb->sched_node);
+  		timer_count--;
+  		tcb->wakeup_time = NO_TIMEOUT;
+  		*queued += sched_make_ready(tcb, & CURCORE);
 
-  //Debugging code.
-  #if debugger
-	for (int i = 0; i < num_of_queues; i++)
-		fprintf(debug_file, "[%d] = %lu ", i, rlist_len(&SCHEDULER[i]) );
-	fprintf(debug_file, "\n");
-  #endif
+  		Mutex_Unlock(& tcb->state_spinlock);
+  }
 
+  if(is_rlist_empty(slot))
+  	timer_slot_mask[s/64] &= ~((uint64_t)1 << (s%64));
+  return 1;
+}
 
 
-  /* Empty the timeout list up to the current time and wake up each thread */
+/*
+  Wake up the threads whose timeout has expired.
+
+  Every slot before the current tick is expired completely and is not
+  visited again until the wheel comes around. The slot of the current 
+  tick is visited at every call, since it may hold threads that wake up
+  later during this tick.
+*/
+static void sched_expire_timeouts()
+{
   TimerDuration curtime = bios_clock();
-  while(! is_rlist_empty(&TIMEOUT_LIST)) {
-  		TCB* tcb = TIMEOUT_LIST.next->tcb;
-  		if(tcb->wakeup_time > curtime)
-  			break;
-  		sched_make_ready(tcb);
+  TimerDuration tick = curtime / TIMER_TICK;
+  int queued = 0;
+
+  /* Called from interrupt handlers too, where the lock must not sleep */
+  int preempt = preempt_off;
+  Mutex_Lock(& timeout_spinlock);
+
+  if(timer_count == 0) {
+  	/* Nothing to expire, just move the wheel */
+  	if(timer_next_tick < tick) timer_next_tick = tick;
+  } else {
+  	/* Each slot needs to be visited at most once */
+  	if(timer_next_tick + TIMER_SLOTS < tick)
+  		timer_next_tick = tick - TIMER_SLOTS;
+
+  	while(timer_next_tick < tick) {
+  		if(! sched_expire_slot(timer_next_tick % TIMER_SLOTS, curtime, &queued))
+  			goto done;
+  		timer_next_tick++;
+  	}
+  	sched_expire_slot(tick % TIMER_SLOTS, curtime, &queued);
   }
 
+done:
+  Mutex_Unlock(& timeout_spinlock);
+  if(preempt) preempt_on;
+
+  if(queued) cpu_core_restart_one();
+}
 
-  
-  //Lower the priority of current thread.
-  if ( cause == SCHED_QUANTUM && current->prio < num_of_queues - 1 )
-  	current->prio++;
 
-  //Increase the priority of current thread.
-  else if ( cause == SCHED_IO && current->prio > 0 )
-  	current->prio--;
+/*
+  True if the thread left @c core so recently that its cache there is 
+  probably still warm.
+*/
+static inline int sched_cache_hot(TCB* tcb, CCB* core, TimerDuration now)
+{
+  return tcb->last_core == core->id && now - tcb->last_run < SCHED_MIGRATION_COST;
+}
 
 
-  //Create an rlnode variable.
-  rlnode * sel = NULL; //rlist_pop_front(&SCHEDULER[0]);
+/*
+  Steal a batch of threads from the busiest other core, into the run queue
+  of core @c self. Returns the number of threads moved.
 
+  The two run queues are never locked together: the batch is first moved
+  into a private list.
 
-  //Get the next node from the scheduler.
-  for (int i = 0; i < num_of_queues; i++)
-  	if ( !is_rlist_empty( &SCHEDULER[i] ) )
-  	{
-  		sel = rlist_pop_front( &SCHEDULER[i] );
-  		break;
+  Threads that may not run on @c self are left to the victim, and so are
+  cache-hot threads, unless there is no other thread to take. The threads
+  that stay are queued again on the victim, in the order they were picked.
+*/
+static unsigned int sched_steal(CCB* self)
+{
+  /* Find a victim (this is a racy, advisory read) */
+  CCB* victim = NULL;
+  unsigned int most = 0;
+  for(uint c=0; c<cpu_cores(); c++) {
+  	CCB* core = & cctx[c];
+  	if(core != self && core->ready_count > most) {
+  		most = core->ready_count;
+  		victim = core;
   	}
+  }
+  if(victim == NULL || self->parked) return 0;
+
+  /* Take half of the victim's threads */
+  rlnode batch, kept;
+  rlnode_init(&batch, NULL);
+  rlnode_init(&kept, NULL);
+  unsigned int moved = 0;
+  TCB* hot = NULL;
+  TimerDuration now = bios_fine_clock();
+
+  Mutex_Lock(& victim->rq_spinlock);
+  unsigned int quota = (victim->ready_count+1)/2;
+  if(quota > STEAL_BATCH) quota = STEAL_BATCH;
+  for(unsigned int scan = 0; moved < quota && scan < STEAL_SCAN; scan++) {
+  	TCB* tcb = SCHED->pick(victim);
+  	if(tcb == NULL) break;
+  	if(! core_allowed(tcb, self->id)) {
+  		rlist_push_back(&kept, & tcb->sched_node);
+  	} else if(sched_cache_hot(tcb, victim, now)) {
+  		if(hot == NULL) hot = tcb;
+  		rlist_push_back(&kept, & tcb->sched_node);
+  	} else {
+  		rlist_push_back(&batch, & tcb->sched_node);
+  		moved++;
+  	}
+  }
 
+  /* Rather a hot thread than none */
+  if(moved == 0 && hot != NULL) {
+  	rlist_remove(& hot->sched_node);
+  	rlist_push_back(&batch, & hot->sched_node);
+  	moved++;
+  }
 
+  /* Put back the rest */
+  while(! is_rlist_empty(&kept))
+  	SCHED->enqueue(victim, rlist_pop_front(&kept)->tcb);
+  Mutex_Unlock(& victim->rq_spinlock);
 
-  //Solve priority inversion.
-  if ( !is_rlist_empty( &SCHEDULER[next_queue] ) )
-  	rlist_push_back( &SCHEDULER[next_queue-1], rlist_pop_front( &SCHEDULER[next_queue] ) );
+  /* Queue them locally */
+  Mutex_Lock(& self->rq_spinlock);
+  while(! is_rlist_empty(&batch))
+  	SCHED->enqueue(self, rlist_pop_front(&batch)->tcb);
+  Mutex_Unlock(& self->rq_spinlock);
 
-  //Increase the next queue index.
-  next_queue++;
+  return moved;
+}
 
-  //Reset the next queue index.
-  if (next_queue == num_of_queues)
-  	next_queue = 1;
 
-  //SCHEDULER is empty.
-  if (sel == NULL)
-  	return NULL;
-  
+/*
+  Remove the head of the scheduler list, if any, and
+  return it. Return NULL if the list is empty.
+
+  The run queue of the current core is used, and when it is empty a batch
+  of threads is stolen from another core.
+*/
+static TCB* sched_queue_select(enum SCHED_CAUSE cause, TCB *current)
+{
+  CCB* core = & CURCORE;
+
+  //Sample the length of the run queue.
+  unsigned int len = core->ready_count;
+  core->runqueue_hist[(len < SCHED_HIST_BUCKETS) ? len : SCHED_HIST_BUCKETS-1]++;
+
 
-  return sel->tcb;  /* When the list is empty, this is NULL */
+  /* 
+    A parked core gives away its threads, and runs nothing. A thread that
+    may only run here unparks the core again.
+  */
+  if(core->parked) {
+  	rlnode batch;
+  	rlnode_init(&batch, NULL);
+  	if(core->handoff != NULL) {
+  		rlist_push_back(&batch, & core->handoff->sched_node);
+  		core->handoff = NULL;
+  	}
+  	Mutex_Lock(& core->rq_spinlock);
+  	TCB* tcb;
+  	while((tcb = SCHED->pick(core)) != NULL)
+  		rlist_push_back(&batch, & tcb->sched_node);
+  	Mutex_Unlock(& core->rq_spinlock);
+
+  	while(! is_rlist_empty(&batch))
+  		sched_queue_add(core, rlist_pop_front(&batch)->tcb);
+
+  	if(core->parked) {
+  		core->edf_running = NO_TIMEOUT;
+  		return NULL;
+  	}
+  }
+
+  /* Empty the timeout list up to the current time and wake up each thread */
+  sched_expire_timeouts();
+
+
+  //Deadline threads run ahead of the policy.
+  Mutex_Lock(& core->rq_spinlock);
+  TCB* sel = edf_pick(core);
+  if (sel != NULL) core->ready_count--;
+  Mutex_Unlock(& core->rq_spinlock);
+  core->edf_running = (sel != NULL) ? sel->edf_abs_deadline : NO_TIMEOUT;
+
+  //Else, a thread that was handed this core runs next.
+  if (sel != NULL && core->handoff != NULL)
+  	sched_queue_add(core, core->handoff);
+  else if (sel == NULL)
+  	sel = core->handoff;
+  core->handoff = NULL;
+
+  //Else, get the next thread from this core, or steal some work.
+  if (sel == NULL && SCHED->balance && ! core->parked)
+  	SCHED->balance(core);
+  if (sel == NULL) {
+  	Mutex_Lock(& core->rq_spinlock);
+  	sel = SCHED->pick(core);
+  	Mutex_Unlock(& core->rq_spinlock);
+  }
+
+  //A thread whose affinity changed since it was queued goes to an allowed core.
+  while (sel != NULL && ! core_allowed(sel, core->id)) {
+  	sched_queue_add(core, sel);
+  	Mutex_Lock(& core->rq_spinlock);
+  	sel = SCHED->pick(core);
+  	Mutex_Unlock(& core->rq_spinlock);
+  }
+
+  if (sel == NULL && sched_steal(core) > 0) {
+  	Mutex_Lock(& core->rq_spinlock);
+  	sel = SCHED->pick(core);
+  	Mutex_Unlock(& core->rq_spinlock);
+  }
+
+
+  //Park or unpark cores, by their utilization.
+  sched_balance_cores();
+
+  //Periodic aging of the run queue (e.g., the boost of the MLFQ against starvation).
+  TimerDuration curtime = bios_clock();
+  if ( curtime - core->last_boost >= SCHED_BOOST_PERIOD ) {
+  	if (SCHED->age) {
+  		Mutex_Lock(& core->rq_spinlock);
+  		SCHED->age(core, curtime);
+  		Mutex_Unlock(& core->rq_spinlock);
+  	}
+  	core->last_boost = curtime;
+  }
+
+  return sel;  /* When the queues are empty, this is NULL */
 } 
 
 
@@ -409,15 +1214,27 @@ int wakeup(TCB* tcb)
 	int oldpre = preempt_off;
 
 	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(& sched_spinlock);
+	Mutex_Lock(& tcb->state_spinlock);
 
+	int queued = 0, edf = 0;
+	CCB* target = NULL;
 	if(tcb->state==STOPPED || tcb->state==INIT) {
-		sched_make_ready(tcb);
+		target = sched_wakeup_core(tcb);
+		queued = sched_make_ready(tcb, target);
+		edf = is_edf(tcb);
 		ret = 1;		
 	}
 
 
-	Mutex_Unlock(& sched_spinlock);
+	Mutex_Unlock(& tcb->state_spinlock);
+
+	/* Tell the target core, or else restart possibly halted cores */
+	if(queued) {
+		if(target != & CURCORE || edf)
+			cpu_ici(target->id);
+		else
+			cpu_core_restart_one();
+	}
 
 	/* Restore preemption state */
 	if(oldpre) preempt_on;
@@ -427,9 +1244,93 @@ int wakeup(TCB* tcb)
 
 
 /*
-  Atomically put the current process to sleep, after unlocking mx.
+  Make the thread ready, and the next thread of the current core.
+
+  A thread that is still switching out of some core (CTX_DIRTY) cannot be
+  handed off, since that core queues it in gain(). 
  */
-void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout)
+int wakeup_handoff(TCB* tcb)
+{
+	int ret = 0;
+	int oldpre = preempt_off;
+	CCB* core = & CURCORE;
+
+	Mutex_Lock(& tcb->state_spinlock);
+
+	int queued = 0, edf = 0;
+	CCB* target = NULL;
+	if(tcb->state==STOPPED || tcb->state==INIT) {
+		if(core->handoff == NULL && tcb->phase == CTX_CLEAN 
+			&& CURTHREAD->type != IDLE_THREAD && ! is_edf(tcb)
+			&& core_allowed(tcb, cpu_core_id) && ! core->parked) {
+			sched_mark_ready(tcb);
+			core->handoff = tcb;
+		} else {
+			target = sched_wakeup_core(tcb);
+			queued = sched_make_ready(tcb, target);
+			edf = is_edf(tcb);
+		}
+		ret = 1;
+	}
+
+	Mutex_Unlock(& tcb->state_spinlock);
+
+	if(queued) {
+		if(target != core || edf)
+			cpu_ici(target->id);
+		else
+			cpu_core_restart_one();
+	}
+
+	if(oldpre) preempt_on;
+	return ret;
+}
+
+
+void yield_handoff()
+{
+	/* Only this thread sets the handoff of its core, and a preemption
+	   would have run it already, so we can look before preemption is off */
+	if(CURCORE.handoff == NULL) return;
+
+	int oldpre = preempt_off;
+	if(CURCORE.handoff != NULL)
+		yield(SCHED_HANDOFF);
+	if(oldpre) preempt_on;
+}
+
+
+int sched_set_affinity(TCB* tcb, core_mask_t mask)
+{
+	uint ncores = cpu_cores();
+	if(ncores < 8*sizeof(core_mask_t))
+		mask &= ((core_mask_t)1 << ncores) - 1;
+	if(mask == 0)
+		return -1;
+
+	int oldpre = preempt_off;
+	int ret = -1;
+
+	/* A deadline thread must keep its core */
+	Mutex_Lock(& tcb->state_spinlock);
+	if(! is_edf(tcb) || ((mask >> tcb->edf_core) & 1)) {
+		tcb->affinity = mask;
+		ret = 0;
+	}
+	Mutex_Unlock(& tcb->state_spinlock);
+
+	/* Move away from this core, the next core is chosen by the scheduler */
+	if(ret == 0 && tcb == CURTHREAD && ! core_allowed(tcb, cpu_core_id))
+		yield(SCHED_USER);
+
+	if(oldpre) preempt_on;
+	return ret;
+}
+
+
+/* Sleep, releasing a mutex or posting a semaphore */
+static void sleep_and_release(Thread_state state, Mutex* mx, Semaphore* sem,
+  enum SCHED_CAUSE cause, TimerDuration timeout)
 {
   assert(state==STOPPED || state==EXITED);
 
@@ -441,7 +1342,7 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, Time
     domain.
    */
   int preempt = preempt_off;
-  Mutex_Lock(& sched_spinlock);
+  Mutex_Lock(& tcb->state_spinlock);
 
   /* mark the thread as stopped or exited */
   tcb->state = state;
@@ -450,11 +1351,14 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, Time
   if(state!=EXITED) 
   	sched_register_timeout(tcb, timeout);
 
-  /* Release mx */
-  if(mx!=NULL) Mutex_Unlock(mx);
+  /* Release the state spinlock before calling yield() !!! */
+  Mutex_Unlock(& tcb->state_spinlock);
 
-  /* Release the schduler spinlock before calling yield() !!! */
-  Mutex_Unlock(& sched_spinlock);
+  /* Release mx or sem. Either may wake up another thread, whose 
+     state_spinlock we must not take while we hold ours. We are already
+     asleep, so a wakeup from here on is not lost, yield() finds us READY. */
+  if(mx!=NULL) Mutex_Unlock(mx);
+  if(sem!=NULL) Semaphore_Post(sem);
   
   /* call this to schedule someone else */
   yield(cause);
@@ -463,6 +1367,66 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, Time
   if(preempt) preempt_on;
 }
 
+void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout)
+{
+  sleep_and_release(state, mx, NULL, cause, timeout);
+}
+
+void sleep_posting(Thread_state state, Semaphore* sem, enum SCHED_CAUSE cause, TimerDuration timeout)
+{
+  sleep_and_release(state, NULL, sem, cause, timeout);
+}
+
+
+/* The log2 bucket of a latency histogram for a wait of t usec */
+static inline unsigned int sched_hist_bucket(TimerDuration t)
+{
+  unsigned int b = (t == 0) ? 0 : 64 - __builtin_clzll(t);
+  return (b < SCHED_HIST_BUCKETS) ? b : SCHED_HIST_BUCKETS-1;
+}
+
+
+/*
+  Accounting at a context switch from current to next.
+
+  The time since the last switch of the core is charged to the current 
+  thread, its process and the core. If the current thread remains ready, 
+  its wait for a core starts now; for a thread that blocks, the wait
+  starts when it is woken up.
+
+  The counters of a thread are only updated by the core that runs it,
+  and the counters of a process are updated atomically, so that no
+  lock is needed.
+*/
+static inline void sched_account_switch(TCB* current, TCB* next, int current_ready, int preempted)
+{
+  CCB* core = & CURCORE;
+  TimerDuration now = bios_fine_clock();
+  TimerDuration delta = now - core->switch_stamp;
+  PCB* pcb = current->owner_pcb;
+
+  current->run_time += delta;
+  if(current->type == IDLE_THREAD)
+    core->idle_time += delta;
+  else
+    core->busy_time += delta;
+  if(pcb) __atomic_fetch_add(& pcb->run_time, delta, __ATOMIC_RELAXED);
+
+  if(current != next) {
+    if(preempted) {
+      current->invol_switches++;
+      if(pcb) __atomic_fetch_add(& pcb->invol_switches, 1, __ATOMIC_RELAXED);
+    } else {
+      current->vol_switches++;
+      if(pcb) __atomic_fetch_add(& pcb->vol_switches, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  if(current_ready) current->acct_stamp = now;
+  current->last_run = now;
+  core->switch_stamp = now;
+}
+
 
 /* This function is the entry point to the scheduler's context switching */
 
@@ -477,12 +1441,14 @@ void yield(enum SCHED_CAUSE cause)
   TCB* current = CURTHREAD;  /* Make a local copy of current process, for speed */
 
   int current_ready = 0;
+  int preempted = 0;
 
-  Mutex_Lock(& sched_spinlock);
+  Mutex_Lock(& current->state_spinlock);
   switch(current->state)
   {
     case RUNNING:
       current->state = READY;
+      preempted = 1;
     case READY: /* We were awakened before we managed to sleep! */
       current_ready = 1;
       break;
@@ -495,13 +1461,26 @@ void yield(enum SCHED_CAUSE cause)
       fprintf(stderr, "BAD STATE for current thread %p in yield: %d\n", current, current->state);
       assert(0);  /* It should not be READY or EXITED ! */
   }
+  Mutex_Unlock(& current->state_spinlock);
+
+  /* Tell the policy why the current thread leaves the core */
+  if(current->type != IDLE_THREAD) {
+    current->last_cause = cause;
+    if(preempted) {
+      if(SCHED->preempt) SCHED->preempt(& CURCORE, current, cause);
+    }
+    else {
+      if(is_edf(current)) edf_block(current);
+      if(SCHED->block) SCHED->block(current, cause);
+    }
+  }
 
   /* Get next */
   TCB* next = sched_queue_select(cause, current);
 
   /* Maybe there was nothing ready in the scheduler queue ? */
   if(next==NULL) {
-    if(current_ready)
+    if(current_ready && core_allowed(current, cpu_core_id) && ! CURCORE.parked)
       next = current;
     else
       next = & CURCORE.idle_thread;
@@ -511,7 +1490,7 @@ void yield(enum SCHED_CAUSE cause)
   current->next = next;
   next->prev = current;
 
-  Mutex_Unlock(& sched_spinlock);
+  sched_account_switch(current, next, current_ready, preempted);
 
   /* Switch contexts */
   if(current!=next) {
@@ -540,40 +1519,166 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-  Mutex_Lock(& sched_spinlock);
-
   /* Mark current state */
   TCB* current = CURTHREAD; 
   TCB* prev = current->prev;
 
+  Mutex_Lock(& current->state_spinlock);
   current->state = RUNNING;
   current->phase = CTX_DIRTY;
+  current->last_core = cpu_core_id;
+  Mutex_Unlock(& current->state_spinlock);
+
+  /* Charge the time spent in the ready state */
+  TimerDuration switch_stamp = CURCORE.switch_stamp;
+  if(current->type != IDLE_THREAD && switch_stamp > current->acct_stamp) {
+    TimerDuration waited = switch_stamp - current->acct_stamp;
+    current->wait_time += waited;
+    if(current->owner_pcb)
+      __atomic_fetch_add(& current->owner_pcb->wait_time, waited, __ATOMIC_RELAXED);
+  }
+
+  /* Record the wakeup latency of a thread that was dispatched */
+  if(current->type != IDLE_THREAD && current != prev) {
+    TimerDuration waited = (switch_stamp > current->acct_stamp) ? switch_stamp - current->acct_stamp : 0;
+    CURCORE.latency_hist[current->last_cause][sched_hist_bucket(waited)]++;
+  }
 
   if(current != prev) {
   	/* Take care of the previous thread */
+    int exited = 0, queued = 0;
+    Mutex_Lock(& prev->state_spinlock);
     prev->phase = CTX_CLEAN;
     switch(prev->state) 
     {
       case READY:
-        if(prev->type != IDLE_THREAD) sched_queue_add(prev);
+        if(prev->type != IDLE_THREAD) {
+          sched_queue_add(& CURCORE, prev);
+          queued = 1;
+        }
         break;
       case EXITED:
-      	release_TCB(prev);
+        exited = 1;
         break;
       case STOPPED:
         break;
       default:
         assert(0);  /* prev->state should not be INIT or RUNNING ! */
     }
+    Mutex_Unlock(& prev->state_spinlock);
+
+    if(queued)
+      cpu_core_restart_one();
+    if(exited)
+      release_TCB(prev);
   }
 
-  Mutex_Unlock(& sched_spinlock);
+  /* Set a 1-quantum alarm, or go tickless */
+  sched_set_alarm(current);
 
   /* Reset preemption as needed */
   if(preempt) preempt_on;
+}
+
+
+/*
+  Adaptive idle polling.
+  ----------------------
+
+  Halting a core costs a sleep and a wakeup of its pthread on the host,
+  which is much longer than the typical wait for a pipe or a mutex. 
+  Therefore, an idle core first polls for work for idle_spin_window usec. 
+  The window follows the recent idle periods of the core:
+
+  - an idle period that ends while polling does not change the window,
+  - a period that ends after a halt, but within idle_spin_max usec, 
+    doubles the window, since polling longer would have caught it,
+  - a longer period halves the window, since polling was a waste.
+*/
+TimerDuration idle_spin_max = IDLE_SPIN_MAX;
+
+/* The first window after a short idle period, in usec */
+#define IDLE_SPIN_START 10
+
+/* Pause instructions between two polls */
+#define IDLE_SPIN_PAUSE 50
+
+/* Polls between two calls to cpu_core_relax() */
+#define IDLE_SPIN_RELAX 16
+
+void idle_spin_stats(unsigned long* hits, unsigned long* misses, TimerDuration* spin_time)
+{
+  *hits = *misses = 0;
+  *spin_time = 0;
+  for(uint c=0; c<MAX_CORES; c++) {
+    *hits += cctx[c].idle_spin_hits;
+    *misses += cctx[c].idle_spin_misses;
+    *spin_time += cctx[c].idle_spin_time;
+  }
+}
+
+/* 
+  True if there is work for an idle core. A thread that wakes up prefers 
+  an idle core (see sched_wakeup_core), therefore we only look at our own
+  run queue.
+*/
+static inline int idle_work_ready(CCB* core)
+{
+  return core->ready_count > 0 || active_threads == 0;
+}
 
-  /* Set a 1-quantum alarm */
-  bios_set_timer(QUANTUM);
+/* Adapt the polling window to an idle period of the given length */
+static void idle_spin_learn(CCB* core, TimerDuration idle)
+{
+  TimerDuration window = core->idle_spin_window;
+  if(idle <= window)
+    return;
+  if(idle <= idle_spin_max) {
+    window = (window < IDLE_SPIN_START) ? IDLE_SPIN_START : 2*window;
+    core->idle_spin_window = (window < idle_spin_max) ? window : idle_spin_max;
+  } else {
+    core->idle_spin_window = window/2;
+  }
+}
+
+/*
+  Wait for work on an idle core: poll for a while, and then halt.
+
+  While polling, an interrupt may switch to a thread (e.g., an ICI
+  brings a thread to our run queue). When we get back, this core's 
+  switch_stamp has moved, and this also ends the idle period.
+*/
+static void idle_wait(CCB* core)
+{
+  TimerDuration start = bios_fine_clock();
+  TimerDuration stamp = core->switch_stamp;
+  TimerDuration window = core->idle_spin_window;
+  if(window > idle_spin_max) window = idle_spin_max;
+
+  if(window > 0) {
+    TimerDuration now = start;
+    for(unsigned int poll = 1; now - start < window; poll++) {
+      if(core->switch_stamp != stamp || idle_work_ready(core)) {
+        if(core->switch_stamp != stamp) now = core->switch_stamp;
+        core->idle_spin_hits++;
+        core->idle_spin_time += now - start;
+        idle_spin_learn(core, now - start);
+        return;
+      }
+      for(int i=0; i<IDLE_SPIN_PAUSE; i++)
+        __builtin_ia32_pause();
+      /* On a busy host, let the other cores run */
+      if(poll % IDLE_SPIN_RELAX == 0)
+        cpu_core_relax();
+      now = bios_fine_clock();
+    }
+    core->idle_spin_misses++;
+    core->idle_spin_time += now - start;
+  }
+
+  if(core->ready_count == 0 && active_threads > 0)
+    cpu_core_halt();
+  idle_spin_learn(core, bios_fine_clock() - start);
 }
 
 
@@ -584,7 +1689,10 @@ static void idle_thread()
 
   /* We come here whenever we cannot find a ready thread for our core */
   while(active_threads>0) {
-    cpu_core_halt();
+    if(CURCORE.parked)
+      cpu_core_park(& CURCORE.parked);
+    else if(CURCORE.ready_count == 0)
+      idle_wait(& CURCORE);
     yield(SCHED_IDLE);
   }
 
@@ -597,20 +1705,207 @@ static void idle_thread()
 /*
   Initialize the scheduler queue
  */
-void initialize_scheduler()
+void initialize_scheduler(const struct sched_policy* policy)
+{
+  /* Choose the policy */
+  if(policy == NULL) {
+    const char* name = getenv("TINYOS_SCHED");
+    if(name != NULL && (policy = sched_find_policy(name)) == NULL)
+      FATAL("Unknown scheduling policy in TINYOS_SCHED");
+  }
+  SCHED = (policy != NULL) ? policy : & sched_mlfq;
+
+  /* The cap of idle polling */
+  const char* spin = getenv("TINYOS_IDLE_SPIN");
+  idle_spin_max = (spin != NULL) ? strtoul(spin, NULL, 10) : IDLE_SPIN_MAX;
+
+  /* Core parking */
+  const char* park = getenv("TINYOS_PARK");
+  core_parking = (park != NULL) ? atoi(park) : 1;
+  park_stamp = bios_fine_clock();
+  park_busy = 0;
+
+  /* Name the global scheduler locks for the lock profile */
+  lock_profile_name(& active_threads_spinlock, "active_threads_spinlock");
+  lock_profile_name(& timeout_spinlock, "timeout_spinlock");
+  lock_profile_name(& park_spinlock, "park_spinlock");
+  parked_cores = 0;
+
+  for (int i = 0; i < TIMER_SLOTS; i++)
+  	rlnode_init(&TIMER_WHEEL[i], NULL);
+  for (int i = 0; i < TIMER_SLOTS/64; i++)
+  	timer_slot_mask[i] = 0;
+  timer_next_tick = bios_clock() / TIMER_TICK;
+  timer_count = 0;
+
+
+  //Initialize the run queue of every core.
+  for (int c = 0; c < MAX_CORES; c++) {
+  	CCB* core = & cctx[c];
+  	for (int i = 0; i < num_of_queues; i++)
+  		rlnode_init( &(core->ready_list[i]), NULL);
+  	core->ready_mask = 0;
+  	core->ready_count = 0;
+  	rbtree_init(& core->edf_queue);
+  	core->edf_util = 0;
+  	core->edf_running = NO_TIMEOUT;
+  	core->slice_end = 0;
+  	rbtree_init(& core->fair_queue);
+  	core->fair_front = NO_TIMEOUT;
+  	core->last_boost = bios_clock();
+  	core->tickless = 0;
+  	core->rq_spinlock = MUTEX_INIT;
+  	lock_profile_name(& core->rq_spinlock, "CCB.rq_spinlock");
+  	rlnode_init(& core->thread_cache, NULL);
+  	core->thread_cache_size = 0;
+  	core->thread_cache_hits = 0;
+  	core->thread_cache_misses = 0;
+  	core->busy_time = 0;
+  	core->idle_time = 0;
+  	core->handoff = NULL;
+  	core->idle_spin_window = 0;
+  	core->idle_spin_hits = 0;
+  	core->idle_spin_misses = 0;
+  	core->idle_spin_time = 0;
+  	core->parked = 0;
+  	core->park_count = 0;
+  	memset(core->latency_hist, 0, sizeof(core->latency_hist));
+  	memset(core->runqueue_hist, 0, sizeof(core->runqueue_hist));
+  }
+}
+
+
+/*
+  Scheduler statistics
+ */
+
+static const char* sched_cause_names[SCHED_CAUSES] = {
+  [SCHED_QUANTUM] = "quantum",
+  [SCHED_IO] = "io",
+  [SCHED_MUTEX] = "mutex",
+  [SCHED_PIPE] = "pipe",
+  [SCHED_POLL] = "poll",
+  [SCHED_IDLE] = "idle",
+  [SCHED_USER] = "user",
+  [SCHED_TIMER] = "timer",
+  [SCHED_PREEMPT] = "preempt",
+  [SCHED_HANDOFF] = "handoff",
+  [SCHED_FUTEX] = "futex"
+};
+
+/* A report being formatted into a buffer, snprintf-style */
+typedef struct report_buffer {
+  char* buf;
+  size_t size;
+  size_t len;
+} report_buffer;
+
+static void report_printf(report_buffer* rb, const char* fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  size_t room = (rb->len < rb->size) ? rb->size - rb->len : 0;
+  int n = vsnprintf(room ? rb->buf + rb->len : NULL, room, fmt, ap);
+  va_end(ap);
+  if(n > 0) rb->len += n;
+}
+
+/* The label of a bucket of the latency histograms */
+static const char* latency_label(unsigned int b, char* label)
+{
+  if(b == 0) 
+    sprintf(label, "<1");
+  else if(b == SCHED_HIST_BUCKETS-1)
+    sprintf(label, ">=%lu", 1ul << (b-1));
+  else
+    sprintf(label, "%lu-%lu", 1ul << (b-1), 1ul << b);
+  return label;
+}
+
+size_t sched_stats_report(char* buf, size_t size)
 {
-  rlnode_init(&TIMEOUT_LIST, NULL);
+  report_buffer rb = { buf, size, 0 };
+  if(size > 0) buf[0] = 0;
+
+  unsigned int ncores = cpu_cores();
+  unsigned long by_core[MAX_CORES][SCHED_HIST_BUCKETS];
+  unsigned long by_cause[SCHED_CAUSES][SCHED_HIST_BUCKETS];
+  unsigned long total[SCHED_CAUSES];
+  char label[32];
+
+  /* Sum the per-core histograms both ways */
+  memset(by_core, 0, sizeof(by_core));
+  memset(by_cause, 0, sizeof(by_cause));
+  memset(total, 0, sizeof(total));
+  for(unsigned int c=0; c<ncores; c++)
+    for(int k=0; k<SCHED_CAUSES; k++)
+      for(int b=0; b<SCHED_HIST_BUCKETS; b++) {
+        unsigned long n = cctx[c].latency_hist[k][b];
+        by_core[c][b] += n;
+        by_cause[k][b] += n;
+        total[k] += n;
+      }
+
+  report_printf(&rb, "Scheduler statistics, policy %s\n", SCHED->name);
+
+  report_printf(&rb, "\nWakeup latency (usec) by core\n%12s", "latency");
+  for(unsigned int c=0; c<ncores; c++)
+    report_printf(&rb, "   core %2u", c);
+  report_printf(&rb, "\n");
+  for(int b=0; b<SCHED_HIST_BUCKETS; b++) {
+    unsigned long row = 0;
+    for(unsigned int c=0; c<ncores; c++) row += by_core[c][b];
+    if(row == 0) continue;
+    report_printf(&rb, "%12s", latency_label(b, label));
+    for(unsigned int c=0; c<ncores; c++)
+      report_printf(&rb, " %9lu", by_core[c][b]);
+    report_printf(&rb, "\n");
+  }
+
+  report_printf(&rb, "\nWakeup latency (usec) by cause of the last yield\n%12s", "latency");
+  for(int k=0; k<SCHED_CAUSES; k++)
+    if(total[k]) report_printf(&rb, " %9s", sched_cause_names[k]);
+  report_printf(&rb, "\n");
+  for(int b=0; b<SCHED_HIST_BUCKETS; b++) {
+    unsigned long row = 0;
+    for(int k=0; k<SCHED_CAUSES; k++) row += by_cause[k][b];
+    if(row == 0) continue;
+    report_printf(&rb, "%12s", latency_label(b, label));
+    for(int k=0; k<SCHED_CAUSES; k++)
+      if(total[k]) report_printf(&rb, " %9lu", by_cause[k][b]);
+    report_printf(&rb, "\n");
+  }
 
+  report_printf(&rb, "\nRun queue length at scheduling decisions\n%12s", "length");
+  for(unsigned int c=0; c<ncores; c++)
+    report_printf(&rb, "   core %2u", c);
+  report_printf(&rb, "\n");
+  for(int b=0; b<SCHED_HIST_BUCKETS; b++) {
+    unsigned long row = 0;
+    for(unsigned int c=0; c<ncores; c++) row += cctx[c].runqueue_hist[b];
+    if(row == 0) continue;
+    if(b == SCHED_HIST_BUCKETS-1)
+      sprintf(label, ">=%d", b);
+    else
+      sprintf(label, "%d", b);
+    report_printf(&rb, "%12s", label);
+    for(unsigned int c=0; c<ncores; c++)
+      report_printf(&rb, " %9lu", cctx[c].runqueue_hist[b]);
+    report_printf(&rb, "\n");
+  }
 
-  //Initialize the SCHEDULER.
-  for (int i = 0; i < num_of_queues; i++)
-  	rlnode_init( &(SCHEDULER[i]), NULL);
+  report_printf(&rb, "\nIdle polling, at most %lu usec\n%12s %9s %9s %9s %12s\n", 
+    idle_spin_max, "core", "window", "hits", "misses", "usec");
+  for(unsigned int c=0; c<ncores; c++)
+    report_printf(&rb, "%12u %9lu %9lu %9lu %12lu\n", c, cctx[c].idle_spin_window,
+      cctx[c].idle_spin_hits, cctx[c].idle_spin_misses, cctx[c].idle_spin_time);
 
+  report_printf(&rb, "\nCore parking %s, %u cores parked\n%12s %9s %9s\n", 
+    core_parking ? "on" : "off", parked_cores, "core", "parked", "parks");
+  for(unsigned int c=0; c<ncores; c++)
+    report_printf(&rb, "%12u %9s %9lu\n", c, cctx[c].parked ? "yes" : "no", cctx[c].park_count);
 
-  //Open the file for debugging.
-  #if debugger
-  	debug_file = fopen("scheduler_debugger.txt", "w");
-  #endif
+  return rb.len;
 }
 
 
@@ -629,6 +1924,10 @@ void run_scheduler()
   curcore->idle_thread.state = RUNNING;
   curcore->idle_thread.phase = CTX_DIRTY;
   curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+  curcore->idle_thread.state_spinlock = MUTEX_INIT;
+  lock_profile_name(& curcore->idle_thread.state_spinlock, "TCB.state_spinlock");
+  curcore->idle_thread.affinity = (core_mask_t)1 << cpu_core_id;
+  curcore->switch_stamp = bios_fine_clock();
   rlnode_init(& curcore->idle_thread.sched_node, & curcore->idle_thread);
 
   /* Initialize interrupt handler */
@@ -641,6 +1940,14 @@ void run_scheduler()
 
   /* Finished scheduling */
   assert(CURTHREAD == &CURCORE.idle_thread);
+
+  /* Free the thread blocks of our cache */
+  while(! is_rlist_empty(& curcore->thread_cache)) {
+    TCB* tcb = rlist_pop_front(& curcore->thread_cache)->tcb;
+    free_thread(THREAD_BASE(tcb), THREAD_SIZE(tcb->stack_size));
+  }
+  curcore->thread_cache_size = 0;
+
   cpu_interrupt_handler(ALARM, NULL);
   cpu_interrupt_handler(ICI, NULL);
 }
@@ -74,9 +74,16 @@ enum SCHED_CAUSE {
   SCHED_PIPE,     /**< Sleep at a pipe or socket */
   SCHED_POLL,     /**< The thread is polling a device */
   SCHED_IDLE,     /**< The idle thread called yield */
-  SCHED_USER      /**< User-space code called yield */
+  SCHED_USER,     /**< User-space code called yield */
+  SCHED_TIMER,    /**< A tickless core woke up for a timeout */
+  SCHED_PREEMPT,  /**< An ICI from another core brought a more urgent thread */
+  SCHED_HANDOFF,  /**< The thread handed the core to a thread it woke up */
+  SCHED_FUTEX     /**< Sleep on a contended lock */
 };
 
+/** @brief The number of causes in @c SCHED_CAUSE */
+#define SCHED_CAUSES (SCHED_FUTEX+1)
+
 
 
 
@@ -121,28 +128,77 @@ typedef struct thread_control_block
   Thread_type type;       /**< The type of thread */
   Thread_state state;    /**< The state of the thread */
   Thread_phase phase;    /**< The phase of the thread */
+  int ici_nested;        /**< Set while the thread is preempted by @c ici_handler() */
 
   void (*thread_func)();   /**< The function executed by this thread */
 
   TimerDuration wakeup_time; /**< The time this thread will be woken up by the scheduler */
   rlnode sched_node;      /**< node to use when queueing in the scheduler lists */
 
+  Mutex state_spinlock;   /**< Protects @c state, @c phase and @c wakeup_time */
+
   struct thread_control_block * prev;  /**< previous context */
   struct thread_control_block * next;  /**< next context */
 
   //Priority Index.
   unsigned int prio;
 
+  //The core where the thread last ran.
+  uint last_core;
+
+  core_mask_t affinity;       /**< The cores where the thread may run */
+  TimerDuration last_run;     /**< When the thread last left a core, in usec */
+
   //PTCB.
   PTCB *tcb_ptcb;
+
+  //References to the memory block of the thread (the thread and its PTCB).
+  int block_refs;
+
+  //The size of the stack of the thread.
+  size_t stack_size;
+
+  TimerDuration run_time;     /**< Time spent running on some core, in usec */
+  TimerDuration wait_time;    /**< Time spent ready, waiting for a core, in usec */
+  TimerDuration acct_stamp;   /**< When the thread started running or became ready */
+  enum SCHED_CAUSE last_cause; /**< The cause of the last yield of the thread */
+  unsigned long vol_switches;   /**< Switches where the thread blocked or exited */
+  unsigned long invol_switches; /**< Switches where the thread was preempted */
+
+  TimerDuration recent_cpu;   /**< Decayed cpu usage, kept by the decay policy */
+  TimerDuration recent_stamp; /**< When @c recent_cpu was last decayed */
+
+  rbnode fair_node;           /**< Node in the run queue of the fair policy */
+  long fair_lag;              /**< Virtual runtime ahead (or behind) that of its process */
+  TimerDuration fair_charged; /**< The @c run_time already charged by the fair policy */
+
+  //The deadline class (all zero for normal threads).
+  TimerDuration edf_runtime;  /**< Budget of each period, in usec */
+  TimerDuration edf_period;   /**< The period, in usec, or 0 if not a deadline thread */
+  TimerDuration edf_deadline; /**< The relative deadline of each job, in usec */
+  uint edf_core;              /**< The core where the thread was admitted */
+  TimerDuration edf_budget;   /**< Budget left in the current period */
+  TimerDuration edf_abs_deadline; /**< Deadline of the current job */
+  TimerDuration edf_period_end;   /**< End of the current period */
+  TimerDuration edf_charged;  /**< The @c run_time already charged to the budget */
+  int edf_missed;             /**< Set when the current job missed its deadline */
+  unsigned long edf_jobs;     /**< Number of jobs (periods where the thread woke up) */
+  unsigned long edf_misses;   /**< Number of jobs that missed their deadline */
+  rbnode edf_node;            /**< Node in the deadline queue of @c edf_core */
   
 } TCB;
 
 
 
-/** Thread stack size */
+/** Default thread stack size */
 #define THREAD_STACK_SIZE  (128*1024)
 
+/** Smallest thread stack size. Interrupt handlers also run on thread stacks. */
+#define THREAD_STACK_MIN  (32*1024)
+
+/** Largest thread stack size */
+#define THREAD_STACK_MAX  (64*1024*1024)
+
 
 /************************
  *
@@ -151,6 +207,74 @@ typedef struct thread_control_block
  ************************/
 
 
+/** @brief Number of priority levels of the multilevel feedback queue. 
+
+  This can be changed at build time, with the SCHED_QUEUES variable of the
+  Makefile (e.g., make SCHED_QUEUES=64). Since the non-empty levels of a 
+  run queue are kept in a 64-bit mask, at most 64 levels are supported.
+*/
+#ifndef SCHED_QUEUES
+#define SCHED_QUEUES 10
+#endif
+
+#if SCHED_QUEUES < 2 || SCHED_QUEUES > 64
+#error "SCHED_QUEUES must be between 2 and 64"
+#endif
+
+/** @brief Period (in usec) of the aging of the scheduling policy.
+
+  Every this often, each core calls the @c age hook of the policy on its run
+  queue. E.g., the multilevel feedback queue moves all the threads of the 
+  run queue to the highest priority level, so that low-priority threads 
+  do not starve.
+*/
+#ifndef SCHED_BOOST_PERIOD
+#define SCHED_BOOST_PERIOD (50*QUANTUM)
+#endif
+
+/** @brief The number of buckets of the scheduler histograms.
+
+  Wakeup latencies are kept in log2 buckets: bucket 0 counts waits under 
+  1 usec, and bucket b counts waits in [2^(b-1), 2^b) usec. Run queue lengths
+  are kept in linear buckets. The last bucket counts everything larger.
+*/
+#define SCHED_HIST_BUCKETS 24
+
+/** @brief How long (in usec) a thread is considered cache-hot after it leaves its core.
+
+  A core that steals work does not take a thread that ran on the victim 
+  core more recently than this, unless there is nothing else to take.
+*/
+#ifndef SCHED_MIGRATION_COST
+#define SCHED_MIGRATION_COST 500
+#endif
+
+/** @brief Period (in usec) of the decisions to park or unpark cores. */
+#ifndef PARK_PERIOD
+#define PARK_PERIOD 100000
+#endif
+
+/** @brief A core is parked when the utilization of the others is below this (in percent). */
+#ifndef PARK_LOW
+#define PARK_LOW 25
+#endif
+
+/** @brief A core is unparked when the utilization of the others is above this (in percent). */
+#ifndef PARK_HIGH
+#define PARK_HIGH 75
+#endif
+
+/** @brief A core is unparked when a run queue gets this long. */
+#ifndef UNPARK_DEPTH
+#define UNPARK_DEPTH 2
+#endif
+
+/** @brief The default of @c idle_spin_max, in usec. */
+#ifndef IDLE_SPIN_MAX
+#define IDLE_SPIN_MAX 200
+#endif
+
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related)
@@ -162,6 +286,46 @@ typedef struct core_control_block {
   TCB idle_thread;            /**< Used by the scheduler to handle the core's idle thread */
   sig_atomic_t preemption;    /**< Marks preemption, used by the locking code */
 
+  rlnode ready_list[SCHED_QUEUES]; /**< The core's multilevel run queue */
+  uint64_t ready_mask;        /**< Bit i is set iff @c ready_list[i] is not empty */
+  unsigned int ready_count;   /**< Number of threads in the run queue */
+  TimerDuration last_boost;   /**< Time of the last priority boost */
+  int tickless;               /**< Set when the alarm of the core is not a quantum */
+  TimerDuration slice_end;    /**< When the current timeslice ends, if the core is not tickless */
+
+  rbtree edf_queue;           /**< Deadline threads with budget, by absolute deadline */
+  unsigned int edf_util;      /**< Utilization of the admitted deadline threads, in units of 1/EDF_UTIL_SCALE */
+  TimerDuration edf_running;  /**< The deadline of the current thread, if it runs from @c edf_queue, else @c NO_TIMEOUT */
+
+  rbtree fair_queue;          /**< The run queue of the fair policy, by virtual runtime */
+  TimerDuration fair_front;   /**< The key of the first thread of @c fair_queue, or 
+                                   @c NO_TIMEOUT (read by other cores without the lock) */
+
+  rlnode thread_cache;        /**< Released thread blocks, kept for reuse */
+  unsigned int thread_cache_size;    /**< Number of blocks in @c thread_cache */
+  unsigned long thread_cache_hits;   /**< Threads spawned with a block from @c thread_cache */
+  unsigned long thread_cache_misses; /**< Threads spawned with a newly allocated block */
+  Mutex rq_spinlock;          /**< Protects the run queue of this core */
+
+  TimerDuration busy_time;    /**< Time spent running normal threads, in usec */
+  TimerDuration idle_time;    /**< Time spent running the idle thread, in usec */
+  TimerDuration switch_stamp; /**< Time of the last context switch */
+
+  unsigned long latency_hist[SCHED_CAUSES][SCHED_HIST_BUCKETS]; /**< Time threads 
+                    waited ready before they ran on this core, by the cause of their last yield */
+  unsigned long runqueue_hist[SCHED_HIST_BUCKETS]; /**< Length of the run queue, 
+                    sampled at each scheduling decision */
+
+  TCB* handoff;               /**< A woken thread that runs next on this core */
+
+  TimerDuration idle_spin_window; /**< How long (usec) the idle thread polls before it halts */
+  unsigned long idle_spin_hits;   /**< Idle periods that ended while polling */
+  unsigned long idle_spin_misses; /**< Idle periods that polled for the whole window and halted */
+  TimerDuration idle_spin_time;   /**< Time spent polling, in usec */
+
+  volatile sig_atomic_t parked;   /**< Set while the core is parked */
+  unsigned long park_count;       /**< Number of times the core was parked */
+
 } CCB;
  
 
@@ -201,8 +365,93 @@ extern CCB cctx[MAX_CORES];
 	The thread will belong to process @c pcb and execute @c func.
   Note that, the new thread is returned in the @c INIT state.
   The caller must use @c wakeup() to start it.
+
+  The thread gets a stack of @c stack_size bytes, rounded up to whole pages 
+  and at least @c THREAD_STACK_MIN. If @c stack_size is 0, the stack is 
+  @c THREAD_STACK_SIZE bytes.
+*/
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size);
+
+/**
+  @brief Release the PTCB of a thread.
+
+  The PTCB is kept in the same memory block as the TCB, therefore the
+  block is recycled when both the thread has exited and its PTCB has been
+  released.
+*/
+void release_PTCB(PTCB* ptcb);
+
+/**
+  @brief Get the statistics of the thread block caches of all cores.
+
+  @param hits the number of threads spawned on a recycled block
+  @param misses the number of threads spawned on a newly allocated block
+*/
+void thread_cache_stats(unsigned long* hits, unsigned long* misses);
+
+/** @brief True if the thread may run on core @c c */
+static inline int core_allowed(TCB* tcb, uint c) { return (tcb->affinity >> c) & 1; }
+
+/**
+  @brief Set the cores where a thread may run.
+
+  The mask is restricted to the existing cores. A deadline thread must 
+  keep the core where it was admitted. If the current thread may no longer 
+  run on the current core, it moves to another core at once.
+
+  @returns 0 on success, or -1 if the mask contains no core, or it does not
+  contain the core of a deadline thread.
+*/
+int sched_set_affinity(TCB* tcb, core_mask_t mask);
+
+/**
+  @brief The most time (in usec) that an idle core polls its run queue
+  before it halts.
+
+  An idle core polls for new work for a while before it halts, so that a
+  thread that wakes up soon after does not wait for the host to restart 
+  the core. The window of each core adapts to the length of its recent
+  idle periods, like the halt polling of hypervisors: it doubles when the
+  core halted, but work came within @c idle_spin_max usec, and it halves
+  when the core stayed idle for longer. Polling takes host cpu, and this 
+  caps the waste of each idle period. Zero turns polling off.
+
+  The default is @c IDLE_SPIN_MAX, or the value of the environment 
+  variable @c TINYOS_IDLE_SPIN at boot. It can also be changed at run time.
+*/
+extern TimerDuration idle_spin_max;
+
+/**
+  @brief Park surplus cores.
+
+  The scheduler measures the utilization of the cores every @c PARK_PERIOD.
+  When it is below @c PARK_LOW, the highest unparked core is parked: its 
+  threads move to other cores, and it halts with no timer. Threads do not
+  wake up on a parked core, and no core steals from it or restarts it.
+  Core 0 and cores with deadline threads are never parked.
+
+  A parked core is unparked when the utilization goes above @c PARK_HIGH,
+  or when a run queue gets @c UNPARK_DEPTH threads, or when a thread may 
+  only run on parked cores (see @c SetThreadAffinity).
+
+  The default is on, unless the environment variable @c TINYOS_PARK is 0 
+  at boot. When it is turned off, the cores are unparked one per period.
+*/
+extern int core_parking;
+
+/**
+  @brief Unpark a core, if it is parked.
+*/
+void core_unpark(CCB* core);
+
+/**
+  @brief Get the statistics of idle polling of all cores.
+
+  @param hits the number of idle periods that ended while polling
+  @param misses the number of idle periods that polled for the whole window
+  @param spin_time the total time spent polling, in usec
 */
-TCB* spawn_thread(PCB* pcb, void (*func)());
+void idle_spin_stats(unsigned long* hits, unsigned long* misses, TimerDuration* spin_time);
 
 /**
   @brief Wakeup a blocked thread.
@@ -216,6 +465,29 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
 */
 int wakeup(TCB* tcb);
 
+/**
+  @brief Wakeup a blocked thread, and hand it the current core.
+
+  This is like @c wakeup(), but the thread does not go through a run queue.
+  Instead, it becomes the thread that runs next on the current core, at the
+  next call to @c yield() (see @c yield_handoff()). If the current core
+  already has a handoff thread, or the thread has not finished switching
+  out of some core, this is the same as @c wakeup().
+
+  @param tcb the thread to be made @c READY.
+  @returns 1 if the thread state was @c STOPPED or @c INIT, 0 otherwise
+  @see yield_handoff
+*/
+int wakeup_handoff(TCB* tcb);
+
+/**
+  @brief Switch to the handoff thread of the current core, if any.
+
+  The current thread stays @c READY. Kernel code calls this after releasing
+  its locks, so that the handoff thread does not block on them at once.
+*/
+void yield_handoff();
+
 
 /** 
   @brief Block the current thread.
@@ -249,6 +521,20 @@ int wakeup(TCB* tcb);
    */
 void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout);
 
+/**
+    @brief Block the current thread, posting a semaphore.
+
+    This is the same as @c sleep_releasing, but the state of the thread changes
+    atomically with a post on a semaphore, instead of a mutex unlock. It is used 
+    for the kernel locks (see @c kernel_sleep).
+
+    @param newstate the new state for the thread
+    @param sem the semaphore to post.
+    @param cause the cause of the sleep
+    @param timeout a timeout for the sleep, or @c NO_TIMEOUT
+   */
+void sleep_posting(Thread_state newstate, Semaphore* sem, enum SCHED_CAUSE cause, TimerDuration timeout);
+
 /**
   @brief Give up the CPU.
 
@@ -267,12 +553,217 @@ void yield(enum SCHED_CAUSE cause);
 */
 void run_scheduler(void); 
 
+struct sched_policy;
+
 /**
   @brief Initialize the scheduler.
 
    This function is called during kernel initialization.
+   The scheduler uses @c policy, or if it is NULL, the policy named by the
+   environment variable @c TINYOS_SCHED, or else the multilevel feedback queue.
+ */
+void initialize_scheduler(const struct sched_policy* policy); 
+
+/**
+  @brief Format a report of the scheduler histograms.
+
+  The report is written to @c buf like @c snprintf, i.e., at most @c size bytes
+  are written, including the terminating 0.
+
+  @returns the length of the whole report
  */
-void initialize_scheduler(void); 
+size_t sched_stats_report(char* buf, size_t size);
+
+
+/************************
+ *
+ *   Scheduling policies
+ *
+ ************************/
+
+/**
+  @brief A scheduling policy.
+
+  The run queue of each core has @c SCHED_QUEUES levels, and level 0 is the
+  most urgent. A policy decides the level of each thread (in @c tcb->prio),
+  and which thread runs next. The scheduler calls the hooks of the policy
+  as follows:
+
+  - @c enqueue and @c pick, with the @c rq_spinlock of the core held. The
+    default is @c rq_push and @c rq_pop.
+  - @c preempt, when the current thread leaves the core but stays ready:
+    it used up its quantum (@c SCHED_QUANTUM), or a more urgent thread 
+    took the core, or it yielded (e.g., @c SCHED_MUTEX while spinning).
+  - @c block, when the current thread leaves the core voluntarily (it 
+    blocks or exits), with the cause of the call to @c yield().
+  - @c wake, when a thread becomes ready after @c INIT or @c STOPPED, with 
+    its @c state_spinlock held.
+  - @c age, every @c SCHED_BOOST_PERIOD on each core, with the 
+    @c rq_spinlock of the core held.
+  - @c keep, at the end of a quantum of the current thread, with the 
+    @c rq_spinlock of the core held. If it returns non-zero, the thread 
+    runs another quantum instead of being preempted.
+  - @c balance, before each @c pick on a core, with no lock held. It may
+    move threads from the run queues of other cores to this one.
+
+  All hooks run in the non-preemptive domain. The hooks after @c pick may 
+  be NULL.
+*/
+typedef struct sched_policy {
+  const char* name;         /**< The name used to select the policy */
+  void (*enqueue)(CCB* core, TCB* tcb);   /**< Add a ready thread to the run queue */
+  TCB* (*pick)(CCB* core);                /**< Remove and return the next thread, or NULL */
+  void (*preempt)(CCB* core, TCB* current, enum SCHED_CAUSE cause); /**< The current thread is preempted, or yields */
+  void (*block)(TCB* current, enum SCHED_CAUSE cause); /**< The current thread yields the core */
+  void (*wake)(TCB* tcb);                 /**< A thread becomes ready */
+  void (*age)(CCB* core, TimerDuration now); /**< Periodic aging of the run queue */
+  int (*keep)(CCB* core, TCB* current);   /**< The current thread may run another quantum */
+  void (*balance)(CCB* core);             /**< Pull threads from other cores */
+} sched_policy;
+
+/** @brief The multilevel feedback queue policy (the default). */
+extern const sched_policy sched_mlfq;
+
+/**
+  @brief The heuristics of the multilevel feedback queue.
+
+  For each cause, the number of levels by which a thread moves when it
+  leaves its core for this cause. A positive number demotes the thread
+  and a negative number promotes it. By default:
+  - a thread that uses up its quantum drops one level,
+  - a thread that sleeps for I/O, or at a pipe or socket, rises one 
+    level, so that it runs soon after the thread that wakes it up,
+  - a thread that spins in @c Mutex_Lock drops one level, so that the
+    holder of the mutex gets the core.
+
+  The table can be tuned before @c boot().
+*/
+extern int mlfq_cause_adjust[SCHED_CAUSES];
+
+/** @brief The round-robin policy, with a single level. */
+extern const sched_policy sched_rr;
+
+/** @brief The decay-usage policy, where the level follows the recent cpu usage. */
+extern const sched_policy sched_decay;
+
+/** @brief The fair-share policy, which divides the cpu among processes by weight. */
+extern const sched_policy sched_fair;
+
+/** @brief The weight of a process with nice value 0. */
+#define NICE_0_WEIGHT 1024
+
+/** 
+  @brief The weight of a process with the given nice value. 
+
+  Each nice level is worth about 25% of cpu, against a process of the 
+  next level. The nice value is clamped to [NICE_MIN, NICE_MAX].
+*/
+unsigned int sched_nice_weight(int nice);
+
+/** @brief The policy in use. */
+extern const sched_policy* SCHED;
+
+/**
+  @brief Find a scheduling policy by name.
+
+  @returns the policy, or NULL if there is no policy with this name.
+*/
+const sched_policy* sched_find_policy(const char* name);
+
+/**
+  @brief Add a thread to the end of its level in a core's run queue.
+
+  *** MUST BE CALLED WITH core->rq_spinlock HELD ***
+*/
+void rq_push(CCB* core, TCB* tcb);
+
+/**
+  @brief Remove and return the first thread of the most urgent non-empty 
+  level of a core's run queue, or NULL if the run queue is empty.
+
+  *** MUST BE CALLED WITH core->rq_spinlock HELD ***
+*/
+TCB* rq_pop(CCB* core);
+
+
+
+/************************
+ *
+ *   Deadline class
+ *
+ ************************/
+
+/**
+  @brief The deadline (EDF) class.
+
+  A thread joins the deadline class by declaring a runtime, a period and a
+  relative deadline (see @c SetDeadline). It is admitted to an allowed core whose 
+  total utilization (the sum of runtime/period) stays below 
+  @c EDF_UTIL_MAX, and from then on it is queued only on that core.
+
+  A job starts when the thread wakes up, and it is released at that time,
+  or at the end of the previous period if that is later. The thread gets
+  @c edf_runtime usec of budget and its absolute deadline, and while it has
+  budget it runs ahead of all the threads of the policy, earliest deadline
+  first. A thread that uses up its budget is scheduled by the policy, like
+  a normal thread, until its next period. A job misses its deadline when
+  the thread blocks after the deadline.
+*/
+
+/** @brief Fixed-point scale of utilizations. */
+#define EDF_UTIL_SCALE 1024
+
+/** @brief The most utilization admitted on a core (the rest is left to normal threads). */
+#define EDF_UTIL_MAX (EDF_UTIL_SCALE*9/10)
+
+/** @brief True if the thread is in the deadline class */
+static inline int is_edf(TCB* tcb) { return tcb->edf_period != 0; }
+
+/**
+  @brief Admit the current thread to the deadline class, or change its
+  parameters, or remove it from the class if @c period is 0.
+
+  @returns 0 on success, or -1 if the parameters are invalid or no core 
+  can admit the thread.
+*/
+int edf_admit(TCB* tcb, TimerDuration runtime, TimerDuration period, TimerDuration deadline);
+
+/**
+  @brief Return the utilization of a thread to its core, when it is released.
+*/
+void edf_release(TCB* tcb);
+
+/**
+  @brief A deadline thread becomes ready. Maybe start a new job.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+void edf_wake(TCB* tcb);
+
+/**
+  @brief A deadline thread leaves its core voluntarily, ending its job.
+*/
+void edf_block(TCB* tcb);
+
+/**
+  @brief Charge the budget of a deadline thread with the time it ran.
+  @returns 1 if the thread still has budget.
+*/
+int edf_charge(TCB* tcb);
+
+/**
+  @brief Add a deadline thread with budget to the deadline queue of a core.
+
+  *** MUST BE CALLED WITH core->rq_spinlock HELD ***
+*/
+void edf_enqueue(CCB* core, TCB* tcb);
+
+/**
+  @brief Remove and return the thread with the earliest deadline, or NULL.
+
+  *** MUST BE CALLED WITH core->rq_spinlock HELD ***
+*/
+TCB* edf_pick(CCB* core);
 
 
 /**
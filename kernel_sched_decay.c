@@ -0,0 +1,85 @@
+
+#include "kernel_sched.h"
+
+/**
+	@file kernel_sched_decay.c
+
+	@brief The decay-usage policy.
+
+	Each thread keeps its recent cpu usage in @c recent_cpu. Every quantum 
+	it uses up is added to it, and it is halved every @c SCHED_BOOST_PERIOD.
+	The level of a thread is proportional to its recent usage, so a thread
+	that was busy a while ago is not punished for ever, and a thread that
+	sleeps a lot stays at the top levels.
+
+	The decay is applied lazily, when the thread is looked at, using 
+	@c recent_stamp.
+*/
+
+/* The usage that costs one level */
+#define DECAY_LEVEL_USAGE (2*QUANTUM)
+
+
+/* Apply the halvings that are due up to now, and recompute the level */
+static void decay_update(TCB* tcb, TimerDuration now)
+{
+  if(now > tcb->recent_stamp) {
+    TimerDuration periods = (now - tcb->recent_stamp) / SCHED_BOOST_PERIOD;
+    tcb->recent_cpu = (periods >= 64) ? 0 : tcb->recent_cpu >> periods;
+    tcb->recent_stamp += periods * SCHED_BOOST_PERIOD;
+  }
+
+  TimerDuration level = tcb->recent_cpu / DECAY_LEVEL_USAGE;
+  tcb->prio = (level < SCHED_QUEUES-1) ? level : SCHED_QUEUES-1;
+}
+
+
+static void decay_preempt(CCB* core, TCB* current, enum SCHED_CAUSE cause)
+{
+  if(cause != SCHED_QUANTUM) return;
+  current->recent_cpu += QUANTUM;
+  decay_update(current, bios_clock());
+}
+
+
+static void decay_wake(TCB* tcb)
+{
+  decay_update(tcb, bios_clock());
+}
+
+
+/*
+  Recompute the level of every thread in a core's run queue.
+
+  *** MUST BE CALLED WITH core->rq_spinlock HELD ***
+*/
+static void decay_age(CCB* core, TimerDuration now)
+{
+  rlnode all;
+  rlnode_init(&all, NULL);
+
+  while(core->ready_mask) {
+    int i = __builtin_ctzll(core->ready_mask);
+    rlist_append(&all, &core->ready_list[i]);
+    core->ready_mask &= ~((uint64_t)1 << i);
+  }
+  core->ready_count = 0;
+
+  /* Re-insert in order, so that the FIFO order within each level is kept */
+  while(! is_rlist_empty(&all)) {
+    TCB* tcb = rlist_pop_front(&all)->tcb;
+    decay_update(tcb, now);
+    rq_push(core, tcb);
+  }
+}
+
+
+const sched_policy sched_decay = {
+  .name = "decay",
+  .enqueue = rq_push,
+  .pick = rq_pop,
+  .preempt = decay_preempt,
+  .block = NULL,
+  .wake = decay_wake,
+  .age = decay_age
+};
@@ -0,0 +1,146 @@
+
+#include "kernel_sched.h"
+
+/**
+	@file kernel_sched_edf.c
+
+	@brief The deadline (EDF) class.
+
+	The deadline threads of a core are kept in @c edf_queue, ordered by
+	absolute deadline. The scheduler looks there before it asks the policy
+	(see @c sched_queue_select). The budget of a thread is charged with its
+	@c run_time, like the fair policy does, and the alarm of a core that
+	runs a deadline thread is set to expire when the budget runs out.
+*/
+
+
+/* Utilization of a thread, in units of 1/EDF_UTIL_SCALE (rounded up) */
+static unsigned int edf_util(TimerDuration runtime, TimerDuration period)
+{
+  return (runtime*EDF_UTIL_SCALE + period - 1) / period;
+}
+
+
+/* Try to reserve some utilization on a core */
+static int edf_reserve(CCB* core, unsigned int util)
+{
+  unsigned int old = __atomic_load_n(& core->edf_util, __ATOMIC_RELAXED);
+  do {
+    if(old + util > EDF_UTIL_MAX) return 0;
+  } while(! __atomic_compare_exchange_n(& core->edf_util, &old, old+util, 0, 
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return 1;
+}
+
+
+void edf_release(TCB* tcb)
+{
+  if(! is_edf(tcb)) return;
+  __atomic_fetch_sub(& cctx[tcb->edf_core].edf_util, 
+    edf_util(tcb->edf_runtime, tcb->edf_period), __ATOMIC_RELAXED);
+  tcb->edf_period = 0;
+}
+
+
+int edf_admit(TCB* tcb, TimerDuration runtime, TimerDuration period, TimerDuration deadline)
+{
+  if(period == 0) {
+    edf_release(tcb);
+    return 0;
+  }
+  if(runtime == 0 || runtime > deadline || deadline > period)
+    return -1;
+
+  /* Give back the old reservation, but keep it if no core can take the new one */
+  unsigned int util = edf_util(runtime, period);
+  int was_edf = is_edf(tcb);
+  uint old_core = tcb->edf_core;
+  unsigned int old_util = was_edf ? edf_util(tcb->edf_runtime, tcb->edf_period) : 0;
+  if(was_edf)
+    __atomic_fetch_sub(& cctx[old_core].edf_util, old_util, __ATOMIC_RELAXED);
+
+  /* First fit among the allowed cores, starting from the current core */
+  uint ncores = cpu_cores();
+  int found = -1;
+  for(uint i=0; i<ncores && found<0; i++) {
+    uint c = (cpu_core_id + i) % ncores;
+    if(core_allowed(tcb, c) && edf_reserve(& cctx[c], util)) found = c;
+  }
+
+  if(found < 0) {
+    if(was_edf)
+      __atomic_fetch_add(& cctx[old_core].edf_util, old_util, __ATOMIC_RELAXED);
+    return -1;
+  }
+
+  /* The core must run the thread */
+  core_unpark(& cctx[found]);
+
+  /* The first job starts now */
+  TimerDuration now = bios_clock();
+  tcb->edf_core = found;
+  tcb->edf_runtime = runtime;
+  tcb->edf_deadline = deadline;
+  tcb->edf_budget = runtime;
+  tcb->edf_abs_deadline = now + deadline;
+  tcb->edf_period_end = now + period;
+  tcb->edf_charged = tcb->run_time;
+  tcb->edf_missed = 0;
+  tcb->edf_jobs++;
+  tcb->edf_period = period;   /* Last, this makes the thread a deadline thread */
+  return 0;
+}
+
+
+int edf_charge(TCB* tcb)
+{
+  TimerDuration ran = tcb->run_time - tcb->edf_charged;
+  tcb->edf_charged = tcb->run_time;
+  tcb->edf_budget = (ran < tcb->edf_budget) ? tcb->edf_budget - ran : 0;
+  return tcb->edf_budget > 0;
+}
+
+
+void edf_wake(TCB* tcb)
+{
+  /* 
+    A new job. If the thread wakes up before the end of the period, the
+    job is released at the end of the period, so that the thread gets at
+    most one budget per period. But, it may start to run early.
+  */
+  TimerDuration now = bios_clock();
+  TimerDuration release = (now < tcb->edf_period_end) ? tcb->edf_period_end : now;
+
+  edf_charge(tcb);
+  tcb->edf_budget = tcb->edf_runtime;
+  tcb->edf_abs_deadline = release + tcb->edf_deadline;
+  tcb->edf_period_end = release + tcb->edf_period;
+  tcb->edf_missed = 0;
+  tcb->edf_jobs++;
+}
+
+
+void edf_block(TCB* tcb)
+{
+  if(! tcb->edf_missed && bios_clock() > tcb->edf_abs_deadline) {
+    tcb->edf_missed = 1;
+    tcb->edf_misses++;
+  }
+}
+
+
+void edf_enqueue(CCB* core, TCB* tcb)
+{
+  tcb->edf_node.key = tcb->edf_abs_deadline;
+  rbtree_insert(& core->edf_queue, & tcb->edf_node);
+}
+
+
+TCB* edf_pick(CCB* core)
+{
+  rbnode* node = rbtree_first(& core->edf_queue);
+  if(node == NULL) 
+    return NULL;
+  rbtree_remove(& core->edf_queue, node);
+  return node->tcb;
+}
@@ -0,0 +1,265 @@
+#include "kernel_sched.h"
+#include "kernel_proc.h"
+
+/**
+	@file kernel_sched_fair.c
+
+	@brief The fair-share policy.
+
+	The cpu is shared among processes in proportion to their weight (see
+	@c SetNice), no matter how many threads each one has, and the share of
+	a process is divided equally among its ready threads.
+
+	Each process has a virtual runtime, @c fair_vruntime of the PCB, which
+	advances by NICE_0_WEIGHT/W usec for each usec that any of its threads
+	runs, on any core, where W is the weight of the process. Each thread 
+	has a lag, @c fair_lag of the TCB, how far its own virtual runtime is 
+	ahead of that of its process. A thread advances n times as fast as its
+	process, where n is the number of ready threads of the process, so the
+	threads that share its cpu equally keep their lag, a thread that ran 
+	more moves ahead, and one that ran less falls behind. The lag is kept 
+	within FAIR_WAKEUP_CREDIT behind, so that a thread that slept a while 
+	does not get more than a little credit, and FAIR_MAX_LEAD ahead, so 
+	that a thread of a process with many ready threads (say, a mutex 
+	holder among its waiters) is not kept off the cpu for long.
+
+	Each core keeps its ready threads in an ordered tree, by virtual 
+	runtime, and always runs the first one. Since the virtual runtimes of 
+	the processes are global, a process that runs on many cores falls 
+	behind no one, and its threads give way to the other processes on 
+	every core they share.
+
+	A thread is queued at the virtual runtime of its process plus its lag,
+	and is charged for the time it ran when it is queued again. The key of
+	a queued thread falls behind while its process runs elsewhere; when the
+	thread reaches the front of its tree, it is moved up to at most 
+	FAIR_WAKEUP_CREDIT behind its process, plus its lag, so that the 
+	threads of a process keep their order.
+
+	Since the current thread is not in the tree, a core with two threads 
+	would simply alternate them. Instead, at the end of its quantum, the 
+	current thread keeps the core while it is still behind the first 
+	thread of the tree.
+
+	The virtual runtimes are only compared within a core, so before each 
+	pick, a core pulls the first thread of another core, if that thread is
+	well behind its own first thread. A process cannot get more than a core
+	per thread, and the pulls share the rest among the other processes.
+
+	There is a global virtual clock, @c fair_clock, the largest key picked 
+	on any core. A process that becomes runnable again is moved close to it,
+	so that sleeping earns little credit.
+*/
+
+/* The most that a process, or a thread within its process, may be behind
+   the others after a sleep */
+#define FAIR_WAKEUP_CREDIT (QUANTUM/2)
+
+/* The most that a thread may be ahead of its process */
+#define FAIR_MAX_LEAD QUANTUM
+
+/* How far behind the first thread of another core must be, to pull it */
+#define FAIR_PULL_LAG QUANTUM
+
+static TimerDuration fair_clock;
+
+
+static const unsigned int nice_weight[NICE_MAX-NICE_MIN+1] = {
+ /* -20 */ 88761, 71755, 56483, 46273, 36291,
+ /* -15 */ 29154, 23254, 18705, 14949, 11916,
+ /* -10 */  9548,  7620,  6100,  4904,  3906,
+ /*  -5 */  3121,  2501,  1991,  1586,  1277,
+ /*   0 */  1024,   820,   655,   526,   423,
+ /*   5 */   335,   272,   215,   172,   137,
+ /*  10 */   110,    87,    70,    56,    45,
+ /*  15 */    36,    29,    23,    18,    15,
+};
+
+unsigned int sched_nice_weight(int nice)
+{
+  if(nice < NICE_MIN) nice = NICE_MIN;
+  if(nice > NICE_MAX) nice = NICE_MAX;
+  return nice_weight[nice - NICE_MIN];
+}
+
+
+/* Insert a thread with its key set */
+static void fair_insert(CCB* core, TCB* tcb)
+{
+  rbtree_insert(& core->fair_queue, & tcb->fair_node);
+  core->ready_count++;
+  __atomic_store_n(& core->fair_front, rbtree_first(& core->fair_queue)->key, __ATOMIC_RELAXED);
+}
+
+
+/* Raise an atomic variable to at least val */
+static void fair_raise(TimerDuration* var, TimerDuration val)
+{
+  TimerDuration old = __atomic_load_n(var, __ATOMIC_RELAXED);
+  while(old < val 
+        && ! __atomic_compare_exchange_n(var, &old, val, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+/* The key of a thread whose process is at virtual runtime vr */
+static inline TimerDuration fair_key(TCB* tcb, TimerDuration vr)
+{
+  long lag = tcb->fair_lag;
+  return (lag < 0 && vr < (TimerDuration) -lag) ? 0 : vr + lag;
+}
+
+
+/* Charge the time the thread ran since it was last charged, and return 
+   its key */
+static TimerDuration fair_charge(TCB* tcb)
+{
+  TimerDuration ran = tcb->run_time - tcb->fair_charged;
+  tcb->fair_charged = tcb->run_time;
+
+  PCB* pcb = tcb->owner_pcb;
+  TimerDuration vran = ran * NICE_0_WEIGHT / pcb->weight;
+  TimerDuration vr = __atomic_add_fetch(& pcb->fair_vruntime, vran, __ATOMIC_RELAXED);
+
+  int nready = __atomic_load_n(& pcb->fair_runnable, __ATOMIC_RELAXED);
+  if(nready < 1) nready = 1;
+  tcb->fair_lag += (long) vran * (nready - 1);
+  if(tcb->fair_lag > FAIR_MAX_LEAD)
+    tcb->fair_lag = FAIR_MAX_LEAD;
+  return fair_key(tcb, vr);
+}
+
+
+static void fair_enqueue(CCB* core, TCB* tcb)
+{
+  tcb->fair_node.key = fair_charge(tcb);
+  fair_insert(core, tcb);
+}
+
+
+/* The first node of the tree, after its key is brought up to date */
+static rbnode* fair_first(CCB* core)
+{
+  rbnode* node;
+
+  /* Move up stale keys, at most once per queued thread */
+  for(unsigned int n = core->ready_count; ; n--) {
+    node = rbtree_first(& core->fair_queue);
+    if(node == NULL)
+      break;
+    TCB* tcb = node->tcb;
+    TimerDuration vr = __atomic_load_n(& tcb->owner_pcb->fair_vruntime, __ATOMIC_RELAXED);
+    if(vr < FAIR_WAKEUP_CREDIT || n == 0) break;
+    TimerDuration key = fair_key(tcb, vr - FAIR_WAKEUP_CREDIT);
+    if(node->key >= key) break;
+    rbtree_remove(& core->fair_queue, node);
+    node->key = key;
+    rbtree_insert(& core->fair_queue, node);
+  }
+
+  __atomic_store_n(& core->fair_front, node ? node->key : NO_TIMEOUT, __ATOMIC_RELAXED);
+  return node;
+}
+
+
+/* Remove a node from the tree */
+static void fair_remove(CCB* core, rbnode* node)
+{
+  rbtree_remove(& core->fair_queue, node);
+  core->ready_count--;
+  rbnode* first = rbtree_first(& core->fair_queue);
+  __atomic_store_n(& core->fair_front, first ? first->key : NO_TIMEOUT, __ATOMIC_RELAXED);
+}
+
+
+static TCB* fair_pick(CCB* core)
+{
+  rbnode* node = fair_first(core);
+  if(node == NULL)
+    return NULL;
+  fair_remove(core, node);
+
+  /* A thread that waited long has the most credit */
+  TCB* tcb = node->tcb;
+  TimerDuration vr = __atomic_load_n(& tcb->owner_pcb->fair_vruntime, __ATOMIC_RELAXED);
+  long lag = (long) (node->key - vr);
+  tcb->fair_lag = (lag < -FAIR_WAKEUP_CREDIT) ? -FAIR_WAKEUP_CREDIT : lag;
+
+  fair_raise(& fair_clock, node->key);
+  return tcb;
+}
+
+
+static void fair_block(TCB* current, enum SCHED_CAUSE cause)
+{
+  __atomic_fetch_sub(& current->owner_pcb->fair_runnable, 1, __ATOMIC_RELAXED);
+}
+
+
+static void fair_wake(TCB* tcb)
+{
+  PCB* pcb = tcb->owner_pcb;
+  if(__atomic_fetch_add(& pcb->fair_runnable, 1, __ATOMIC_RELAXED) > 0)
+    return;
+
+  /* Sleeping does not earn more than a little credit */
+  TimerDuration clock = __atomic_load_n(& fair_clock, __ATOMIC_RELAXED);
+  if(clock > FAIR_WAKEUP_CREDIT)
+    fair_raise(& pcb->fair_vruntime, clock - FAIR_WAKEUP_CREDIT);
+}
+
+
+static int fair_keep(CCB* core, TCB* current)
+{
+  /* Charge the quantum now, the thread may not be queued for a while */
+  TimerDuration key = fair_charge(current);
+
+  rbnode* node = fair_first(core);
+  return node == NULL || key < node->key;
+}
+
+
+static void fair_balance(CCB* self)
+{
+  /* Find the first thread furthest behind ours (the reads are racy) */
+  TimerDuration front = __atomic_load_n(& self->fair_front, __ATOMIC_RELAXED);
+  TimerDuration best = front;
+  CCB* victim = NULL;
+  for(uint c=0; c<cpu_cores(); c++) {
+    CCB* core = & cctx[c];
+    TimerDuration key = __atomic_load_n(& core->fair_front, __ATOMIC_RELAXED);
+    if(core != self && key != NO_TIMEOUT && key + FAIR_PULL_LAG < best) {
+      best = key;
+      victim = core;
+    }
+  }
+  if(victim == NULL) return;
+
+  /* Check again with the lock, and take it */
+  TCB* tcb = NULL;
+  Mutex_Lock(& victim->rq_spinlock);
+  rbnode* node = fair_first(victim);
+  if(node != NULL && core_allowed(node->tcb, self->id) 
+     && (front == NO_TIMEOUT || node->key + FAIR_PULL_LAG < front)) {
+    fair_remove(victim, node);
+    tcb = node->tcb;
+  }
+  Mutex_Unlock(& victim->rq_spinlock);
+  if(tcb == NULL) return;
+
+  Mutex_Lock(& self->rq_spinlock);
+  fair_insert(self, tcb);
+  Mutex_Unlock(& self->rq_spinlock);
+}
+
+
+const sched_policy sched_fair = {
+  .name = "fair",
+  .enqueue = fair_enqueue,
+  .pick = fair_pick,
+  .preempt = NULL,
+  .block = fair_block,
+  .wake = fair_wake,
+  .age = NULL,
+  .keep = fair_keep,
+  .balance = fair_balance
+};
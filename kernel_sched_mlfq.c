@@ -0,0 +1,84 @@
+
+#include "kernel_sched.h"
+
+/**
+	@file kernel_sched_mlfq.c
+
+	@brief The multilevel feedback queue policy.
+
+	A thread starts at level 0. Each time it leaves its core, it moves by
+	the levels that @c mlfq_cause_adjust gives for the cause. Every
+	@c SCHED_BOOST_PERIOD all ready threads of a core are moved back to 
+	level 0, so that no thread starves.
+*/
+
+
+int mlfq_cause_adjust[SCHED_CAUSES] = {
+  [SCHED_QUANTUM] = +1,
+  [SCHED_IO]      = -1,
+  [SCHED_MUTEX]   = +1,
+  [SCHED_PIPE]    = -1,
+  [SCHED_POLL]    = 0,
+  [SCHED_IDLE]    = 0,
+  [SCHED_USER]    = 0,
+  [SCHED_TIMER]   = 0,
+  [SCHED_PREEMPT] = 0,
+  [SCHED_HANDOFF] = 0,
+  [SCHED_FUTEX]   = 0
+};
+
+
+static void mlfq_adjust(TCB* current, enum SCHED_CAUSE cause)
+{
+  int prio = (int)current->prio + mlfq_cause_adjust[cause];
+  if (prio < 0) prio = 0;
+  if (prio > SCHED_QUEUES - 1) prio = SCHED_QUEUES - 1;
+  current->prio = prio;
+}
+
+
+static void mlfq_preempt(CCB* core, TCB* current, enum SCHED_CAUSE cause)
+{
+  mlfq_adjust(current, cause);
+}
+
+
+static void mlfq_block(TCB* current, enum SCHED_CAUSE cause)
+{
+  mlfq_adjust(current, cause);
+}
+
+
+/*
+  Move every thread of a core's run queue to the highest priority
+  level. 
+
+  *** MUST BE CALLED WITH core->rq_spinlock HELD ***
+*/
+static void mlfq_boost(CCB* core, TimerDuration now)
+{
+  uint64_t mask = core->ready_mask & ~(uint64_t)1;
+
+  while (mask) {
+  	int i = __builtin_ctzll(mask);
+  	mask &= mask-1;
+
+  	for (rlnode* n = core->ready_list[i].next; n != &core->ready_list[i]; n = n->next)
+  		n->tcb->prio = 0;
+  	rlist_append( &core->ready_list[0], &core->ready_list[i] );
+  }
+
+  if (core->ready_mask)
+  	core->ready_mask = 1;
+}
+
+
+const sched_policy sched_mlfq = {
+  .name = "mlfq",
+  .enqueue = rq_push,
+  .pick = rq_pop,
+  .preempt = mlfq_preempt,
+  .block = mlfq_block,
+  .wake = NULL,
+  .age = mlfq_boost
+};
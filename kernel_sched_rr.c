@@ -0,0 +1,31 @@
+
+#include "kernel_sched.h"
+
+/**
+	@file kernel_sched_rr.c
+
+	@brief The round-robin policy.
+
+	Every thread is kept at level 0, so the run queue of each core is a 
+	single FIFO list, and ready threads take turns of one quantum each.
+	This is the baseline to compare the other policies against.
+*/
+
+
+static void rr_enqueue(CCB* core, TCB* tcb)
+{
+  //Threads may come from another policy, with a different level.
+  tcb->prio = 0;
+  rq_push(core, tcb);
+}
+
+
+const sched_policy sched_rr = {
+  .name = "rr",
+  .enqueue = rr_enqueue,
+  .pick = rq_pop,
+  .preempt = NULL,
+  .block = NULL,
+  .wake = NULL,
+  .age = NULL
+};
@@ -33,6 +33,9 @@ typedef struct Pipe_Control_Block
 	//Condition Variables.
 	CondVar haspace, hasdata;
 
+	//Protects the pipe (kept last, it must match the copy in kernel_pipe.c).
+	klock lock;
+
 }PIPCB;
 //================================Pipe Control Block================================//
 
@@ -157,6 +160,9 @@ typedef struct request
 //Port Table.
 SCB *port_table[MAX_PORT+1];
 
+//Protects the port table, the listeners and their request queues.
+klock port_lock = KLOCK_INIT;
+
 
 
 
@@ -257,6 +263,9 @@ int sock_close(void* this)
 		return -1;
 
 
+	//Close may come from any stream call, so take the port lock here.
+	kernel_lock( &port_lock );
+
 	//Temp variable.
 	enum SOCK_TYPE type = socket->type;
 	
@@ -285,6 +294,8 @@ int sock_close(void* this)
 	//Free the socket.
 	free(socket);
 
+	kernel_unlock( &port_lock );
+
 	return 0;
 }
 
@@ -297,6 +308,9 @@ int sock_close(void* this)
 void initialize_sockets()
 {
 
+	//Name the port lock for the lock profile.
+	lock_profile_name(&port_lock, "port_lock");
+
 	//Initialize port table.
 	for (int i = 0; i < MAX_PORT+1; i++)
 		port_table[i] = NULL;
@@ -386,6 +400,7 @@ int sys_Listen(Fid_t sock)
 
 	//Initialize the cond variable of the listening socket.
 	socket->sock_type_obj.lis_sock.req = COND_INIT;
+	lock_profile_name(&socket->sock_type_obj.lis_sock.req.waitset_lock, "listener req");
 
 	//Change the type to LISTEN.
 	socket->type = SOCK_LISTEN;
@@ -428,7 +443,7 @@ Fid_t sys_Accept(Fid_t lsock)
 			return NOFILE;
 
 		//Else wait.
-		kernel_wait( &(socket->sock_type_obj.lis_sock.req), SCHED_USER );
+		kernel_wait( &port_lock, &(socket->sock_type_obj.lis_sock.req), SCHED_PIPE );
 	}
 
 	//The socket was closed.
@@ -475,8 +490,8 @@ Fid_t sys_Accept(Fid_t lsock)
 	//Request accepted.
 	request->accepted = 1;
 
-	//Wake up the request socket.
-	kernel_broadcast( &(request->conn_cv) );
+	//Wake up the request socket, and let it run.
+	kernel_signal_yield( &(request->conn_cv) );
 	
 	return new_sock;
 }
@@ -519,6 +534,7 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 	//----------Initialize the Request Object----------//
 	new_request->accepted = 0;
 	new_request->conn_cv  = COND_INIT;
+	lock_profile_name(&new_request->conn_cv.waitset_lock, "RQS.conn_cv");
 	new_request->socket   = socket;
 	rlnode_init( &(new_request->node), new_request );
 	//----------Initialize the Request Object----------//
@@ -526,11 +542,11 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 	//Push back the request to the lintener.
 	rlist_push_back( &(port_table[port]->sock_type_obj.lis_sock.queue), &(new_request->node) );
 
-	//Wake up the listener to handle the request.
-	kernel_broadcast( &(port_table[port]->sock_type_obj.lis_sock.req) );
+	//Wake up the listener to handle the request, it runs when we wait below.
+	kernel_signal_yield( &(port_table[port]->sock_type_obj.lis_sock.req) );
 
 	//Wait until you wake up or the time expires.
-	kernel_timedwait( &(new_request->conn_cv), SCHED_USER, timeout);
+	kernel_timedwait( &port_lock, &(new_request->conn_cv), SCHED_PIPE, timeout);
 
 	//If the request was accepted.
 	if (new_request->accepted)
@@ -582,7 +598,10 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 		socket->sock_type_obj.peer_sock.canWrite = 0;
 		
 		//Make sure that the reader on the other socket will read until EOF.
-		socket->sock_type_obj.peer_sock.pipe_send->pip_t.write = -1;
+		PIPCB *pipe = socket->sock_type_obj.peer_sock.pipe_send;
+		kernel_lock( &(pipe->lock) );
+		pipe->pip_t.write = -1;
+		kernel_unlock( &(pipe->lock) );
 	}
 	
 	return 0;
@@ -20,7 +20,7 @@
 
 	The streams of each process are held in the file table of the
 	PCB of the process. The system calls generally use the API
-	of this file to access FCBs: @ref get_fcb, @ref FCB_reserve
+	of this file to access FCBs: @ref get_fcb, @ref get_fcb_ref, @ref FCB_reserve
 	and @ref FCB_unreserve.
 
 	Streams are connected to devices by virtue of a @c file_operations
@@ -40,7 +40,7 @@
  */
 typedef struct file_control_block
 {
-  uint refcount;  			/**< @brief Reference counter. */
+  uint refcount;  			/**< @brief Reference counter, updated atomically. */
   void* streamobj;			/**< @brief The stream object (e.g., a device) */
   file_ops* streamfunc;		/**< @brief The stream implementation methods */
   rlnode freelist_node;		/**< @brief Intrusive list node */
@@ -122,12 +122,28 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 
 	This routine will return NULL if the fid is not legal.
 
+	No reference is taken, so the FCB may be closed by another thread 
+	of the process at any time. Use @ref get_fcb_ref if the stream is 
+	going to be used without a kernel lock that excludes closing it.
+
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
  */
 FCB* get_fcb(Fid_t fid);
 
 
+/** @brief Translate an fid to an FCB and take a reference to it.
+
+	The lookup is done under the FIDT lock of the current process, 
+	so the FCB cannot be released before the caller is done with it.
+	The caller must drop the reference with @ref FCB_decref.
+
+	@param fid the file ID to translate to a pointer to FCB
+	@returns a pointer to the corresponding FCB, or NULL.
+ */
+FCB* get_fcb_ref(Fid_t fid);
+
+
 /** @} */
 
 #endif
@@ -11,34 +11,44 @@
 	Define all the syscalls 
  */
 
+/* The kernel lock of each call (see SYSCALLS in kernel_sys.h) */
+#define LOCK_PROC kernel_lock(&proc_lock);
+#define UNLOCK_PROC kernel_unlock(&proc_lock);
+#define LOCK_PROC_SHARED kernel_lock_shared(&proc_lock);
+#define UNLOCK_PROC_SHARED kernel_unlock_shared(&proc_lock);
+#define LOCK_PORT kernel_lock(&port_lock);
+#define UNLOCK_PORT kernel_unlock(&port_lock);
+#define LOCK_NONE
+#define UNLOCK_NONE
 
-#define PRE_CALL \
-kernel_lock();\
 
+#define PRE_CALL(LOCK) \
+LOCK_##LOCK\
 
 
-#define POST_CALL \
-kernel_unlock();\
+
+#define POST_CALL(LOCK) \
+UNLOCK_##LOCK\
 
 
 /* with return */
-#define SYSCALL(NAME, RET, SIG, ARGS)\
+#define SYSCALL(NAME, RET, SIG, ARGS, LOCK)\
 RET NAME SIG \
 {\
 	RET __ret;\
-	PRE_CALL\
+	PRE_CALL(LOCK)\
 	__ret = sys_##NAME ARGS;\
-	POST_CALL\
+	POST_CALL(LOCK)\
 	return __ret;\
 }\
 
 /* without return */
-#define SYSCALLV(NAME, SIG, ARGS)\
+#define SYSCALLV(NAME, SIG, ARGS, LOCK)\
 void NAME SIG \
 {\
-	PRE_CALL\
+	PRE_CALL(LOCK)\
 	sys_##NAME ARGS;\
-	POST_CALL\
+	POST_CALL(LOCK)\
 }\
 
 
@@ -4,39 +4,57 @@
 #include "bios.h"
 #include "tinyos.h"
 
+/*
+	The system calls. The last column is the kernel lock that the call
+	wrapper holds for the call (see kernel_sys.c):
+	- PROC: the process table, with the threads of the processes (proc_lock)
+	- PROC_SHARED: proc_lock in shared mode, for calls that only read it
+	- PORT: the port table of sockets (port_lock)
+	- NONE: no lock; the call takes the locks of the objects it touches
+ */
 #define SYSCALLS \
-SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
-SYSCALLV(Exit, (int exitval), (exitval))\
-SYSCALL(GetPid, int, (void), ())\
-SYSCALL(GetPPid, int, (void), ())\
-SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
-SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
-SYSCALL(ThreadSelf, Tid_t, (void), ())\
-SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
-SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
-SYSCALLV(ThreadExit, (int exitval), (exitval))\
-SYSCALL(GetTerminalDevices, unsigned int, (), ())\
-SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
-SYSCALL(OpenNull, Fid_t, (), ())\
-SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
-SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
-SYSCALL(Close,int,(Fid_t fd),(fd))\
-SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
-SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
-SYSCALL(Socket, Fid_t, (port_t port), (port))\
-SYSCALL(Listen, int, (Fid_t sock), (sock))\
-SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
-SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
-SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
-SYSCALL(OpenInfo, Fid_t, (), ())\
-
-
-
-#define SYSCALL(NAME, RET, SIG, ARGS)\
+SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args), PROC)\
+SYSCALLV(Exit, (int exitval), (exitval), PROC)\
+SYSCALL(GetPid, int, (void), (), NONE)\
+SYSCALL(GetPPid, int, (void), (), PROC_SHARED)\
+SYSCALL(SetNice, int, (Pid_t pid, int nice), (pid, nice), PROC)\
+SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval), PROC)\
+SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args), PROC)\
+SYSCALL(CreateThreadStack, Tid_t, (Task task, int argl, void* args, unsigned int stack_size), (task, argl, args, stack_size), PROC)\
+SYSCALL(ThreadSelf, Tid_t, (void), (), NONE)\
+SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval), PROC)\
+SYSCALL(ThreadDetach, int, (Tid_t tid), (tid), PROC)\
+SYSCALLV(ThreadExit, (int exitval), (exitval), PROC)\
+SYSCALL(SetThreadAffinity, int, (Tid_t tid, core_mask_t mask), (tid, mask), PROC)\
+SYSCALL(SetDeadline, int, (unsigned int runtime, unsigned int period, unsigned int deadline), (runtime, period, deadline), NONE)\
+SYSCALL(GetDeadlineInfo, int, (deadline_info* info), (info), NONE)\
+SYSCALL(GetTerminalDevices, unsigned int, (), (), NONE)\
+SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno), NONE)\
+SYSCALL(OpenNull, Fid_t, (), (), NONE)\
+SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size), NONE)\
+SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size), NONE)\
+SYSCALL(Close,int,(Fid_t fd),(fd), NONE)\
+SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd), NONE)\
+SYSCALL(Pipe, int, (pipe_t* pipe), (pipe), NONE)\
+SYSCALL(Socket, Fid_t, (port_t port), (port), NONE)\
+SYSCALL(Listen, int, (Fid_t sock), (sock), PORT)\
+SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock), PORT)\
+SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout), PORT)\
+SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how), PORT)\
+SYSCALL(FutexWait, int, (volatile uint32_t* addr, uint32_t val), (addr, val), NONE)\
+SYSCALL(FutexWake, int, (volatile uint32_t* addr, unsigned int n), (addr, n), NONE)\
+SYSCALL(OpenInfo, Fid_t, (), (), NONE)\
+SYSCALL(OpenThreadInfo, Fid_t, (), (), PROC_SHARED)\
+SYSCALL(GetCoreTimes, unsigned int, (unsigned long* busy, unsigned long* idle, unsigned int n), (busy, idle, n), NONE)\
+SYSCALL(OpenSchedStats, Fid_t, (), (), NONE)\
+
+
+
+#define SYSCALL(NAME, RET, SIG, ARGS, LOCK)\
 RET sys_ ## NAME SIG;
 
 /* without return */
-#define SYSCALLV(NAME, SIG, ARGS)\
+#define SYSCALLV(NAME, SIG, ARGS, LOCK)\
 void sys_ ## NAME SIG;
 
 SYSCALLS
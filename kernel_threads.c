@@ -9,9 +9,21 @@
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
 {
+  return sys_CreateThreadStack(task, argl, args, 0);
+}
+
+/** 
+  @brief Create a new thread in the current process, with the given stack size.
+  */
+Tid_t sys_CreateThreadStack(Task task, int argl, void* args, unsigned int stack_size)
+{
+
+  //The stack size is too large.
+  if (stack_size > THREAD_STACK_MAX)
+    return NOTHREAD;
 
   //Spawn a new thread.
-  TCB *new_thread = spawn_thread(CURPROC, start_another_thread);
+  TCB *new_thread = spawn_thread(CURPROC, start_another_thread, stack_size);
 
   //Store the main task and args into the ptcb of this thread.
   new_thread->tcb_ptcb->task = task;
@@ -22,7 +34,7 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
   CURPROC->num_of_threads++;
 
   //Append the ptcb of this new thread into the process list.
-  rlist_append( &(CURPROC->ptcb_head), &(new_thread->tcb_ptcb->ptcb_node) );
+  rlist_push_back( &(CURPROC->ptcb_head), &(new_thread->tcb_ptcb->ptcb_node) );
 
   //Wake up this thread.
   wakeup(new_thread);
@@ -39,6 +51,51 @@ Tid_t sys_ThreadSelf()
 	return (Tid_t) CURTHREAD;
 }
 
+/**
+  @brief Set the cores where a thread of the current process may run.
+  */
+int sys_SetThreadAffinity(Tid_t tid, core_mask_t mask)
+{
+  TCB* tcb = CURTHREAD;
+
+  //Like ThreadJoin, the tid must be a thread of the current process.
+  if (tid != NOTHREAD && tid != (Tid_t)tcb && tid != (Tid_t)tcb->tcb_ptcb)
+  {
+    PTCB *ptcb = (PTCB *)tid;
+    if (ptcb->pcb != CURPROC || ptcb->exited_flag)
+      return -1;
+    tcb = ptcb->tcb;
+  }
+
+  return sched_set_affinity(tcb, mask);
+}
+
+/**
+  @brief Make the current thread a deadline thread (or a normal one).
+  */
+int sys_SetDeadline(unsigned int runtime, unsigned int period, unsigned int deadline)
+{
+  //Preemption must be off, the scheduler reads the deadline fields of the thread.
+  int pre = preempt_off;
+  int ret = edf_admit(CURTHREAD, runtime, period, deadline);
+  if(pre) preempt_on;
+  return ret;
+}
+
+/**
+  @brief Return the deadline statistics of the current thread.
+  */
+int sys_GetDeadlineInfo(deadline_info* info)
+{
+  TCB* tcb = CURTHREAD;
+  if(tcb->edf_jobs == 0) return -1;
+
+  info->jobs = tcb->edf_jobs;
+  info->misses = tcb->edf_misses;
+  info->core = tcb->edf_core;
+  return 0;
+}
+
 /**
   @brief Join the given thread.
   */
@@ -48,15 +105,16 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
   //Get the ptcb from the tid.
   PTCB *ptcb = (PTCB *)tid;
 
-  //Join works when: tid is pointing to a thread which is not detached and not exited.
+  //Join works when: tid is pointing to a thread which is not detached.
   //                 but also when the tid is pointing to a threand which belongs to the current thread!!!!
-  if ( !ptcb->is_detached && !ptcb->exited_flag && ptcb->pcb == CURPROC)
+  //                 If the thread has already exited, we just collect its exit value.
+  if ( !ptcb->is_detached && ptcb->pcb == CURPROC)
   {
       //Increase the reference counter.
       ptcb->ref_cnt++;
 
       while(ptcb->exited_flag == 0)
-        kernel_wait( &(ptcb->joinVar) , SCHED_USER);
+        kernel_wait( &proc_lock, &(ptcb->joinVar) , SCHED_USER);
 
       //Reduce the reference counter.
       ptcb->ref_cnt--;
@@ -71,7 +129,7 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
       if (ptcb->ref_cnt <= 0)
       {
         rlist_remove( &(ptcb->ptcb_node) );
-        free(ptcb);
+        release_PTCB(ptcb);
       }
 
       //Return successfully.
@@ -121,7 +179,8 @@ int sys_ThreadDetach(Tid_t tid)
 void sys_ThreadExit(int exitval)
 {
   
-  //Set the exited flag to true.
+  //Set the exit value and the exited flag.
+  CURTHREAD->tcb_ptcb->exit_value  = exitval;
   CURTHREAD->tcb_ptcb->exited_flag = 1;
 
   //Wake up all the threads that are sleeping in this thread's condVar.
@@ -149,12 +208,12 @@ void sys_ThreadExit(int exitval)
       //Pop front.
       temp = rlist_pop_front( &(CURPROC->ptcb_head) );
 
-      //Free current PTCB.
-      free(temp->ptcb);
+      //Release current PTCB.
+      release_PTCB(temp->ptcb);
     }
 
   }
 
   //Stop the Thread.
-  kernel_sleep(EXITED, SCHED_USER);
+  kernel_sleep(&proc_lock, EXITED, SCHED_USER);
 }
\ No newline at end of file
@@ -266,6 +266,72 @@ TEST_SUITE(rlist_tests,
 
 
 
+
+/* Return the black height of a subtree, or -1 if it is not a valid red-black tree */
+static int rb_check(rbnode* n)
+{
+	if(n==NULL) return 0;
+	if(n->left && (n->left->parent!=n || n->left->key > n->key)) return -1;
+	if(n->right && (n->right->parent!=n || n->right->key < n->key)) return -1;
+	if(n->red && ((n->left && n->left->red) || (n->right && n->right->red))) return -1;
+	int hl = rb_check(n->left), hr = rb_check(n->right);
+	if(hl<0 || hl!=hr) return -1;
+	return hl + (n->red ? 0 : 1);
+}
+
+/* Check that the tree is valid and that it is traversed in (key, insertion) order */
+static int rb_ordered(rbtree* T)
+{
+	if(rb_check(T->root)<0 || (T->root && T->root->red)) return 0;
+	size_t count = 0;
+	rbnode* prev = NULL;
+	for(rbnode* n = rbtree_first(T); n!=NULL; n = rbtree_next(n)) {
+		if(prev && (prev->key > n->key || (prev->key==n->key && prev->unum > n->unum))) 
+			return 0;
+		prev = n;
+		count++;
+	}
+	return count == T->size;
+}
+
+BARE_TEST(test_rbtree,
+	"Test the ordered tree, with random insertions and removals"
+	)
+{
+	enum { N = 2000 };
+	static rbnode nodes[N];
+	rbtree T;
+	rbtree_init(&T);
+	ASSERT(is_rbtree_empty(&T) && rbtree_first(&T)==NULL);
+
+	/* Few distinct keys, so that there are many ties. The object is the insertion order. */
+	srand(1);
+	for(int i=0;i<N;i++) {
+		rbnode_init(&nodes[i], NULL)->unum = i;
+		nodes[i].key = rand() % 100;
+		rbtree_insert(&T, &nodes[i]);
+	}
+	ASSERT(T.size == N);
+	ASSERT(rb_ordered(&T));
+
+	/* Remove every third node */
+	for(int i=0;i<N;i+=3)
+		rbtree_remove(&T, &nodes[i]);
+	ASSERT(rb_ordered(&T));
+
+	/* Pop in order */
+	uint64_t last = 0;
+	while(! is_rbtree_empty(&T)) {
+		rbnode* n = rbtree_first(&T);
+		ASSERT(n->key >= last);
+		last = n->key;
+		rbtree_remove(&T, n);
+	}
+	ASSERT(T.size==0 && rbtree_first(&T)==NULL);
+}
+
+
+
 void test_argv(size_t argc, const char* argv[])
 {
 	int l = argvlen(argc, argv);
@@ -548,6 +614,7 @@ TEST_SUITE(all_tests,
 	"All tests")
 {
 	&rlist_tests,
+	&test_rbtree,
 	&test_pack_unpack,
 	&exception_tests,	
 	NULL
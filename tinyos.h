@@ -74,9 +74,13 @@ typedef uintptr_t Tid_t;
 
     @see Mutex_Lock
     @see Mutex_Unlock
+    A mutex is a ticket lock, packed in a word with a count of the threads 
+    that sleep on it: waiters in the non-preemptive domain are served in 
+    FIFO order, and contended waiters in the preemptive domain sleep.
+
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef uint64_t Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -92,8 +96,11 @@ typedef char Mutex;
 /** @brief Lock a mutex.
 
   Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
-  In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
+  in kernel-space (preemptive domain), the locking will sleep after spinning for a few hundred times,
+  until the mutex is unlocked (see @c FutexWait). An uncontended lock or unlock does not enter
+  the kernel.
+  In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock,
+  which grants the lock to the waiting cores in the order they asked for it.
 
   @see Mutex
   @see Mutex_Unlock
@@ -199,7 +206,174 @@ void Cond_Signal(CondVar*);
   @see Cond_Wait
   @see Cond_Signal
 */
-void Cond_Broadcast(CondVar*); 
+void Cond_Broadcast(CondVar*);
+
+/**
+  @brief Signal a condition variable and switch to the signalled thread.
+
+  This is like @c Cond_Signal, but the thread that is woken up runs 
+  next on the current core, and the calling thread yields to it. The 
+  calling thread remains ready to run.
+
+  This is meant for pairs of threads that take turns, e.g., a producer and
+  a consumer. The caller should unlock the mutex of the condition first,
+  else the signalled thread will just block on it.
+
+  @see Cond_Signal
+  */
+void Cond_SignalYield(CondVar*); 
+
+
+/** @brief A reader-writer lock.
+
+  A reader-writer lock can be held by many readers at once, or by a 
+  single writer. Writers have preference: while a writer waits for the
+  lock, no new reader gets it. Like a mutex, the lock spins in the 
+  non-preemptive domain, and sleeps when it is contended in the preemptive
+  domain.
+
+  @see RwLock_ReadLock
+  @see RwLock_WriteLock
+  @see RwLock_Unlock
+  @see RWLOCK_INIT
+ */
+typedef struct {
+  uint32_t state;       /**< The number of readers, or @c RWLOCK_WRITER */
+  uint32_t writers;     /**< Writers waiting for the lock */
+  uint32_t releases;    /**< Counts the times the lock became free, waiters sleep on it */
+  uint32_t sleepers;    /**< Threads asleep on @c releases */
+} RwLock;
+
+/** @brief The value of @c RwLock.state when a writer holds the lock. */
+#define RWLOCK_WRITER 0x80000000u
+
+/** @brief This macro is used to initialize reader-writer locks. 
+
+   It is used as follows:
+   @code
+   RwLock my_lock = RWLOCK_INIT;
+   @endcode
+ */
+#define RWLOCK_INIT ((RwLock){ 0, 0, 0, 0 })
+
+/** @brief Lock a reader-writer lock for reading.
+
+  Wait while a writer holds the lock, or waits for it.
+  @see RwLock_Unlock
+ */
+void RwLock_ReadLock(RwLock*);
+
+/** @brief Lock a reader-writer lock for writing.
+
+  Wait until no reader or writer holds the lock.
+  @see RwLock_Unlock
+ */
+void RwLock_WriteLock(RwLock*);
+
+/** @brief Unlock a reader-writer lock that you locked, for reading or writing.
+  @see RwLock_ReadLock
+  @see RwLock_WriteLock
+ */
+void RwLock_Unlock(RwLock*);
+
+
+/** @brief A counting semaphore.
+
+  A thread that waits on a semaphore decrements its count, waiting while
+  the count is zero. A post increments the count. When nobody waits, each 
+  of these is a single atomic operation. Like a mutex, the semaphore spins
+  in the non-preemptive domain, and sleeps when it is contended in the 
+  preemptive domain. Unlike a mutex, a semaphore may be posted by a thread
+  other than the one that waited on it.
+
+  @see Semaphore_Wait
+  @see Semaphore_Post
+  @see SEMAPHORE_INIT
+ */
+typedef struct {
+  uint32_t count;       /**< The value of the semaphore, waiters sleep on it */
+  uint32_t sleepers;    /**< Threads asleep on @c count */
+} Semaphore;
+
+/** @brief This macro is used to initialize semaphores. 
+
+   It is used as follows:
+   @code
+   Semaphore slots = SEMAPHORE_INIT(10);
+   @endcode
+ */
+#define SEMAPHORE_INIT(n) ((Semaphore){ (n), 0 })
+
+/** @brief Decrement a semaphore, waiting while its count is zero.
+  @see Semaphore_Post
+ */
+void Semaphore_Wait(Semaphore*);
+
+/** @brief Increment a semaphore, waking up a waiter if there is one.
+  @see Semaphore_Wait
+ */
+void Semaphore_Post(Semaphore*);
+
+
+/** @brief A barrier.
+
+  A barrier makes a fixed number of threads wait for each other. Each
+  thread calls @c Barrier_Wait, and no thread returns from it until all
+  of them have called it. The barrier can then be used again.
+
+  @see Barrier_Wait
+  @see BARRIER_INIT
+ */
+typedef struct {
+  uint32_t parties;     /**< The number of threads that meet at the barrier */
+  uint32_t arrived;     /**< The threads that wait in the current round */
+  uint32_t round;       /**< Counts the rounds, waiters sleep on it */
+  uint32_t sleepers;    /**< Threads asleep on @c round */
+} Barrier;
+
+/** @brief This macro is used to initialize barriers for @c n threads. 
+
+   It is used as follows:
+   @code
+   Barrier bar = BARRIER_INIT(4);
+   @endcode
+ */
+#define BARRIER_INIT(n) ((Barrier){ (n), 0, 0, 0 })
+
+/** @brief Wait at a barrier, until all its threads have arrived.
+
+  @returns 1 to the last thread to arrive, and 0 to the rest
+ */
+int Barrier_Wait(Barrier*);
+
+
+/**
+  @brief Sleep on a word, if it has a given value.
+
+  This is the building block for synchronization in user space. If 
+  @c *addr is equal to @c val, the calling thread sleeps until another 
+  thread calls @c FutexWake on @c addr. The check and the sleep are atomic,
+  so a thread that changes the word and then calls @c FutexWake cannot 
+  miss a thread that saw the old value. The sleepers are kept by the 
+  kernel in a table keyed by the address of the word.
+
+  @param addr the address of the word
+  @param val the value the caller expects to find in the word
+  @returns 0 if the thread was woken by @c FutexWake, or -1 if the word
+     did not have the value @c val
+  @see FutexWake
+  */
+int FutexWait(volatile uint32_t* addr, uint32_t val);
+
+/**
+  @brief Wake up the threads sleeping on a word.
+
+  @param addr the address of the word
+  @param n the most threads to wake up
+  @returns the number of threads woken up
+  @see FutexWait
+  */
+int FutexWake(volatile uint32_t* addr, unsigned int n);
 
 
 /*******************************************
@@ -291,6 +465,31 @@ Pid_t GetPid(void);
  */
 Pid_t GetPPid(void);
 
+
+/** @brief The smallest (most favoured) nice value */
+#define NICE_MIN (-20)
+
+/** @brief The largest (least favoured) nice value */
+#define NICE_MAX 19
+
+/** @brief Set the nice value of a process.
+
+  The nice value sets the weight of a process, when the fair-share
+  scheduling policy is used: each process gets a share of the cpu that
+  is proportional to its weight, no matter how many threads it has, and
+  then this share is divided among its threads. A process of nice 0 has 
+  weight 1024, and each nice level is worth about 25% of cpu against a 
+  process one level higher. Child processes inherit the nice value of 
+  their parent. The other scheduling policies ignore the nice value.
+
+  @param pid the process, or @c NOPROC for the current process.
+  @param nice the new nice value, between @c NICE_MIN and @c NICE_MAX.
+  @returns 0 on success, or -1 on error. Possible errors are:
+   - there is no process with the given pid.
+   - the nice value is out of range.
+  */
+int SetNice(Pid_t pid, int nice);
+
 /*******************************************
  *
  * Threads
@@ -319,6 +518,25 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/** 
+  @brief Create a new thread in the current process, with a given stack size.
+
+  This is like `CreateThread`, but the new thread gets a stack of 
+  `stack_size` bytes, instead of the default size. The size is rounded up
+  to whole pages, and small sizes are raised to a minimum size. 
+  If `stack_size` is 0, the default size is used.
+
+  Stack pages only take up memory once they are used. Therefore, many 
+  threads that only block most of the time can be created with small 
+  stacks, while a thread that needs a deep stack can get a large one.
+
+  @param task a function to execute
+  @param stack_size the size of the stack of the new thread in bytes
+  @returns the Tid of the new thread, or NOTHREAD if the stack size 
+     is too large.
+  */
+Tid_t CreateThreadStack(Task task, int argl, void* args, unsigned int stack_size);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -375,6 +593,88 @@ int ThreadDetach(Tid_t tid);
 void ThreadExit(int exitval);
 
 
+/**
+  @brief A set of cores. Bit @c c of the mask is core @c c.
+  */
+typedef uint32_t core_mask_t;
+
+/** @brief The mask of all cores */
+#define CORE_MASK_ALL ((core_mask_t)-1)
+
+/**
+  @brief Set the cores on which a thread may run.
+
+  The thread will only be scheduled on the cores of @c mask. Bits for
+  cores that do not exist are ignored. New threads may run on any core.
+
+  The scheduler also prefers to run a thread on the core where it last
+  ran, and does not move a thread that ran recently to another core, unless
+  that core has nothing else to run.
+
+  The change takes effect at the next scheduling decision for the thread.
+  The current thread moves at once, if its core is not in @c mask.
+
+  @param tid the thread, or @c NOTHREAD for the current thread
+  @param mask the set of allowed cores
+  @returns 0 on success, or -1 on error. Possible errors are:
+    - there is no live thread with the given tid in this process.
+    - the mask contains no existing core.
+    - the thread is a deadline thread (see @c SetDeadline), and its core
+      is not in the mask.
+  */
+int SetThreadAffinity(Tid_t tid, core_mask_t mask);
+
+
+/**
+  @brief Make the current thread a deadline thread.
+
+  A deadline thread runs periodically: in each period of @c period usec, it
+  may run for @c runtime usec, and this work should finish within 
+  @c deadline usec from the start of the period. Deadline threads run ahead
+  of all other threads, earliest deadline first, as long as they stay 
+  within their runtime. A thread that runs longer in a period is scheduled 
+  like a normal thread, until the next period.
+
+  A period starts when the thread wakes up, or at the end of the previous
+  period if the thread wakes up earlier; the first one starts with this 
+  call. A typical deadline thread does its work and then sleeps until the
+  next period.
+
+  The thread is admitted to a core only if the total utilization 
+  (runtime/period) of the deadline threads of that core stays below 90%.
+  Only the cores of the thread's affinity (see @c SetThreadAffinity) are
+  considered.
+
+  @param runtime the budget of each period, in usec
+  @param period the period, in usec, or 0 to make the thread a normal thread again
+  @param deadline the deadline of the work of each period, relative to its start, in usec
+  @returns 0 on success, or -1 on error. Possible errors are:
+    - it is not true that 0 < runtime <= deadline <= period
+    - no core can admit the thread
+  */
+int SetDeadline(unsigned int runtime, unsigned int period, unsigned int deadline);
+
+
+/** @brief Statistics of a deadline thread. */
+typedef struct deadline_info {
+  unsigned long jobs;    /**< @brief The number of periods in which the thread ran */
+  unsigned long misses;  /**< @brief The number of periods in which the thread finished its 
+                              work (that is, blocked) after the deadline */
+  unsigned int core;     /**< @brief The core of the thread */
+} deadline_info;
+
+/**
+  @brief Get the statistics of the current thread, as a deadline thread.
+
+  The statistics are kept while the thread is a deadline thread, and they 
+  are not reset by @c SetDeadline.
+
+  @returns 0 on success, or -1 if the current thread has never been a
+    deadline thread.
+  */
+int GetDeadlineInfo(deadline_info* info);
+
+
 
 /*******************************************
  *
@@ -736,6 +1036,17 @@ typedef struct procinfo
 
     If the task's argument is longer (as designated by the @c argl field), the
     bytes contained in this field are just the prefix.  */
+
+  int prio;        /**< @brief The scheduler priority of the main thread, 
+                    or -1 if the main thread has exited. */
+  int nice;        /**< @brief The nice value of the process (see @c SetNice). */
+  unsigned long run_time;   /**< @brief Time all threads spent running, in usec. */
+  unsigned long wait_time;  /**< @brief Time all threads spent ready to run
+                    but waiting for a core, in usec. */
+  unsigned long vol_switches;   /**< @brief Context switches where a thread
+                    blocked or exited. */
+  unsigned long invol_switches; /**< @brief Context switches where a thread
+                    was preempted. */
 } procinfo;
 
 
@@ -760,6 +1071,86 @@ typedef struct procinfo
 Fid_t OpenInfo();
 
 
+/**
+	@brief A struct containing the accounting of a thread.
+
+	This structure is returned by thread information streams.
+	@see OpenThreadInfo
+  */
+typedef struct threadinfo
+{
+	Pid_t pid;      /**< @brief The pid of the process of the thread. */
+	Tid_t tid;      /**< @brief The id of the thread, as returned by 
+                    @c CreateThread. */
+	int is_main;    /**< @brief Non-zero for the main thread of the process. */
+	int exited;     /**< @brief Non-zero if the thread has exited, and
+                    has not been joined yet. */
+	int prio;       /**< @brief The scheduler priority of the thread. */
+	unsigned int last_core; /**< @brief The core where the thread last ran. */
+
+	unsigned long run_time;   /**< @brief Time spent running, in usec. */
+	unsigned long wait_time;  /**< @brief Time spent ready to run but 
+                    waiting for a core, in usec. */
+	unsigned long vol_switches;   /**< @brief Context switches where the
+                    thread blocked or exited. */
+	unsigned long invol_switches; /**< @brief Context switches where the
+                    thread was preempted. */
+} threadinfo;
+
+
+/**
+	@brief Open a thread information stream.
+
+	This is a read-only stream that returns a sequence of 
+	@c threadinfo structures, each packed into a block of size 
+	@c sizeof(threadinfo), one for every thread of every process. 
+	The threads of a process follow in the order of their creation, 
+	and the processes in the order of their pids.
+
+	The stream returns a snapshot of the threads, as of the time of 
+	the call.
+
+	@returns a file id on success, or NOFILE on error. Possible reasons
+		for error are:
+		- the available file ids for the process are exhausted.
+	@see threadinfo
+ */
+Fid_t OpenThreadInfo();
+
+
+/**
+	@brief Return the time that each core spent busy and idle.
+
+	For each core @c c less than @c n, @c busy[c] is set to the time the
+	core spent running threads, and @c idle[c] to the time it was idle,
+	in usec. Either array may be NULL.
+
+	@returns the number of cores
+ */
+unsigned int GetCoreTimes(unsigned long* busy, unsigned long* idle, unsigned int n);
+
+
+/**
+	@brief Open a scheduler statistics stream.
+
+	This is a read-only stream that returns a text report of the 
+	scheduler histograms, as of the time of the call:
+	- the time threads waited ready before they ran, in log2 buckets of usec,
+	  for each core and for each cause of the thread's last yield
+	- the length of the run queue at each scheduling decision, for each core
+	- the polling window of each idle core, and how often polling found work
+	- which cores are parked, and how often each core was parked.
+
+	The same report is printed to @c stderr when the VM shuts down, if the
+	environment variable @c TINYOS_SCHEDSTATS is set.
+
+	@returns a file id on success, or NOFILE on error. Possible reasons
+		for error are:
+		- the available file ids for the process are exhausted.
+ */
+Fid_t OpenSchedStats();
+
+
 
 
 /*******************************************
@@ -781,6 +1172,19 @@ Fid_t OpenInfo();
 void boot(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args);
 
 
+/** @brief Choose the scheduling policy for the next call to @c boot().
+
+   The available policies are @c "mlfq" (multilevel feedback queue, the default), 
+   @c "rr" (round-robin), @c "decay" (decay-usage) and @c "fair" (fair-share 
+   among processes, see @c SetNice). When no policy is chosen,
+   the environment variable @c TINYOS_SCHED is consulted.
+
+   @param name the name of the policy, or NULL to restore the default.
+   @returns 0 on success, or -1 if there is no policy with this name.
+   */
+int set_scheduler_policy(const char* name);
+
+
 /** @} */
 
 #endif
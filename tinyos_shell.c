@@ -21,6 +21,7 @@ int Repeat(size_t,const char**);
 int Hanoi(size_t,const char**);
 int HelpMessage(size_t,const char**);
 int SystemInfo(size_t,const char**);
+int SchedStats(size_t,const char**);
 int Capitalize(size_t,const char**);
 int LowerCase(size_t,const char**);
 int LineEnum(size_t,const char**);
@@ -39,6 +40,7 @@ COMMANDS[]  =
 	{"help", HelpMessage, 0, "A help message."},
 	{"ls", ListPrograms, 0, "List available programs programs."},
 	{"sysinfo", SystemInfo, 0, "Print some basic info about the current system."},
+	{"schedstat", SchedStats, 0, "Print the wakeup latency and run queue histograms of the scheduler."},
 	{"runterm", RunTerm, 2, "runterm <term> <prog>  <args...> : execute '<prog> <args...>' on terminal <term>."},
 	{"sh", Shell, 0, "Run a shell."},
 	{"repeat", Repeat, 2, "repeat <n> <prog> <args...>: execute '<prog> <args...>' <n> times."},
@@ -172,8 +174,8 @@ int SystemInfo(size_t argc, const char** argv)
 	if(finfo!=NOFILE) {
 		/* Print per-process info */
 		procinfo info;
-		printf("%5s %5s %6s %8s %20s\n",
-			"PID", "PPID", "State", "Threads", "Main program"
+		printf("%5s %5s %6s %8s %5s %5s %10s %10s %9s %20s\n",
+			"PID", "PPID", "State", "Threads", "Prio", "Nice", "CPU(ms)", "Wait(ms)", "Switches", "Main program"
 			);
 		/* Read in next piece of info */		
 		while(Read(finfo, (char*) &info, sizeof(info)) > 0) {
@@ -189,16 +191,68 @@ int SystemInfo(size_t argc, const char** argv)
 				if(info.pid==1) pname = "init";
 			}
 
-			printf("%5d %5d %6s %8u %20s\n",
+			printf("%5d %5d %6s %8lu %5d %5d %10.1f %10.1f %9lu %20s\n",
 				info.pid,
 				info.ppid,
 				(info.alive?"ALIVE":"ZOMBIE"),
 				info.thread_count,
+				info.prio,
+				info.nice,
+				info.run_time/1000.0,
+				info.wait_time/1000.0,
+				info.vol_switches+info.invol_switches,
 				pname
 				);
 		}
+		Close(finfo);
 	}
+
+	Fid_t fthreads = OpenThreadInfo();
+	if(fthreads!=NOFILE) {
+		/* Print per-thread info */
+		threadinfo info;
+		printf("\n%5s %18s %5s %5s %4s %10s %10s %9s %9s\n",
+			"PID", "TID", "Main", "Prio", "Core", "CPU(ms)", "Wait(ms)", "Vol", "Invol"
+			);
+		while(Read(fthreads, (char*) &info, sizeof(info)) > 0) {
+			printf("%5d %18p %5s %5d %4u %10.1f %10.1f %9lu %9lu%s\n",
+				info.pid,
+				(void*) info.tid,
+				(info.is_main?"yes":"no"),
+				info.prio,
+				info.last_core,
+				info.run_time/1000.0,
+				info.wait_time/1000.0,
+				info.vol_switches,
+				info.invol_switches,
+				(info.exited?" (exited)":"")
+				);
+		}
+		Close(fthreads);
+	}
+
+	/* Per-core info */
+	unsigned long busy[MAX_CORES], idle[MAX_CORES];
+	unsigned int ncores = GetCoreTimes(busy, idle, MAX_CORES);
 	printf("\n");
+	for(unsigned int c=0; c<ncores && c<MAX_CORES; c++)
+		printf("Core %2u: busy %10.1f ms, idle %10.1f ms\n", 
+			c, busy[c]/1000.0, idle[c]/1000.0);
+	printf("\n");
+	return 0;
+}
+
+
+int SchedStats(size_t argc, const char** argv)
+{
+	Fid_t fstats = OpenSchedStats();
+	if(fstats==NOFILE) return 1;
+
+	char buf[256];
+	int n;
+	while((n = Read(fstats, buf, sizeof(buf))) > 0)
+		printf("%.*s", n, buf);
+	Close(fstats);
 	return 0;
 }
 
@@ -424,6 +478,7 @@ struct __rs_globals
 	/* used to log connection messages */
 	rlnode log;
 	size_t logcount;
+	RwLock logrw;
 	
 	/* Synchronize with active threads */
 	Mutex mx;
@@ -576,10 +631,10 @@ static void log_message(void* __globals, const char* msg, ...)
 
 	/* Append the record */
 	logrec *rec = (logrec*) buffer;
-	Mutex_Lock(& GS(mx));
+	RwLock_WriteLock(& GS(logrw));
 	rlnode_new(& rec->node)->num = ++GS(logcount);
 	rlist_push_back(& GS(log), & rec->node);
-	Mutex_Unlock(& GS(mx));
+	RwLock_Unlock(& GS(logrw));
 }
 
 /* init the log */
@@ -587,17 +642,18 @@ static void log_init(void* __globals)
 {
 	rlnode_init(& GS(log), NULL);
 	GS(logcount)=0;
+	GS(logrw) = RWLOCK_INIT;
 }
 
 /* Print the log to the console */
 static void log_print(void* __globals)
 {
-	Mutex_Lock(& GS(mx));
+	RwLock_ReadLock(& GS(logrw));
 	for(rlnode* ptr = GS(log).next; ptr != &GS(log); ptr=ptr->next) {
 		logrec *rec = (logrec*)ptr;
 		printf("%6d: %s\n", rec->node.num, rec->message);
 	}
-	Mutex_Unlock(& GS(mx));
+	RwLock_Unlock(& GS(logrw));
 }
 
 	
@@ -607,9 +663,9 @@ static void log_truncate(void* __globals)
 	rlnode list;
 	rlnode_init(&list, NULL);
 	
-	Mutex_Lock(& GS(mx));
+	RwLock_WriteLock(& GS(logrw));
 	rlist_append(& list, &GS(log));
-	Mutex_Unlock(& GS(mx));
+	RwLock_Unlock(& GS(logrw));
 
 	/* Free the memory ! */
 	while(list.next != &list) {
@@ -43,3 +43,227 @@ void exception_unwind(exception_context context, int errcode)
 		raise_exception(context);
 }
 
+
+
+
+/*
+	Red-black trees
+ */
+
+static void rb_rotate_left(rbtree* tree, rbnode* x)
+{
+	rbnode* y = x->right;
+	x->right = y->left;
+	if(y->left) y->left->parent = x;
+	y->parent = x->parent;
+	if(x->parent == NULL) tree->root = y;
+	else if(x == x->parent->left) x->parent->left = y;
+	else x->parent->right = y;
+	y->left = x;
+	x->parent = y;
+}
+
+static void rb_rotate_right(rbtree* tree, rbnode* x)
+{
+	rbnode* y = x->left;
+	x->left = y->right;
+	if(y->right) y->right->parent = x;
+	y->parent = x->parent;
+	if(x->parent == NULL) tree->root = y;
+	else if(x == x->parent->right) x->parent->right = y;
+	else x->parent->left = y;
+	y->right = x;
+	x->parent = y;
+}
+
+/* Put v in the place of u, as a child of u's parent */
+static void rb_transplant(rbtree* tree, rbnode* u, rbnode* v)
+{
+	if(u->parent == NULL) tree->root = v;
+	else if(u == u->parent->left) u->parent->left = v;
+	else u->parent->right = v;
+	if(v) v->parent = u->parent;
+}
+
+static inline int rb_is_red(rbnode* n) { return n != NULL && n->red; }
+
+
+rbnode* rbtree_next(rbnode* node)
+{
+	if(node->right) {
+		node = node->right;
+		while(node->left) node = node->left;
+		return node;
+	}
+	while(node->parent && node == node->parent->right)
+		node = node->parent;
+	return node->parent;
+}
+
+
+void rbtree_insert(rbtree* tree, rbnode* z)
+{
+	rbnode* y = NULL;
+	rbnode* x = tree->root;
+	int leftmost = 1;
+
+	while(x) {
+		y = x;
+		if(z->key < x->key) 
+			x = x->left;
+		else {
+			x = x->right;
+			leftmost = 0;
+		}
+	}
+
+	z->parent = y;
+	z->left = z->right = NULL;
+	z->red = 1;
+	if(y == NULL) tree->root = z;
+	else if(z->key < y->key) y->left = z;
+	else y->right = z;
+
+	if(leftmost) tree->first = z;
+	tree->size++;
+
+	/* Restore the red-black properties */
+	while(rb_is_red(z->parent)) {
+		rbnode* p = z->parent;
+		rbnode* g = p->parent;   /* p is red, so it is not the root */
+
+		if(p == g->left) {
+			rbnode* u = g->right;
+			if(rb_is_red(u)) {
+				p->red = u->red = 0;
+				g->red = 1;
+				z = g;
+			} else {
+				if(z == p->right) {
+					z = p;
+					rb_rotate_left(tree, z);
+					p = z->parent;
+				}
+				p->red = 0;
+				g->red = 1;
+				rb_rotate_right(tree, g);
+			}
+		} else {
+			rbnode* u = g->left;
+			if(rb_is_red(u)) {
+				p->red = u->red = 0;
+				g->red = 1;
+				z = g;
+			} else {
+				if(z == p->left) {
+					z = p;
+					rb_rotate_right(tree, z);
+					p = z->parent;
+				}
+				p->red = 0;
+				g->red = 1;
+				rb_rotate_left(tree, g);
+			}
+		}
+	}
+	tree->root->red = 0;
+}
+
+
+void rbtree_remove(rbtree* tree, rbnode* z)
+{
+	if(tree->first == z) tree->first = rbtree_next(z);
+	tree->size--;
+
+	rbnode* y = z;
+	rbnode* x;       /* The node that takes the place of y (maybe NULL) */
+	rbnode* xp;      /* The parent of x */
+	int y_red = y->red;
+
+	if(z->left == NULL) {
+		x = z->right;
+		xp = z->parent;
+		rb_transplant(tree, z, z->right);
+	} else if(z->right == NULL) {
+		x = z->left;
+		xp = z->parent;
+		rb_transplant(tree, z, z->left);
+	} else {
+		/* y is the successor of z, it takes the place of z */
+		y = z->right;
+		while(y->left) y = y->left;
+		y_red = y->red;
+		x = y->right;
+		if(y->parent == z) 
+			xp = y;
+		else {
+			xp = y->parent;
+			rb_transplant(tree, y, y->right);
+			y->right = z->right;
+			y->right->parent = y;
+		}
+		rb_transplant(tree, z, y);
+		y->left = z->left;
+		y->left->parent = y;
+		y->red = z->red;
+	}
+
+	z->parent = z->left = z->right = NULL;
+	if(y_red) return;
+
+	/* A black node was removed, restore the black height */
+	while(x != tree->root && !rb_is_red(x)) {
+		if(x == xp->left) {
+			rbnode* w = xp->right;
+			if(w->red) {
+				w->red = 0;
+				xp->red = 1;
+				rb_rotate_left(tree, xp);
+				w = xp->right;
+			}
+			if(!rb_is_red(w->left) && !rb_is_red(w->right)) {
+				w->red = 1;
+				x = xp;
+				xp = x->parent;
+			} else {
+				if(!rb_is_red(w->right)) {
+					w->left->red = 0;
+					w->red = 1;
+					rb_rotate_right(tree, w);
+					w = xp->right;
+				}
+				w->red = xp->red;
+				xp->red = 0;
+				w->right->red = 0;
+				rb_rotate_left(tree, xp);
+				x = tree->root;
+			}
+		} else {
+			rbnode* w = xp->left;
+			if(w->red) {
+				w->red = 0;
+				xp->red = 1;
+				rb_rotate_right(tree, xp);
+				w = xp->left;
+			}
+			if(!rb_is_red(w->right) && !rb_is_red(w->left)) {
+				w->red = 1;
+				x = xp;
+				xp = x->parent;
+			} else {
+				if(!rb_is_red(w->left)) {
+					w->right->red = 0;
+					w->red = 1;
+					rb_rotate_left(tree, w);
+					w = xp->left;
+				}
+				w->red = xp->red;
+				xp->red = 0;
+				w->left->red = 0;
+				rb_rotate_right(tree, xp);
+				x = tree->root;
+			}
+		}
+	}
+	if(x) x->red = 0;
+}
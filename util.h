@@ -580,6 +580,109 @@ static inline void rlist_select(rlnode* Lsrc, rlnode* Ldest, int (*pred)(rlnode*
 
 
 
+/**
+	@defgroup rbtrees  Ordered trees
+	@brief  An intrusive red-black tree, ordered by an integer key.
+
+	An @c rbnode is embedded in an object, just like an @c rlnode, and it 
+	carries the key by which the tree is ordered. Nodes with equal keys are 
+	kept in the order of insertion, so a tree can serve as a priority queue 
+	that is FIFO among equals. Insertion and removal take O(log n) time, 
+	and the first (smallest) node is found in O(1) time.
+
+	For example, to keep TCBs ordered by deadline:
+	@code
+	rbtree tree;
+	rbtree_init(&tree);
+
+	rbnode_init(& tcb->node, tcb);
+	tcb->node.key = deadline;
+	rbtree_insert(&tree, & tcb->node);
+	...
+	TCB* first = rbtree_first(&tree)->tcb;
+	rbtree_remove(&tree, rbtree_first(&tree));
+	@endcode
+
+	@{
+ */
+
+/**
+	@brief Ordered tree node
+*/
+typedef struct rb_tree_node {
+  /** @brief The object of the node, as in @c rlnode */
+  union {
+    PCB*  pcb; 
+    TCB*  tcb;
+    void* obj;
+    intptr_t num;
+    uintptr_t unum;
+  };
+  uint64_t key;                  /**< @brief The key by which the tree is ordered */
+  struct rb_tree_node* parent;   /**< @brief The parent, or NULL at the root */
+  struct rb_tree_node* left;     /**< @brief The left child (smaller keys) */
+  struct rb_tree_node* right;    /**< @brief The right child (larger or equal keys) */
+  int red;                       /**< @brief The color of the node */
+} rbnode;
+
+/**
+	@brief Ordered tree
+*/
+typedef struct rb_tree {
+  rbnode* root;    /**< @brief The root node, or NULL if empty */
+  rbnode* first;   /**< @brief The node with the smallest key, or NULL if empty */
+  size_t size;     /**< @brief The number of nodes in the tree */
+} rbtree;
+
+/** @brief Initialize an empty tree. */
+static inline void rbtree_init(rbtree* tree) 
+{ 
+	tree->root = tree->first = NULL; 
+	tree->size = 0; 
+}
+
+/** @brief Initialize a tree node to point to an object. */
+static inline rbnode* rbnode_init(rbnode* node, void* obj)
+{
+	node->obj = obj;
+	node->parent = node->left = node->right = NULL;
+	node->red = 0;
+	return node;
+}
+
+/** @brief Return true if the tree is empty. */
+static inline int is_rbtree_empty(rbtree* tree) { return tree->root == NULL; }
+
+/** @brief Return the node with the smallest key, or NULL if the tree is empty. */
+static inline rbnode* rbtree_first(rbtree* tree) { return tree->first; }
+
+/** 
+	@brief Return the next node in key order, or NULL. 
+
+	This can be used to traverse a tree, starting from @c rbtree_first().
+*/
+rbnode* rbtree_next(rbnode* node);
+
+/**
+	@brief Insert a node into a tree.
+
+	The node is placed according to its @c key, after all the nodes with 
+	an equal key. The node must not be in any tree.
+*/
+void rbtree_insert(rbtree* tree, rbnode* node);
+
+/**
+	@brief Remove a node from a tree.
+
+	The node must be in this tree. Its @c key must not have changed since
+	it was inserted.
+*/
+void rbtree_remove(rbtree* tree, rbnode* node);
+
+/* @} rbtrees */
+
+
+
 /*
 	Some helpers for packing and unpacking vectors of strings into
 	(argl, args)
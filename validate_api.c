@@ -476,6 +476,38 @@ BOOT_TEST(test_cond_timedwait_broadcast,
 }
 
 
+BOOT_TEST(test_cond_signal_yield,
+	"Test that Cond_SignalYield wakes up waiters, in turns between two threads."
+	)
+{
+	Mutex m = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	int turn = 0;
+	const int N = 1000;
+
+	int player(int argl, void* args)
+	{
+		for(int i=0; i<N; i++) {
+			Mutex_Lock(&m);
+			while(turn != argl) Cond_Wait(&m, &cv);
+			turn = 1-argl;
+			Mutex_Unlock(&m);
+			Cond_SignalYield(&cv);
+		}
+		return 0;
+	}
+
+	Tid_t t0 = CreateThread(player, 0, NULL);
+	Tid_t t1 = CreateThread(player, 1, NULL);
+	ASSERT(ThreadJoin(t0, NULL)==0);
+	ASSERT(ThreadJoin(t1, NULL)==0);
+
+	/* Signalling with no waiters does nothing */
+	Cond_SignalYield(&cv);
+	return 0;
+}
+
+
 
 /*********************************************
  *
@@ -865,6 +897,202 @@ BOOT_TEST(test_write_to_many_terminals,
 
 
 
+BOOT_TEST(test_info_accounting,
+	"Test that the information stream returns every process, with the cpu time "
+	"and the context switches of each process, and that GetCoreTimes returns "
+	"the times of the cores."
+	)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	/* Use some cpu time, and block a few times */
+	fibo(27);
+	Mutex_Lock(&mx);
+	for(int i=0; i<3; i++)
+		Cond_TimedWait(&mx, &cv, 10);
+	Mutex_Unlock(&mx);
+
+	Fid_t finfo = OpenInfo();
+	ASSERT(finfo != NOFILE);
+
+	procinfo info;
+	int found = 0;
+	while(Read(finfo, (char*)&info, sizeof(info)) == sizeof(info)) {
+		if(info.pid != GetPid()) continue;
+		found = 1;
+		ASSERT(info.alive);
+		ASSERT(info.prio >= 0);
+		ASSERT(info.run_time > 0);
+		ASSERT(info.vol_switches >= 3);
+	}
+	ASSERT(found);
+	ASSERT(Close(finfo)==0);
+
+	unsigned long busy[MAX_CORES], idle[MAX_CORES];
+	unsigned long total_busy = 0, total_idle = 0;
+	ASSERT(GetCoreTimes(NULL, NULL, 0) == cpu_cores());
+	ASSERT(GetCoreTimes(busy, idle, MAX_CORES) == cpu_cores());
+	for(unsigned int c=0; c<cpu_cores(); c++) {
+		total_busy += busy[c];
+		total_idle += idle[c];
+	}
+	ASSERT(total_busy > 0);
+	ASSERT(total_idle > 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_thread_info,
+	"Test that the thread information stream returns every thread of the "
+	"process, with the accounting of each thread."
+	)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	int done = 0;
+
+	int task(int argl, void* args) {
+		fibo(20);
+		return 0;
+	}
+
+	/* One thread exits, the other sleeps until we are done */
+	int sleeper(int argl, void* args) {
+		Mutex_Lock(&mx);
+		while(! done)
+			Cond_Wait(&mx, &cv);
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+
+	Tid_t t1 = CreateThread(task, 0, NULL);
+	Tid_t t2 = CreateThread(sleeper, 0, NULL);
+	ASSERT(t1!=NOTHREAD);
+	ASSERT(t2!=NOTHREAD);
+
+	/* Let the first thread run to completion */
+	fibo(20);
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 50);
+	Mutex_Unlock(&mx);
+
+	Fid_t finfo = OpenThreadInfo();
+	ASSERT(finfo != NOFILE);
+	ASSERT(Write(finfo, "x", 1)==-1);
+
+	threadinfo info;
+	int mains = 0, found1 = 0, found2 = 0;
+	while(Read(finfo, (char*)&info, sizeof(info)) == sizeof(info)) {
+		if(info.pid != GetPid()) continue;
+		ASSERT(info.last_core < cpu_cores());
+		if(info.is_main) {
+			mains++;
+			ASSERT(! info.exited);
+			ASSERT(info.run_time > 0);
+			ASSERT(info.vol_switches >= 1);
+		}
+		if(info.tid == t1) {
+			found1 = 1;
+			ASSERT(info.exited);
+			ASSERT(info.run_time > 0);
+		}
+		if(info.tid == t2) {
+			found2 = 1;
+			ASSERT(! info.exited);
+			ASSERT(info.vol_switches >= 1);
+		}
+	}
+	ASSERT(Close(finfo)==0);
+	ASSERT(mains == 1);
+	ASSERT(found1 && found2);
+
+	Mutex_Lock(&mx);
+	done = 1;
+	Cond_Broadcast(&cv);
+	Mutex_Unlock(&mx);
+	ASSERT(ThreadJoin(t1, NULL)==0);
+	ASSERT(ThreadJoin(t2, NULL)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_sched_stats,
+	"Test that the scheduler statistics stream returns the latency and run "
+	"queue histograms, and that it is read-only."
+	)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	/* Sleep on a timeout a few times, so that there are wakeups */
+	Mutex_Lock(&mx);
+	for(int i=0; i<3; i++)
+		Cond_TimedWait(&mx, &cv, 10);
+	Mutex_Unlock(&mx);
+
+	Fid_t fstats = OpenSchedStats();
+	ASSERT(fstats != NOFILE);
+	ASSERT(Write(fstats, "x", 1)==-1);
+
+	char report[8192];
+	int len = 0, n;
+	while((n = Read(fstats, report+len, 100)) > 0) {
+		len += n;
+		ASSERT(len < sizeof(report)-100);
+	}
+	report[len] = 0;
+	ASSERT(Close(fstats)==0);
+
+	ASSERT(strstr(report, "Wakeup latency (usec) by core") != NULL);
+	ASSERT(strstr(report, "Run queue length") != NULL);
+	/* Our timed waits were counted under cause user */
+	ASSERT(strstr(report, " user") != NULL);
+#ifdef LOCK_PROFILE
+	/* The lock profile is appended */
+	ASSERT(strstr(report, "Lock contention") != NULL);
+	ASSERT(strstr(report, "proc_lock") != NULL);
+#endif
+	return 0;
+}
+
+
+static int nice_child(int argl, void* args)
+{
+	Fid_t finfo = OpenInfo();
+	procinfo info;
+	int nice = 100;
+	while(Read(finfo, (char*)&info, sizeof(info)) == sizeof(info))
+		if(info.pid == GetPid()) nice = info.nice;
+	Close(finfo);
+	return nice;
+}
+
+BOOT_TEST(test_set_nice,
+	"Test that SetNice checks its arguments, and that the nice value is "
+	"reported by the information stream and inherited by children."
+	)
+{
+	ASSERT(SetNice(NOPROC, NICE_MIN-1)==-1);
+	ASSERT(SetNice(NOPROC, NICE_MAX+1)==-1);
+	ASSERT(SetNice(-5, 0)==-1);
+	ASSERT(SetNice(MAX_PROC, 0)==-1);
+	ASSERT(SetNice(GetPid()+100, 0)==-1);
+
+	ASSERT(SetNice(NOPROC, 7)==0);
+	int status;
+	Pid_t child = Exec(nice_child, 0, NULL);
+	ASSERT(WaitChild(child, &status)==child);
+	ASSERT(status == 7);
+
+	ASSERT(SetNice(GetPid(), NICE_MIN)==0);
+	child = Exec(nice_child, 0, NULL);
+	ASSERT(WaitChild(child, &status)==child);
+	ASSERT(status == NICE_MIN);
+	return 0;
+}
+
+
 TEST_SUITE(basic_tests, 
 	"A suite of basic tests, focusing on the functional behaviour of the\n"
 	"tinyos3 API, but not the operational (concurrency and I/O multiplexing)."
@@ -883,6 +1111,7 @@ TEST_SUITE(basic_tests,
 	&test_cond_timedwait_timeout,
 	&test_cond_timedwait_signal,
 	&test_cond_timedwait_broadcast,
+	&test_cond_signal_yield,
 	&test_null_device,
 	&test_get_terminals,
 	&test_open_terminals,
@@ -901,6 +1130,10 @@ TEST_SUITE(basic_tests,
 	&test_write_error_on_bad_fid,
 	&test_write_to_many_terminals,
 	&test_child_inherits_files,
+	&test_info_accounting,
+	&test_thread_info,
+	&test_sched_stats,
+	&test_set_nice,
 	NULL
 };
 
@@ -966,8 +1199,375 @@ BOOT_TEST(test_exit_many_threads,
 }
 
 
+BOOT_TEST(test_join_exited_thread,
+	"Test that a thread that has already exited can be joined, and that "
+	"the join returns the value passed to ThreadExit or returned by the task."
+	)
+{
+	int task(int argl, void* args) {
+		return 2;
+	}
+
+	int exit_task(int argl, void* args) {
+		ThreadExit(3);
+		return 4;
+	}
+
+	Tid_t t1 = CreateThread(task, 0, NULL);
+	Tid_t t2 = CreateThread(exit_task, 0, NULL);
+	ASSERT(t1!=NOTHREAD);
+	ASSERT(t2!=NOTHREAD);
+
+	/* Give both threads the time to exit */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 100);
+	Mutex_Unlock(&mx);
+
+	int exitval = 0;
+	ASSERT(ThreadJoin(t1, &exitval)==0);
+	ASSERT(exitval==2);
+	ASSERT(ThreadJoin(t2, &exitval)==0);
+	ASSERT(exitval==3);
+	return 0;
+}
+
+
+
+BOOT_TEST(test_create_thread_stack,
+	"Test that threads can be created with a given stack size, and that a "
+	"thread can use a large stack."
+	)
+{
+	int task(int argl, void* args) {
+		/* Use most of the stack */
+		volatile char buf[argl];
+		for(int i=0; i<argl; i+=1024) buf[i] = (char)i;
+		int sum = 0;
+		for(int i=0; i<argl; i+=1024) sum += buf[i];
+		return sum;
+	}
+
+	int exitval;
+	Tid_t t = CreateThreadStack(task, 3*1024*1024, NULL, 4*1024*1024);
+	ASSERT(t!=NOTHREAD);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+
+	/* A small stack is raised to the minimum size */
+	t = CreateThreadStack(task, 4*1024, NULL, 100);
+	ASSERT(t!=NOTHREAD);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+
+	/* A stack size of 0 is the default size */
+	t = CreateThreadStack(task, 64*1024, NULL, 0);
+	ASSERT(t!=NOTHREAD);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+
+	ASSERT(CreateThreadStack(task, 0, NULL, 0xFFFFFFFFu)==NOTHREAD);
+	return 0;
+}
+
+
+
+
+static int edf_second(int argl, void* args)
+{
+	return SetDeadline(2000, 10000, 10000);
+}
+
+BOOT_TEST(test_set_deadline,
+	"Test that SetDeadline checks its parameters and the utilization of the cores, "
+	"and that a deadline thread counts its periods."
+	)
+{
+	deadline_info info;
+	ASSERT(GetDeadlineInfo(&info)==-1);
+
+	/* Bad parameters */
+	ASSERT(SetDeadline(0, 10000, 10000)==-1);
+	ASSERT(SetDeadline(6000, 10000, 5000)==-1);
+	ASSERT(SetDeadline(5000, 10000, 20000)==-1);
+
+	/* Too much utilization for any core */
+	ASSERT(SetDeadline(9500, 10000, 10000)==-1);
+	ASSERT(GetDeadlineInfo(&info)==-1);
+
+	/* Run a few periods */
+	ASSERT(SetDeadline(1000, 10000, 5000)==0);
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	for(int i=0;i<10;i++) {
+		fibo(15);
+		Cond_TimedWait(&mx, &cv, 10);
+	}
+	Mutex_Unlock(&mx);
+
+	ASSERT(GetDeadlineInfo(&info)==0);
+	ASSERT(info.jobs >= 5);
+	ASSERT(info.misses <= info.jobs);
+	ASSERT(info.core < cpu_cores());
+
+	/* Change the parameters: the old utilization is given back first */
+	ASSERT(SetDeadline(8000, 10000, 10000)==0);
+
+	/* Another 20% fits only on another core */
+	int rc;
+	Tid_t t = CreateThread(edf_second, 0, NULL);
+	ASSERT(ThreadJoin(t, &rc)==0);
+	ASSERT(rc == ((cpu_cores()>1) ? 0 : -1));
+
+	/* Back to normal */
+	ASSERT(SetDeadline(0, 0, 0)==0);
+	t = CreateThread(edf_second, 0, NULL);
+	ASSERT(ThreadJoin(t, &rc)==0);
+	ASSERT(rc == 0);
+	return 0;
+}
+
+
+static Mutex affinity_mx = MUTEX_INIT;
+static CondVar affinity_go = COND_INIT;
+static int affinity_pinned;
+
+static int affinity_worker(int argl, void* args)
+{
+	/* Do not exit before we are pinned */
+	Mutex_Lock(&affinity_mx);
+	while(! affinity_pinned)
+		Cond_Wait(&affinity_mx, &affinity_go);
+	Mutex_Unlock(&affinity_mx);
+
+	fibo(20);
+	return argl;
+}
+
+BOOT_TEST(test_thread_affinity,
+	"Test that SetThreadAffinity checks its arguments, and that pinned threads run."
+	)
+{
+	core_mask_t last = (core_mask_t)1 << (cpu_cores()-1);
+
+	/* Bad masks */
+	ASSERT(SetThreadAffinity(NOTHREAD, 0)==-1);
+	if(cpu_cores() < 32)
+		ASSERT(SetThreadAffinity(NOTHREAD, (core_mask_t)1 << cpu_cores())==-1);
 
+	/* Move the current thread around */
+	ASSERT(SetThreadAffinity(NOTHREAD, last)==0);
+	fibo(15);
+	ASSERT(SetThreadAffinity(ThreadSelf(), 1)==0);
+	fibo(15);
+	ASSERT(SetThreadAffinity(NOTHREAD, CORE_MASK_ALL)==0);
+
+	/* Pin threads to each core, or to every core but one */
+	Tid_t t[8];
+	affinity_pinned = 0;
+	for(int i=0;i<8;i++) {
+		t[i] = CreateThread(affinity_worker, i, NULL);
+		core_mask_t mask = (core_mask_t)1 << (i % cpu_cores());
+		if(i & 1) mask = (cpu_cores()>1) ? ~mask : mask;
+		ASSERT(SetThreadAffinity(t[i], mask)==0);
+	}
+	Mutex_Lock(&affinity_mx);
+	affinity_pinned = 1;
+	Cond_Broadcast(&affinity_go);
+	Mutex_Unlock(&affinity_mx);
+	for(int i=0;i<8;i++) {
+		int rc;
+		ASSERT(ThreadJoin(t[i], &rc)==0);
+		ASSERT(rc == i);
+	}
 
+	return 0;
+}
+
+
+static volatile uint32_t futex_word;
+
+static int futex_sleeper(int argl, void* args)
+{
+	int woken = 0;
+	while(futex_word == 0)
+		if(FutexWait(&futex_word, 0)==0) woken++;
+	return woken;
+}
+
+static Mutex futex_mx = MUTEX_INIT;
+static int futex_count;
+
+static int futex_locker(int argl, void* args)
+{
+	for(int i=0; i<100; i++) {
+		Mutex_Lock(&futex_mx);
+		int c = futex_count;
+		fibo(12);
+		futex_count = c+1;
+		Mutex_Unlock(&futex_mx);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_futex,
+	"Test that FutexWait sleeps only on the expected value, that FutexWake wakes "
+	"the sleepers, and that contended mutexes stay exclusive."
+	)
+{
+	/* Wrong value, or no sleepers */
+	futex_word = 0;
+	ASSERT(FutexWait(&futex_word, 1)==-1);
+	ASSERT(FutexWake(&futex_word, 1)==0);
+
+	/* Wake up a sleeper */
+	Tid_t t = CreateThread(futex_sleeper, 0, NULL);
+	fibo(25);
+	futex_word = 1;
+	FutexWake(&futex_word, 1);
+	int woken;
+	ASSERT(ThreadJoin(t, &woken)==0);
+	ASSERT(woken <= 1);
+
+	/* Contended mutex */
+	Tid_t lk[8];
+	futex_count = 0;
+	for(int i=0;i<8;i++)
+		lk[i] = CreateThread(futex_locker, 0, NULL);
+	for(int i=0;i<8;i++)
+		ASSERT(ThreadJoin(lk[i], NULL)==0);
+	ASSERT(futex_count == 800);
+
+	return 0;
+}
+
+
+static Mutex handoff_mx = MUTEX_INIT;
+static int handoff_count;
+
+static int handoff_locker(int argl, void* args)
+{
+	for(int i=0; i<2000; i++) {
+		Mutex_Lock(&handoff_mx);
+		handoff_count++;
+		fibo(8+argl);
+		Mutex_Unlock(&handoff_mx);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_mutex_handoff,
+	"Test that a waiter that goes to sleep just as the holder unlocks a mutex "
+	"is not left asleep, by handing the mutex between two threads many times."
+	)
+{
+	Tid_t t[2];
+	handoff_count = 0;
+	for(int i=0;i<2;i++)
+		t[i] = CreateThread(handoff_locker, i, NULL);
+	for(int i=0;i<2;i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	ASSERT(handoff_count == 4000);
+	return 0;
+}
+
+
+static RwLock rw_lock = RWLOCK_INIT;
+static int rw_a, rw_b, rw_bad;
+
+static int rw_worker(int argl, void* args)
+{
+	for(int i=0; i<200; i++) {
+		if(argl && i%10==0) {
+			RwLock_WriteLock(&rw_lock);
+			rw_a++;
+			fibo(10);
+			rw_b++;
+			RwLock_Unlock(&rw_lock);
+		} else {
+			RwLock_ReadLock(&rw_lock);
+			int a = rw_a;
+			fibo(10);
+			if(a != rw_b) rw_bad++;
+			RwLock_Unlock(&rw_lock);
+		}
+	}
+	return 0;
+}
+
+BOOT_TEST(test_rwlock,
+	"Test that readers of an RwLock never see a writer's update half-done."
+	)
+{
+	Tid_t t[8];
+	rw_a = rw_b = rw_bad = 0;
+	for(int i=0;i<8;i++)
+		t[i] = CreateThread(rw_worker, i & 1, NULL);
+	for(int i=0;i<8;i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+
+	ASSERT(rw_bad == 0);
+	ASSERT(rw_a == 4*20 && rw_b == 4*20);
+	ASSERT(rw_lock.state == 0 && rw_lock.writers == 0);
+	return 0;
+}
+
+
+static Semaphore sem_slots = SEMAPHORE_INIT(2);
+static int sem_inside, sem_max;
+
+static int sem_worker(int argl, void* args)
+{
+	for(int i=0; i<50; i++) {
+		Semaphore_Wait(&sem_slots);
+		int in = __atomic_add_fetch(&sem_inside, 1, __ATOMIC_SEQ_CST);
+		if(in > sem_max) sem_max = in;
+		fibo(8);
+		__atomic_sub_fetch(&sem_inside, 1, __ATOMIC_SEQ_CST);
+		Semaphore_Post(&sem_slots);
+	}
+	return 0;
+}
+
+static Barrier bar = BARRIER_INIT(4);
+static int bar_arrivals, bar_early, bar_last;
+
+static int bar_worker(int argl, void* args)
+{
+	for(int round=1; round<=20; round++) {
+		fibo(5+argl);
+		__atomic_add_fetch(&bar_arrivals, 1, __ATOMIC_SEQ_CST);
+		if(Barrier_Wait(&bar)) 
+			__atomic_add_fetch(&bar_last, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&bar_arrivals, __ATOMIC_SEQ_CST) < 4*round)
+			bar_early++;
+	}
+	return 0;
+}
+
+BOOT_TEST(test_semaphore_barrier,
+	"Test that a semaphore admits at most its count, and that no thread passes a "
+	"barrier before the others arrive."
+	)
+{
+	Tid_t t[8];
+	sem_inside = sem_max = 0;
+	for(int i=0;i<8;i++)
+		t[i] = CreateThread(sem_worker, 0, NULL);
+	for(int i=0;i<8;i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	ASSERT(sem_max >= 1 && sem_max <= 2);
+	ASSERT(sem_slots.count == 2);
+
+	bar_arrivals = bar_early = bar_last = 0;
+	for(int i=0;i<4;i++)
+		t[i] = CreateThread(bar_worker, 3*i, NULL);
+	for(int i=0;i<4;i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	ASSERT(bar_early == 0);
+	ASSERT(bar_last == 20);
+	ASSERT(bar.arrived == 0 && bar.round == 20);
+	return 0;
+}
 
 
 TEST_SUITE(thread_tests, 
@@ -976,6 +1576,14 @@ TEST_SUITE(thread_tests,
 {
 	&test_create_join_thread,
 	&test_exit_many_threads,
+	&test_join_exited_thread,
+	&test_create_thread_stack,
+	&test_set_deadline,
+	&test_thread_affinity,
+	&test_futex,
+	&test_mutex_handoff,
+	&test_rwlock,
+	&test_semaphore_barrier,
 	NULL
 };
 